@@ -0,0 +1,355 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Builds a synthetic library of 1000 artists, 10 albums each and 100 
+ * songs per album (1M files) in memory, and measures how much memory it 
+ * takes and how long directory and full path lookups take. The previous 
+ * layout, one heap allocated object per directory holding its full path, 
+ * is reproduced here so both can be compared on the same machine.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <malloc.h>
+#include <boost/filesystem/path.hpp>
+#include "directory_tree.h"
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t artist_count = 1000;
+constexpr size_t albums_per_artist = 10;
+constexpr size_t songs_per_album = 100;
+constexpr size_t lookup_count = 200000;
+
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+	++allocations;
+	if(void* ptr = std::malloc(size))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+// Big blocks are mmapped, they're not part of uordblks
+size_t heap_in_use()
+{
+	auto info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+}
+
+// The per directory object layout, kept only for comparison purposes.
+class legacy_directory : public std::enable_shared_from_this<legacy_directory> {
+public:
+	using ptr = std::shared_ptr<const legacy_directory>;
+	using path_type = boost::filesystem::path;
+
+	legacy_directory(path_type full_path)
+	: m_path(std::move(full_path)), m_loaded(false)
+	{
+		m_name = m_path.end();
+		--m_name;
+	}
+
+	const path_type& name() const
+	{
+		return *m_name;
+	}
+
+	const path_type& path() const
+	{
+		return m_path;
+	}
+
+	std::vector<ptr> directories() const
+	{
+		std::lock_guard<std::mutex> _(m_mutex);
+		return m_directories;
+	}
+
+	void populate(const std::vector<std::string>& directories, 
+		const std::vector<std::string>& files) const
+	{
+		std::lock_guard<std::mutex> _(m_mutex);
+		for(const auto& name : directories)
+			m_directories.push_back(std::make_shared<legacy_directory>(m_path / name));
+		m_files.insert(m_files.end(), files.begin(), files.end());
+		std::sort(
+			m_directories.begin(), 
+			m_directories.end(),
+			[](const ptr& lhs, const ptr& rhs) {
+				return lhs->name() < rhs->name();
+			}
+		);
+		std::sort(m_files.begin(), m_files.end());
+		m_loaded = true;
+	}
+
+	ptr find_directory(path_type::iterator start, path_type::iterator end) const
+	{
+		if(start == end)
+			return shared_from_this();
+		ptr child;
+		{
+			std::lock_guard<std::mutex> _(m_mutex);
+			auto iter = std::lower_bound(
+				m_directories.begin(),
+				m_directories.end(),
+				*start,
+				[](const ptr& dir, const path_type& name) {
+					return dir->name() < name;
+				}
+			);
+			if(iter == m_directories.end() || (*iter)->name() != *start)
+				throw std::runtime_error("path not found");
+			child = *iter;
+		}
+		++start;
+		return child->find_directory(start, end);
+	}
+private:
+	path_type m_path;
+	path_type::iterator m_name;
+	mutable std::vector<ptr> m_directories;
+	mutable std::vector<std::string> m_files;
+	mutable std::mutex m_mutex;
+	mutable bool m_loaded;
+};
+
+class legacy_sharing_manager {
+public:
+	legacy_sharing_manager(const std::string& shared_dir)
+	: m_root(std::make_shared<legacy_directory>(""))
+	{
+		m_root->populate({ shared_dir }, {});
+	}
+
+	legacy_directory::ptr root() const
+	{
+		return m_root->directories()[0];
+	}
+
+	legacy_directory::ptr find_directory(const std::string& shared_path) const
+	{
+		legacy_directory::path_type dir_path(shared_path);
+		return m_root->find_directory(dir_path.begin(), dir_path.end());
+	}
+
+	std::string find_full_path(const std::string& shared_path) const
+	{
+		legacy_directory::path_type dir_path(shared_path);
+		auto end = dir_path.begin();
+		++end;
+		auto dir = m_root->find_directory(dir_path.begin(), end);
+		auto path = dir->path();
+		while(end != dir_path.end()) {
+			path /= *end;
+			++end;
+		}
+		return path.string();
+	}
+private:
+	legacy_directory::ptr m_root;
+};
+
+std::string artist_name(size_t artist)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "Artist %04zu", artist);
+	return buffer;
+}
+
+std::string album_name(size_t album)
+{
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "Album %02zu", album);
+	return buffer;
+}
+
+std::string song_name(size_t artist, size_t album, size_t song)
+{
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%02zu - Song %07zu.mp3", song + 1,
+		(artist * albums_per_artist + album) * songs_per_album + song);
+	return buffer;
+}
+
+std::vector<std::string> artist_names()
+{
+	std::vector<std::string> output;
+	for(size_t i = 0; i < artist_count; ++i)
+		output.push_back(artist_name(i));
+	return output;
+}
+
+std::vector<std::string> album_names()
+{
+	std::vector<std::string> output;
+	for(size_t i = 0; i < albums_per_artist; ++i)
+		output.push_back(album_name(i));
+	return output;
+}
+
+std::vector<std::string> song_names(size_t artist, size_t album)
+{
+	std::vector<std::string> output;
+	for(size_t i = 0; i < songs_per_album; ++i)
+		output.push_back(song_name(artist, album, i));
+	return output;
+}
+
+struct lookup {
+	std::string directory;
+	std::string file;
+};
+
+std::vector<lookup> make_lookups()
+{
+	std::mt19937 generator(42);
+	std::vector<lookup> output;
+	for(size_t i = 0; i < lookup_count; ++i) {
+		size_t artist = generator() % artist_count;
+		size_t album = generator() % albums_per_artist;
+		size_t song = generator() % songs_per_album;
+		auto dir = "library/" + artist_name(artist) + "/" + album_name(album);
+		output.push_back(lookup{dir, dir + "/" + song_name(artist, album, song)});
+	}
+	return output;
+}
+
+struct result {
+	double build_ms;
+	double heap_mb;
+	size_t allocations;
+	double find_directory_ns;
+	double find_full_path_ns;
+};
+
+template<typename Function>
+double elapsed_ns(Function function)
+{
+	auto start = clock_type::now();
+	function();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		clock_type::now() - start
+	).count();
+}
+
+// Returns the amount of bytes and allocations build_function needed
+template<typename Function>
+void measure_build(result& output, Function build_function)
+{
+	size_t heap_before = heap_in_use(), allocations_before = allocations;
+	output.build_ms = elapsed_ns(build_function) / 1e6;
+	output.heap_mb = (heap_in_use() - heap_before) / (1024.0 * 1024.0);
+	output.allocations = allocations - allocations_before;
+}
+
+result run_legacy(const std::vector<lookup>& lookups)
+{
+	result output;
+	std::unique_ptr<legacy_sharing_manager> manager;
+	measure_build(output, [&]() {
+		manager.reset(new legacy_sharing_manager("/media/library"));
+		auto root = manager->root();
+		root->populate(artist_names(), {});
+		auto artists = root->directories();
+		for(size_t i = 0; i < artists.size(); ++i) {
+			artists[i]->populate(album_names(), {});
+			auto albums = artists[i]->directories();
+			for(size_t j = 0; j < albums.size(); ++j)
+				albums[j]->populate({}, song_names(i, j));
+		}
+	});
+	size_t found = 0;
+	output.find_directory_ns = elapsed_ns([&]() {
+		for(const auto& entry : lookups)
+			found += manager->find_directory(entry.directory)->path().size();
+	}) / lookups.size();
+	output.find_full_path_ns = elapsed_ns([&]() {
+		for(const auto& entry : lookups)
+			found += manager->find_full_path(entry.file).size();
+	}) / lookups.size();
+	if(found == 0)
+		std::cout << "Nothing found" << std::endl;
+	return output;
+}
+
+result run_tree(const std::vector<lookup>& lookups)
+{
+	result output;
+	std::unique_ptr<directory_tree> tree;
+	measure_build(output, [&]() {
+		tree.reset(new directory_tree({ "/media/library" }));
+		auto root = tree->root().directories()[0];
+		tree->populate(root, artist_names(), {});
+		auto artists = root.directories();
+		for(size_t i = 0; i < artists.size(); ++i) {
+			tree->populate(artists[i], album_names(), {});
+			auto albums = artists[i].directories();
+			for(size_t j = 0; j < albums.size(); ++j)
+				tree->populate(albums[j], {}, song_names(i, j));
+		}
+	});
+	size_t found = 0;
+	output.find_directory_ns = elapsed_ns([&]() {
+		for(const auto& entry : lookups)
+			found += tree->find_directory(entry.directory).is_valid();
+	}) / lookups.size();
+	output.find_full_path_ns = elapsed_ns([&]() {
+		for(const auto& entry : lookups)
+			found += tree->find_full_path(entry.file).size();
+	}) / lookups.size();
+	if(found == 0)
+		std::cout << "Nothing found" << std::endl;
+	return output;
+}
+
+void print(const std::string& name, const result& res)
+{
+	std::cout << std::left << std::setw(16) << name << std::right << std::fixed 
+			  << std::setprecision(1)
+			  << std::setw(10) << res.build_ms << " ms build"
+			  << std::setw(10) << res.heap_mb << " MB"
+			  << std::setw(10) << res.allocations << " allocations"
+			  << std::setw(8) << res.find_directory_ns << " ns find_directory"
+			  << std::setw(8) << res.find_full_path_ns << " ns find_full_path" 
+			  << std::endl;
+}
+
+int main()
+{
+	const auto lookups = make_lookups();
+	print("per directory", run_legacy(lookups));
+	print("directory_tree", run_tree(lookups));
+}
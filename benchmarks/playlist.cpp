@@ -0,0 +1,224 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Builds a 100k songs playlist and measures deleting, inserting and 
+ * moving songs at random positions, as well as jumping to random songs. 
+ * The previous layout, a vector of songs plus a vector holding the play 
+ * order, is reproduced here so both can be compared on the same machine. 
+ * It never supported inserting or moving, so those are done the way it 
+ * would have had to.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "playlist.h"
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t playlist_size = 100000;
+constexpr size_t edit_count = 10000;
+constexpr size_t lookup_count = 100000;
+
+// The vector based layout, kept only for comparison purposes.
+class legacy_playlist {
+public:
+	legacy_playlist()
+	: m_current_index()
+	{
+
+	}
+
+	void add_songs(std::vector<song> songs)
+	{
+		for(auto& item : songs) {
+			m_songs.push_back(std::move(item));
+			m_songs_order.push_back(m_songs.size() - 1);
+		}
+	}
+
+	bool insert_songs(size_t index, std::vector<song> songs)
+	{
+		for(size_t i = 0; i < songs.size(); ++i)
+			insert_song(std::move(songs[i]), index + i);
+		return true;
+	}
+
+	bool delete_songs(const std::vector<size_t>& indexes)
+	{
+		for(auto iter = indexes.rbegin(); iter != indexes.rend(); ++iter)
+			delete_song(*iter);
+		return true;
+	}
+
+	bool move_song(size_t from, size_t to)
+	{
+		song item = m_songs[from];
+		delete_song(from);
+		insert_song(std::move(item), to);
+		return true;
+	}
+
+	bool set_current_index(size_t index)
+	{
+		if(index >= m_songs.size() || index == m_current_index)
+			return false;
+		m_current_index = index;
+		return true;
+	}
+
+	int current_index() const
+	{
+		if(m_current_index == m_songs.size())
+			return -1;
+		return m_songs_order[m_current_index];
+	}
+
+	size_t song_count() const
+	{
+		return m_songs.size();
+	}
+private:
+	void insert_song(song item, size_t index)
+	{
+		size_t position = m_songs_order.size();
+		for(size_t i = 0; i < m_songs_order.size(); ++i) {
+			if(m_songs_order[i] == index)
+				position = i;
+			if(m_songs_order[i] >= index)
+				m_songs_order[i]++;
+		}
+		m_songs.insert(m_songs.begin() + index, std::move(item));
+		m_songs_order.insert(m_songs_order.begin() + position, index);
+		if(position <= m_current_index && m_current_index != m_songs.size() - 1)
+			m_current_index++;
+	}
+
+	void delete_song(size_t index)
+	{
+		size_t to_delete = 0;
+		for(size_t i = 0; i < m_songs_order.size(); ++i) {
+			if(m_songs_order[i] == index)
+				to_delete = i;
+			if(m_songs_order[i] > index)
+				m_songs_order[i]--;
+		}
+		m_songs.erase(m_songs.begin() + index);
+		m_songs_order.erase(m_songs_order.begin() + to_delete);
+		if(m_current_index > m_songs.size())
+			m_current_index = m_songs.size();
+		else if(index < m_current_index && m_current_index > 0)
+			m_current_index--;
+	}
+
+	std::vector<song> m_songs;
+	std::vector<unsigned int> m_songs_order;
+	size_t m_current_index;
+};
+
+struct result {
+	double build_ms;
+	double delete_us;
+	double insert_us;
+	double move_us;
+	double lookup_ns;
+};
+
+template<typename Function>
+double elapsed_ns(Function function)
+{
+	auto start = clock_type::now();
+	function();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		clock_type::now() - start
+	).count();
+}
+
+song make_song(size_t index)
+{
+	return song("library/Artist " + std::to_string(index % 1000) + "/Song " + 
+		std::to_string(index) + ".mp3");
+}
+
+template<typename Playlist>
+result run(Playlist& songs)
+{
+	result output;
+	std::mt19937 generator(42);
+	output.build_ms = elapsed_ns([&]() {
+		for(size_t i = 0; i < playlist_size; i += 100) {
+			std::vector<song> batch;
+			for(size_t j = i; j < i + 100; ++j)
+				batch.push_back(make_song(j));
+			songs.add_songs(std::move(batch));
+		}
+	}) / 1e6;
+	output.delete_us = elapsed_ns([&]() {
+		for(size_t i = 0; i < edit_count; ++i)
+			songs.delete_songs({ generator() % songs.song_count() });
+	}) / 1e3 / edit_count;
+	output.insert_us = elapsed_ns([&]() {
+		for(size_t i = 0; i < edit_count; ++i) {
+			const size_t index = generator() % (songs.song_count() + 1);
+			songs.insert_songs(index, { make_song(playlist_size + i) });
+		}
+	}) / 1e3 / edit_count;
+	output.move_us = elapsed_ns([&]() {
+		for(size_t i = 0; i < edit_count; ++i) {
+			const size_t from = generator() % songs.song_count();
+			songs.move_song(from, generator() % songs.song_count());
+		}
+	}) / 1e3 / edit_count;
+	long long total = 0;
+	output.lookup_ns = elapsed_ns([&]() {
+		for(size_t i = 0; i < lookup_count; ++i) {
+			songs.set_current_index(generator() % songs.song_count());
+			total += songs.current_index();
+		}
+	}) / lookup_count;
+	if(total == 0)
+		std::cout << "Nothing found" << std::endl;
+	return output;
+}
+
+void print(const std::string& name, const result& res)
+{
+	std::cout << std::left << std::setw(20) << name << std::right << std::fixed 
+			  << std::setprecision(2)
+			  << std::setw(10) << res.build_ms << " ms build"
+			  << std::setw(10) << res.delete_us << " us delete"
+			  << std::setw(10) << res.insert_us << " us insert"
+			  << std::setw(10) << res.move_us << " us move"
+			  << std::setw(10) << res.lookup_ns << " ns jump" 
+			  << std::endl;
+}
+
+int main()
+{
+	legacy_playlist legacy;
+	print("vectors", run(legacy));
+	playlist tree;
+	print("song_tree", run(tree));
+	playlist shuffled;
+	shuffled.playlist_mode(playlist::mode::random_order);
+	print("song_tree shuffled", run(shuffled));
+}
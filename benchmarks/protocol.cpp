@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Measures the per request protocol overhead: decoding a request, finding 
+ * its command, building the reply and encoding it, for both encodings. 
+ * Each path does the same work core::callback and session::reply do, 
+ * the commands themselves are replaced by the replies they'd build. 
+ * Heap allocations are counted by replacing the global operator new.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <map>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <jsoncpp/json/reader.h>
+#include <jsoncpp/json/writer.h>
+#include "msgpack.h"
+
+using clock_type = std::chrono::steady_clock;
+using reply_builder = Json::Value (*)();
+
+constexpr size_t iterations = 200000;
+
+static size_t allocation_count = 0;
+
+void* operator new(size_t size)
+{
+	++allocation_count;
+	if(void* output = std::malloc(size ? size : 1))
+		return output;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+struct result {
+	double ns;
+	double allocations;
+	size_t request_bytes;
+	size_t reply_bytes;
+};
+
+// Stands in for core's command tables
+static const std::map<std::string, int> commands = {
+	{ "next_song", 0 }, { "previous_song", 0 }, { "playlist_mode", 0 },
+	{ "set_playlist_mode", 0 }, { "playlist_delta", 0 }, { "clear_playlist", 0 },
+	{ "pause", 0 }, { "play", 0 }, { "add_shared_songs", 0 }, { "new_events", 0 },
+	{ "player_status", 0 }, { "delete_songs", 0 }, { "insert_songs", 0 },
+	{ "move_song", 0 }, { "batch", 0 }, { "set_current_song", 0 },
+	{ "add_youtube_songs", 0 }, { "underrun_stats", 0 },
+};
+
+static Json::Value player_status_reply()
+{
+	Json::Value output(Json::objectValue);
+	output["result"] = true;
+	output["status"] = "playing";
+	output["current_song_percent"] = 37.5;
+	output["playlist_mode"] = "default";
+	return output;
+}
+
+static Json::Value success_reply()
+{
+	Json::Value output(Json::objectValue);
+	output["result"] = true;
+	return output;
+}
+
+static std::string msgpack_request(const std::string& type, const Json::Value& params)
+{
+	std::string body;
+	msgpack_writer writer(body);
+	writer.begin_map(params.isNull() ? 1 : 2);
+	writer.write_string("type");
+	writer.write_string(type);
+	if(!params.isNull()) {
+		writer.write_string("params");
+		writer.write(params);
+	}
+	return body;
+}
+
+template<typename Function>
+result measure(Function function)
+{
+	result output{};
+	size_t total = 0;
+	const size_t allocations = allocation_count;
+	auto start = clock_type::now();
+	for(size_t i = 0; i < iterations; ++i)
+		total += function();
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		clock_type::now() - start
+	).count();
+	output.ns = double(elapsed) / iterations;
+	output.allocations = double(allocation_count - allocations) / iterations;
+	output.reply_bytes = total / iterations;
+	return output;
+}
+
+result run_json(const std::string& line, reply_builder build_reply)
+{
+	auto output = measure([&]() -> size_t {
+		Json::Value root;
+		Json::Reader reader;
+		if(!reader.parse(line.data(), line.data() + line.size(), root) || !root.isMember("type"))
+			std::abort();
+		std::string type = root["type"].asString();
+		Json::Value params;
+		params.swap(root["params"]);
+		if(commands.find(type) == commands.end())
+			std::abort();
+		Json::FastWriter writer;
+		auto data = std::make_shared<std::string>(writer.write(build_reply()));
+		return data->size();
+	});
+	output.request_bytes = line.size() + 1;
+	return output;
+}
+
+result run_msgpack(const std::string& frame, reply_builder build_reply)
+{
+	auto output = measure([&]() -> size_t {
+		std::string type;
+		Json::Value params;
+		if(!read_msgpack_request(frame.data(), frame.size(), type, params))
+			std::abort();
+		if(commands.find(type) == commands.end())
+			std::abort();
+		auto data = std::make_shared<std::string>(msgpack_frame(build_reply()));
+		return data->size();
+	});
+	output.request_bytes = frame.size() + msgpack_frame_header_size;
+	return output;
+}
+
+void print(const std::string& name, const result& res)
+{
+	std::cout << std::left << std::setw(28) << name << std::right << std::fixed 
+			  << std::setprecision(1)
+			  << std::setw(10) << res.ns << " ns"
+			  << std::setw(8) << res.allocations << " allocations"
+			  << std::setw(6) << res.request_bytes << " B request"
+			  << std::setw(6) << res.reply_bytes << " B reply"
+			  << std::endl;
+}
+
+int main()
+{
+	Json::Value set_song_params(Json::objectValue);
+	set_song_params["timestamp"] = 1234567;
+	set_song_params["index"] = 42;
+	Json::FastWriter writer;
+	Json::Value set_song(Json::objectValue);
+	set_song["type"] = "set_current_song";
+	set_song["params"] = set_song_params;
+	std::string set_song_line = writer.write(set_song);
+	set_song_line.pop_back();
+
+	print("json player_status", run_json("{\"type\":\"player_status\"}", player_status_reply));
+	print("msgpack player_status", 
+		run_msgpack(msgpack_request("player_status", Json::Value()), player_status_reply));
+	print("json set_current_song", run_json(set_song_line, success_reply));
+	print("msgpack set_current_song", 
+		run_msgpack(msgpack_request("set_current_song", set_song_params), success_reply));
+}
@@ -0,0 +1,69 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Pushes a fixed amount of samples from a producer thread to a consumer
+ * thread as fast as possible and reports the decode buffer's throughput.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include "ring_buffer.h"
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t buffer_size = 8192;
+constexpr size_t chunk_samples = 1152 * 2;
+constexpr size_t period_samples = 1024;
+constexpr size_t total_samples = size_t(1) << 28;
+
+double run(spsc_ring_buffer<short>& buffer)
+{
+	auto start = clock_type::now();
+	std::thread producer([&]() {
+		std::vector<short> chunk(chunk_samples, 1);
+		for(size_t i = 0; i < total_samples / chunk_samples; ++i)
+			buffer.put(chunk.begin(), chunk.end());
+	});
+	std::vector<short> output(period_samples);
+	size_t read = 0;
+	const size_t expected = (total_samples / chunk_samples) * chunk_samples;
+	// Whatever is left after this fits in the buffer, so the producer 
+	// won't block.
+	while(read + period_samples <= expected)
+		read += buffer.get(output.begin(), output.size());
+	producer.join();
+	std::chrono::duration<double> elapsed = clock_type::now() - start;
+	return read / elapsed.count();
+}
+
+void print(const std::string& name, double samples_per_second)
+{
+	std::cout << std::left << std::setw(28) << name
+			  << std::right << std::setw(12) << std::fixed
+			  << std::setprecision(1) << samples_per_second / 1e6
+			  << " Msamples/s" << std::endl;
+}
+
+int main()
+{
+	spsc_ring_buffer<short> buffer(buffer_size);
+	print("spsc_ring_buffer", run(buffer));
+}
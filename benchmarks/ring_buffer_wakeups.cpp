@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Measures how often the decode (producer) thread wakes up and how long
+ * it takes to start refilling the buffer after the playback callback
+ * (consumer) frees space. The old sleep-polling strategy is reproduced
+ * here so both can be compared on the same machine.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "ring_buffer.h"
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr size_t buffer_size = 8192;
+// 512 stereo frames, as requested by a typical PortAudio callback
+constexpr size_t period_samples = 1024;
+// One decoded MP3 frame
+constexpr size_t chunk_samples = 1152 * 2;
+
+// The sleep-polling buffer, kept only for comparison purposes.
+template<typename T, size_t n>
+class polling_ring_buffer {
+public:
+	template<typename InputIterator>
+	bool put(InputIterator start, InputIterator end)
+	{
+		size_t size = std::distance(start, end);
+		while(size != 0) {
+			while(m_available == n - 1) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			size_t back = m_back;
+			size_t amount = std::min(size, n - 1 - m_available);
+			for(size_t i = 0; i < amount; ++i)
+				m_buffer[(back + m_available + i) % n] = *start++;
+			m_available += amount;
+			size -= amount;
+		}
+		return true;
+	}
+
+	template<typename OutputIterator>
+	void get(OutputIterator output, size_t count, T default_value = T())
+	{
+		if(m_available < count) {
+			std::fill(output, output + count, default_value);
+			return;
+		}
+		size_t back = m_back;
+		for(size_t i = 0; i < count; ++i)
+			*output++ = m_buffer[(back + i) % n];
+		m_back = (back + count) % n;
+		m_available -= count;
+	}
+private:
+	std::array<T, n> m_buffer;
+	std::atomic<size_t> m_back{0}, m_available{0};
+};
+
+long voluntary_switches()
+{
+	rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_nvcsw;
+}
+
+struct result {
+	double wakeups_per_second;
+	double refill_latency_us;
+};
+
+/*
+ * Runs a producer that decodes as fast as it can against a consumer that
+ * either drains one period every ~11.6ms ("playing") or does nothing at
+ * all ("paused").
+ */
+template<typename Buffer>
+result run(Buffer& buffer, bool playing, std::chrono::milliseconds duration)
+{
+	std::atomic<bool> running(true);
+	std::atomic<long> wakeups(0);
+	std::atomic<clock_type::rep> last_get(0);
+	double latency_total = 0;
+	size_t latency_samples = 0;
+
+	std::thread producer([&]() {
+		std::vector<short> chunk(chunk_samples, 1);
+		long start_switches = voluntary_switches();
+		while(running) {
+			auto before = clock_type::now();
+			buffer.put(chunk.begin(), chunk.end());
+			auto after = clock_type::now();
+			// Only puts that had to wait for space tell us something
+			// about how fast we react to the consumer.
+			if(after - before > std::chrono::microseconds(500) && last_get != 0) {
+				auto freed_at = clock_type::time_point(
+					clock_type::duration(last_get.load())
+				);
+				auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+					after - freed_at
+				);
+				if(latency.count() >= 0) {
+					latency_total += latency.count();
+					++latency_samples;
+				}
+			}
+		}
+		wakeups = voluntary_switches() - start_switches;
+	});
+
+	std::vector<short> output(period_samples);
+	auto end = clock_type::now() + duration;
+	while(clock_type::now() < end) {
+		if(playing) {
+			buffer.get(output.begin(), period_samples);
+			last_get = clock_type::now().time_since_epoch().count();
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(11610));
+	}
+	running = false;
+	// Let the producer leave put() if it's stuck on a full buffer
+	std::vector<short> drain(buffer_size);
+	auto join_deadline = clock_type::now() + std::chrono::seconds(1);
+	std::thread drainer([&]() {
+		while(clock_type::now() < join_deadline) {
+			buffer.get(drain.begin(), period_samples);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	});
+	producer.join();
+	drainer.join();
+
+	double seconds = duration.count() / 1000.0;
+	result output_result;
+	output_result.wakeups_per_second = wakeups / seconds;
+	output_result.refill_latency_us = latency_samples ?
+		latency_total / latency_samples : 0;
+	return output_result;
+}
+
+void print(const std::string& name, const result& res)
+{
+	std::cout << std::left << std::setw(28) << name
+			  << std::right << std::setw(12) << std::fixed
+			  << std::setprecision(1) << res.wakeups_per_second
+			  << " wakeups/s"
+			  << std::setw(12) << res.refill_latency_us
+			  << " us refill latency" << std::endl;
+}
+
+int main()
+{
+	const auto duration = std::chrono::milliseconds(3000);
+	{
+		polling_ring_buffer<short, buffer_size> buffer;
+		print("polling, paused", run(buffer, false, duration));
+	}
+	{
+		spsc_ring_buffer<short> buffer(buffer_size);
+		print("blocking, paused", run(buffer, false, duration));
+	}
+	{
+		polling_ring_buffer<short, buffer_size> buffer;
+		print("polling, playing", run(buffer, true, duration));
+	}
+	{
+		spsc_ring_buffer<short> buffer(buffer_size);
+		print("blocking, playing", run(buffer, true, duration));
+	}
+}
@@ -0,0 +1,100 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_ARTWORK_STORE_H
+#define SHAPLIM_ARTWORK_STORE_H
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <functional>
+
+std::string base64_encode(const std::string& data);
+
+class artwork {
+public:
+	artwork(std::string mime, std::string data, std::string thumbnail);
+
+	const std::string& mime() const;
+	const std::string& data() const;
+	// Falls back to the full picture if it's already small or it couldn't
+	// be scaled down.
+	const std::string& thumbnail() const;
+	const std::string& thumbnail_mime() const;
+	bool has_thumbnail() const;
+private:
+	std::string m_mime, m_data, m_thumbnail, m_thumbnail_mime;
+};
+
+/*
+ * Cover art, keyed by a hash of its contents so every track in an album
+ * shares the same picture. Raw bytes are kept; encoding happens only 
+ * when a client asks for a picture. If a directory is set, pictures are 
+ * stored there, so ids stay valid across restarts and pictures nobody is
+ * using are dropped from memory.
+ */
+class artwork_store {
+public:
+	using artwork_ptr = std::shared_ptr<const artwork>;
+	// Sources are only dropped once they can't have the picture anymore,
+	// not when they just can't be read right now
+	enum class read_result {
+		found,
+		missing,
+		unavailable
+	};
+	// Reads the picture embedded in a song
+	using reader_type = std::function<read_result(const std::string&, std::string&, 
+		std::string&)>;
+
+	static artwork_store instance;
+	static constexpr int thumbnail_size = 128;
+
+	void set_directory(const std::string& path);
+	void set_reader(reader_type reader);
+	// Returns the picture's id
+	std::string add(std::string mime, std::string data);
+	// Returns null if there's no picture with this id
+	artwork_ptr find(const std::string& id);
+	bool contains(const std::string& id);
+	// Records a song that embeds the picture with this id. If the picture
+	// isn't around when it's looked up, it's read again from that song.
+	void add_source(const std::string& id, std::string song_path);
+private:
+	using locker_type = std::lock_guard<std::mutex>;
+
+	// Only one of them is set, depending on whether there's a directory
+	struct entry {
+		artwork_ptr picture;
+		std::weak_ptr<const artwork> weak_picture;
+	};
+
+	artwork_ptr find_loaded(const std::string& id);
+	artwork_ptr find_stored(const std::string& id);
+	void store(const std::string& id, const artwork_ptr& picture);
+	artwork_ptr load(const std::string& id);
+	void save(const std::string& id, const artwork& picture);
+
+	std::map<std::string, entry> m_artwork;
+	std::map<std::string, std::string> m_sources;
+	reader_type m_reader;
+	std::string m_directory;
+	std::mutex m_lock;
+};
+
+#endif // SHAPLIM_ARTWORK_STORE_H
@@ -0,0 +1,83 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_CONFIGURATION_H
+#define SHAPLIM_CONFIGURATION_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+class configuration {
+public:
+	using shared_dirs_list = std::vector<std::string>;
+
+	configuration();
+
+	bool load(const std::string& file_path);
+
+	const shared_dirs_list& shared_directories() const;
+	unsigned sample_rate() const;
+	std::chrono::milliseconds buffer_latency() const;
+	unsigned buffer_low_water_percent() const;
+	size_t prefetch_songs() const;
+	std::chrono::seconds prefetch_length() const;
+	// Empty if metadata shouldn't be persisted
+	const std::string& metadata_cache() const;
+	size_t metadata_threads() const;
+	// Empty if pictures should only be kept in memory
+	const std::string& artwork_directory() const;
+	bool index_on_startup() const;
+	size_t index_threads() const;
+	size_t index_operations_per_second() const;
+	bool watch_directories() const;
+	std::chrono::milliseconds watch_coalesce_delay() const;
+	size_t command_threads() const;
+	// Threads running the control server
+	size_t io_threads() const;
+	// Events kept for clients polling with new_events
+	size_t event_log_size() const;
+	// Zero if events are only dropped by count
+	std::chrono::seconds event_log_max_age() const;
+
+	// The largest power of two amount of samples that holds at most 
+	// buffer_latency() worth of audio
+	size_t decode_buffer_size() const;
+	// Amount of samples needed to hold prefetch_length() worth of audio
+	size_t prefetch_buffer_size() const;
+private:
+	shared_dirs_list m_shared_dirs;
+	unsigned m_sample_rate;
+	std::chrono::milliseconds m_buffer_latency;
+	unsigned m_buffer_low_water_percent;
+	size_t m_prefetch_songs;
+	std::chrono::seconds m_prefetch_length;
+	std::string m_metadata_cache;
+	size_t m_metadata_threads;
+	std::string m_artwork_directory;
+	bool m_index_on_startup;
+	size_t m_index_threads;
+	size_t m_index_operations_per_second;
+	bool m_watch_directories;
+	std::chrono::milliseconds m_watch_coalesce_delay;
+	size_t m_command_threads;
+	size_t m_io_threads;
+	size_t m_event_log_size;
+	std::chrono::seconds m_event_log_max_age;
+};
+
+#endif // SHAPLIM_CONFIGURATION_H
@@ -20,6 +20,7 @@
 
 #include <jsoncpp/json/value.h>
 #include <map>
+#include <set>
 #include <functional>
 #include <vector>
 #include <string>
@@ -35,18 +36,30 @@
 #include "sharing_manager.h"
 #include "event_manager.h"
 #include "song_database.h"
+#include "configuration.h"
+#include "prefetcher.h"
+#include "metadata_fetcher.h"
+#include "artwork_store.h"
+#include "library_indexer.h"
+#include "directory_watcher.h"
+#include "search_index.h"
+#include "worker_pool.h"
 
 class core {
 public:
-	using shared_dirs_list = std::vector<std::string>;
-
-	core(const shared_dirs_list& shared_dirs = shared_dirs_list());
+	core(const configuration& config);
 
 	void run();
 	void stop();
 private:
 	using command_type = std::function<Json::Value(core*, const Json::Value&)>;
-	using time_point = event_manager::time_point;
+	using async_command_type = std::function<
+		void(core*, const Json::Value&, session::reply_type)
+	>;
+	using session_command_type = std::function<
+		Json::Value(core*, session&, const Json::Value&)
+	>;
+	using sequence_type = event_manager::sequence_type;
 	enum class playlist_actions {
 		none,
 		next,
@@ -54,37 +67,83 @@ private:
 	};
 
 	void decode_loop();
-	Json::Value callback(session& sess, std::string data);
+	void run_io_service();
+	void callback(session& sess, session::encoding_type encoding, const char* data, 
+		size_t size, session::reply_type reply);
 
 	// Commands
 	Json::Value add_songs(const Json::Value& params);
-	Json::Value next_song(const Json::Value&);
-	Json::Value previous_song(const Json::Value&);
-	Json::Value playlist_mode(const Json::Value&);
+	Json::Value next_song(const Json::Value& params);
+	Json::Value previous_song(const Json::Value& params);
+	Json::Value playlist_mode(const Json::Value& params);
 	Json::Value set_playlist_mode(const Json::Value& params);
 	Json::Value set_current_song(const Json::Value& params);
-	Json::Value show_playlist(const Json::Value& params);
-	Json::Value clear_playlist(const Json::Value&);
+	Json::Value playlist_delta(const Json::Value& params);
+	Json::Value clear_playlist(const Json::Value& params);
 	Json::Value pause(const Json::Value&);
 	Json::Value play(const Json::Value&);
-	Json::Value player_status(const Json::Value&);
+	Json::Value player_status(const Json::Value& params);
 	Json::Value new_events(const Json::Value& params);
 	Json::Value delete_songs(const Json::Value& params);
+	Json::Value insert_songs(const Json::Value& params);
+	Json::Value move_song(const Json::Value& params);
+	Json::Value batch(const Json::Value& params);
+	Json::Value underrun_stats(const Json::Value&);
+	// Playlist command bodies, m_playlist_mutex should be locked when 
+	// calling these
+	Json::Value next_song_unlocked(const Json::Value&);
+	Json::Value previous_song_unlocked(const Json::Value&);
+	Json::Value playlist_mode_unlocked(const Json::Value&);
+	Json::Value set_playlist_mode_unlocked(const Json::Value& params);
+	Json::Value set_current_song_unlocked(const Json::Value& params);
+	Json::Value playlist_delta_unlocked(const Json::Value& params);
+	Json::Value clear_playlist_unlocked(const Json::Value&);
+	Json::Value player_status_unlocked(const Json::Value&);
+	Json::Value delete_songs_unlocked(const Json::Value& params);
+	Json::Value insert_songs_unlocked(const Json::Value& params);
+	Json::Value move_song_unlocked(const Json::Value& params);
+	Json::Value add_shared_songs_unlocked(const Json::Value& params);
+	Json::Value add_youtube_songs_unlocked(const Json::Value& params);
 	// Sharing commands
 	Json::Value list_shared_dirs(const Json::Value&);
 	Json::Value list_directory(const Json::Value& params);
 	Json::Value add_shared_songs(const Json::Value& params);
 	Json::Value add_youtube_songs(const Json::Value& params);
-	Json::Value song_info(const Json::Value& params);
+	Json::Value artwork(const Json::Value& params);
+	Json::Value indexer_status(const Json::Value&);
+	Json::Value search(const Json::Value& params);
+	// Asynchronous commands
+	void song_info(const Json::Value& params, session::reply_type reply);
+	void show_playlist(const Json::Value& params, session::reply_type reply);
+	// Commands that act on the session itself
+	Json::Value subscribe(session& sess, const Json::Value& params);
+	Json::Value set_encoding(session& sess, const Json::Value& params);
 
 	static std::map<std::string, command_type> m_commands;
+	static std::map<std::string, command_type> m_unlocked_commands;
+	static std::map<std::string, command_type> m_pooled_commands;
+	static std::map<std::string, async_command_type> m_async_commands;
+	static std::map<std::string, session_command_type> m_session_commands;
+	Json::Value run_command(const command_type& command, const Json::Value& params);
 	Json::Value json_success() const;
 	Json::Value json_error(std::string error_msg) const;
 
-	bool is_index_still_valid(const time_point& timestamp, size_t index);
+	bool is_index_still_valid(sequence_type timestamp, size_t index);
 
 	void execute_next_action();
-	event_manager::time_point time_point_from_json(const Json::Value& value);
+	void stop_decoding();
+	void update_prefetch();
+	float percent_so_far();
+	sequence_type sequence_from_json(const Json::Value& value);
+	Json::Value event_range_to_json(const event_manager::event_range& range);
+	Json::Value change_to_json(const playlist::change& a_change);
+	Json::Value read_playlist_delta(const Json::Value& params, 
+		playlist::snapshot_source& source);
+	Json::Value complete_playlist_delta(const Json::Value& params, Json::Value output, 
+		const playlist::snapshot_source& source);
+	playlist::snapshot_ptr publish_snapshot(const playlist::snapshot_source& source);
+	void add_song_fields(Json::Value& output, const song_information& info, 
+		const std::set<std::string>& fields);
 
 	boost::asio::io_service m_io_service;
 	server m_server;
@@ -94,12 +153,30 @@ private:
 	decoder m_decoder;
 	playback_manager m_playback;
 	sharing_manager m_sharing_manager;
+	search_index m_search_index;
+	std::unique_ptr<directory_watcher> m_watcher;
+	prefetcher m_prefetcher;
+	metadata_fetcher m_metadata_fetcher;
+	library_indexer m_indexer;
+	worker_pool m_command_pool;
 	std::thread m_decode_thread;
-	playlist_actions m_next_action;
+	std::atomic<playlist_actions> m_next_action;
 	event_manager m_event_manager;
+	// Batches hold it while running the _unlocked command bodies
 	std::mutex m_playlist_mutex;
+	// Set while an atomic batch runs, stop_decoding and update_prefetch 
+	// then wait for it to commit. All of them are guarded by m_playlist_mutex.
+	bool m_in_atomic_batch;
+	bool m_stop_deferred;
+	bool m_prefetch_deferred;
+	// The newest snapshot built, for paging through it. Only accessed 
+	// through std::atomic_load and std::atomic_compare_exchange_weak.
+	playlist::snapshot_ptr m_snapshot;
 	std::condition_variable m_playlist_cond;
 	std::atomic<bool> m_running;
+	const size_t m_songs_to_prefetch;
+	const bool m_index_on_startup;
+	const size_t m_io_threads;
 };
 
 #endif // SHAPLIM_CORE_H
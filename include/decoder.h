@@ -31,14 +31,7 @@ public:
 		generic
 	};
 
-	decoder();
-
-	template<typename Functor>
-	void on_sample_rate_change(Functor callback) 
-	{
-		m_mp3_decoder.on_sample_rate_change(callback);
-		m_generic_decoder.on_sample_rate_change(callback);
-	}
+	decoder(unsigned sample_rate);
 
 	void decode(song_stream stream, types::decode_buffer_type& buffer, song_type type);
 	void stop_decode();
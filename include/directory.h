@@ -19,70 +19,73 @@
 #define SHAPLIM_DIRECTORY_H
 
 #include <string>
-#include <mutex>
-#include <set>
-#include <memory>
+#include <vector>
+#include <functional>
+#include <cstdint>
 #include <boost/filesystem/path.hpp>
+#include <boost/utility/string_ref.hpp>
 #include "music_file.h"
 
+class directory_tree;
+
+/*
+ * A directory inside a shared directory. This is just a handle to a node
+ * in a directory_tree, so it's cheap to copy. Contents are read the first
+ * time they're needed and can be patched afterwards when the filesystem 
+ * changes. Once a directory is removed from the tree, its handles are no
+ * longer valid and behave as if it was empty.
+ */
 class directory {
 public:
 	using directories_list = std::vector<directory>;
 	using files_list = std::vector<music_file>;
 	using path_type = boost::filesystem::path;
+	// Called right before a directory is read for the first time
+	using load_observer_type = std::function<void(const directory&)>;
+	enum class change_type {
+		file_added,
+		file_removed,
+		// Everything inside the directory at this path is gone
+		directory_removed
+	};
+	// Called with the full path of whatever changed, outside any lock
+	using change_observer_type = std::function<void(change_type, const std::string&)>;
 
-	directory(path_type full_path);
+	// Constructs an invalid handle
+	directory();
 
-	const path_type& name() const;
-	const path_type& path() const;
-	const directories_list& directories() const;
-	const files_list& files() const;
+	boost::string_ref name() const;
+	path_type path() const;
+	// These return a snapshot of the contents
+	directories_list directories() const;
+	files_list files() const;
 
 	void load() const;
-	std::string path_for_file(const std::string& file_name) const;
-	const directory& find_directory(path_type::iterator start, 
-		path_type::iterator end) const;
-private:
-	struct only_for_search{};
-
-	directory(path_type full_path, only_for_search);
-	template<typename InputIterator>
-	directory(InputIterator start, InputIterator end);
+	bool is_loaded() const;
+	bool is_valid() const;
+	// Brings the entry with this name in sync with the filesystem. Does 
+	// nothing if the directory hasn't been loaded yet.
+	void refresh_entry(const std::string& name) const;
+	// Forgets the contents, they're read again the next time they're used
+	void unload() const;
+	std::string path_for_file(boost::string_ref file_name) const;
+	// Components are separated by slashes
+	directory find_directory(boost::string_ref relative_path) const;
 
-	void add_directory(directory dir);
-	template<typename InputIterator>
-	friend directory make_virtual_directory(InputIterator start, 
-		InputIterator end);
+	static void set_load_observer(load_observer_type observer);
+	static void set_change_observer(change_observer_type observer);
 	static bool is_media_file(const std::string& extension);
+private:
+	friend class directory_tree;
 
-	path_type m_path;
-	boost::filesystem::path::iterator m_name;
-	mutable directories_list m_directories;
-	mutable files_list m_files;
-	mutable std::shared_ptr<std::mutex> m_mutex;
-	mutable bool m_loaded;
-};
-
-template<typename InputIterator>
-directory make_virtual_directory(InputIterator start, InputIterator end)
-{
-	return directory(std::move(start), std::move(end));
-}
+	directory(directory_tree* tree, uint32_t id, uint32_t generation);
 
-template<typename InputIterator>
-directory::directory(InputIterator start, InputIterator end)
-: m_mutex(new std::mutex())
-{
-	while(start != end) {
-		add_directory(directory(*start));
-		++start;
-	}
-	std::sort(m_directories.begin(), m_directories.end());
-	m_loaded = true;
-}
+	static load_observer_type load_observer;
+	static change_observer_type change_observer;
 
-bool operator<(const directory& lhs, const directory& rhs);
+	directory_tree* m_tree;
+	uint32_t m_id;
+	uint32_t m_generation;
+};
 
 #endif // SHAPLIM_DIRECTORY_H
-
-
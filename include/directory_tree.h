@@ -0,0 +1,111 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_DIRECTORY_TREE_H
+#define SHAPLIM_DIRECTORY_TREE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <boost/utility/string_ref.hpp>
+#include "directory.h"
+#include "music_file.h"
+#include "name_pool.h"
+
+/*
+ * Every shared directory and whatever has been loaded from them. Nodes 
+ * live in a single array and refer to each other by index. A node's 
+ * children and files are contiguous ranges of two other arrays, sorted 
+ * by name, and every name is interned so there's a single copy of it.
+ *
+ * The root node is a virtual directory whose children are the shared 
+ * directories. Shared directories store their full path as their name.
+ */
+class directory_tree {
+public:
+	using string_ref = boost::string_ref;
+
+	directory_tree(const std::vector<std::string>& shared_dirs);
+
+	directory root();
+	// Shared paths start with a shared directory's name
+	directory find_directory(string_ref shared_path);
+	std::string find_full_path(string_ref shared_path);
+	// Fills an unloaded directory without looking at the filesystem
+	void populate(const directory& dir, std::vector<std::string> directories, 
+		std::vector<std::string> files);
+private:
+	friend class directory;
+
+	using node_id = uint32_t;
+	using locker_type = std::lock_guard<std::mutex>;
+	using changes_list = std::vector<std::pair<directory::change_type, std::string>>;
+
+	struct node {
+		name_pool::name_ref name;
+		node_id parent;
+		uint32_t generation;
+		uint32_t first_child;
+		uint32_t child_count;
+		uint32_t first_file;
+		uint32_t file_count;
+		bool loaded;
+		bool alive;
+	};
+
+	static constexpr node_id root_id = 0;
+	static constexpr node_id no_node = UINT32_MAX;
+
+	// Used by directory
+	string_ref name(const directory& dir);
+	std::string path(const directory& dir);
+	directory::directories_list directories(const directory& dir);
+	directory::files_list files(const directory& dir);
+	void load(const directory& dir);
+	bool is_loaded(const directory& dir);
+	bool is_valid(const directory& dir);
+	void refresh_entry(const directory& dir, const std::string& name);
+	void unload(const directory& dir);
+	directory find_directory(const directory& dir, string_ref relative_path);
+
+	// These require the lock to be held
+	node* find_node(const directory& dir);
+	string_ref node_name(node_id id) const;
+	std::string node_path(node_id id) const;
+	// Where name is or would be inside the node's range
+	uint32_t child_position(const node& parent, string_ref name) const;
+	uint32_t file_position(const node& parent, string_ref name) const;
+	// Returns no_node if there's no such child
+	node_id find_child(const node& parent, string_ref name) const;
+	node_id allocate_node(name_pool::name_ref name, node_id parent);
+	void free_node(node_id id);
+	void free_children(node_id id);
+	void compact();
+
+	std::vector<node> m_nodes;
+	std::vector<node_id> m_children;
+	std::vector<music_file> m_files;
+	std::vector<node_id> m_free_nodes;
+	// Slots in m_children and m_files that no range uses anymore
+	size_t m_unused_children;
+	size_t m_unused_files;
+	name_pool m_names;
+	std::mutex m_mutex;
+};
+
+#endif // SHAPLIM_DIRECTORY_TREE_H
@@ -0,0 +1,66 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_DIRECTORY_WATCHER_H
+#define SHAPLIM_DIRECTORY_WATCHER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "directory.h"
+
+class song_database;
+
+/*
+ * Keeps loaded directories in sync with the filesystem using inotify. A 
+ * directory is watched as soon as it's loaded, so only the parts of the 
+ * tree somebody looked at cost anything. Events are collected until 
+ * things calm down, and then every affected entry is refreshed once.
+ */
+class directory_watcher {
+public:
+	directory_watcher(song_database& database, std::chrono::milliseconds coalesce_delay);
+	~directory_watcher();
+
+	void stop();
+private:
+	using locker_type = std::lock_guard<std::mutex>;
+	// Watch descriptor and entry name
+	using pending_entry = std::pair<int, std::string>;
+
+	void watch(const directory& dir);
+	void run();
+	void read_events(std::set<pending_entry>& pending);
+	void apply(const std::set<pending_entry>& pending);
+	void reload_everything();
+
+	song_database& m_database;
+	const std::chrono::milliseconds m_coalesce_delay;
+	std::map<int, directory> m_watches;
+	std::mutex m_mutex;
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	int m_inotify_fd;
+	int m_stop_fd;
+	bool m_reported_limit;
+};
+
+#endif // SHAPLIM_DIRECTORY_WATCHER_H
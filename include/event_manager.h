@@ -19,28 +19,98 @@
 #define SHAPLIM_EVENT_MANAGER_H
 
 #include <chrono>
-#include <map>
 #include <mutex>
-#include <tuple>
+#include <array>
+#include <deque>
 #include <vector>
 #include <memory>
 #include <string>
+#include <limits>
+#include <cstdint>
+#include <utility>
+#include <functional>
 #include <jsoncpp/json/value.h>
 
+enum class event_kind {
+	add_songs,
+	play_song,
+	delete_songs,
+	pause,
+	play,
+	playlist_mode_changed,
+	insert_songs,
+	move_song
+};
+
 class event {
 public:
-	event(std::shared_ptr<Json::Value> data);
+	event(event_kind kind, std::shared_ptr<Json::Value> data);
 
 	const Json::Value& json_data() const;
-	std::string event_type() const;
+	event_kind kind() const;
 private:
 	std::shared_ptr<const Json::Value> m_data;
+	event_kind m_kind;
 };
 
 class event_manager {
 public:
 	using clock_type = std::chrono::steady_clock;
-	using time_point = clock_type::time_point;
+	using sequence_type = uint64_t;
+	// An event encoded at most once per encoding, the first time a 
+	// subscriber asks for it
+	class serialized_event {
+	public:
+		serialized_event(const Json::Value& data);
+
+		// Newline terminated JSON object
+		const std::shared_ptr<const std::string>& json() const;
+		// msgpack frame
+		const std::shared_ptr<const std::string>& msgpack() const;
+	private:
+		const Json::Value& m_data;
+		mutable std::shared_ptr<const std::string> m_json;
+		mutable std::shared_ptr<const std::string> m_msgpack;
+	};
+	// Called without the lock held, one event at a time and in order, 
+	// from whichever thread is delivering events. Returning false 
+	// unsubscribes.
+	using subscriber_type = std::function<bool(const serialized_event&)>;
+
+	// The events after some sequence number
+	struct event_range {
+		std::vector<event> events;
+		// Where the next query should start from
+		sequence_type next;
+		// Some of the requested events were already dropped, or the 
+		// sequence number didn't come from this log
+		bool resync_required;
+	};
+
+	// Holds back the events added by the thread that created it, until 
+	// commit is called. If that doesn't happen, they're discarded.
+	class transaction {
+	public:
+		transaction(event_manager& manager);
+		transaction(const transaction&) = delete;
+		transaction& operator=(const transaction&) = delete;
+		~transaction();
+
+		void commit();
+	private:
+		friend class event_manager;
+
+		event_manager& m_manager;
+		std::vector<std::pair<event_kind, std::shared_ptr<Json::Value>>> m_events;
+		transaction* m_previous;
+	};
+
+	// Subscribing from here doesn't return any previous events
+	static constexpr sequence_type from_now = std::numeric_limits<sequence_type>::max();
+
+	// Events are dropped once there are more than max_events of them, or 
+	// when they're older than max_age. A zero max_age keeps them forever.
+	event_manager(size_t max_events, std::chrono::seconds max_age);
 
 	void add_songs_add_event(const std::vector<std::string>& songs);
 	void add_play_song_event(int index);
@@ -48,13 +118,52 @@ public:
 	void add_pause_event();
 	void add_play_event();
 	void add_playlist_mode_changed_event(std::string value);
+	void add_insert_songs_event(size_t index, const std::vector<std::string>& songs);
+	void add_move_song_event(size_t from, size_t to);
 
-	std::tuple<std::vector<event>, time_point> get_new_events(
-		time_point start_point);
-	std::vector<event> find_new_events(time_point start_point, 
-		const std::string& type);
+	// The sequence number the next event will get
+	sequence_type next_sequence();
+	event_range get_new_events(sequence_type start);
+	// Also includes the events held by the calling thread's transactions,
+	// since they'll come after every stored one.
+	event_range find_new_events(sequence_type start, event_kind kind);
+	// Returns the events since start, every event after those goes to subscriber.
+	event_range subscribe(subscriber_type subscriber, sequence_type start);
 private:
-	std::map<time_point, event> m_events;
+	struct entry {
+		sequence_type sequence;
+		clock_type::time_point time;
+		event data;
+	};
+	struct subscription {
+		subscriber_type callback;
+		// The first event it gets
+		sequence_type start;
+		// Only used by the delivering thread
+		bool active;
+	};
+	using subscription_ptr = std::shared_ptr<subscription>;
+	static constexpr size_t kind_count = 8;
+
+	void add_event(event_kind kind, std::shared_ptr<Json::Value> event_ptr);
+	void deliver();
+	void drop_old_events(clock_type::time_point now);
+	void drop_first_event();
+	entry& find_entry(sequence_type sequence);
+	event_range new_events(sequence_type start);
+
+	const size_t m_max_events;
+	const std::chrono::seconds m_max_age;
+	// A ring indexed by sequence number, holding [m_first, m_next)
+	std::vector<entry> m_events;
+	// The sequence numbers of each kind of event, in order
+	std::array<std::deque<sequence_type>, kind_count> m_kind_index;
+	sequence_type m_first;
+	sequence_type m_next;
+	std::vector<subscription_ptr> m_subscribers;
+	// Stored events that haven't been handed to the subscribers yet
+	std::vector<entry> m_undelivered;
+	bool m_delivering;
 	std::mutex m_mutex;
 };
 
@@ -20,7 +20,6 @@
 
 #include <memory>
 #include <atomic>
-#include <functional>
 #include "types.h"
 
 extern "C" {
@@ -28,23 +27,34 @@ extern "C" {
 }
 
 class song_stream;
+struct SwrContext;
 
+/*
+ * Decodes anything libavformat can handle. Every sample format, channel 
+ * layout and rate is converted to interleaved signed 16 bit stereo at
+ * the output sample rate.
+ */
 class generic_decoder {
 public:
-	generic_decoder();
+	generic_decoder(unsigned sample_rate);
 
 	void decode(song_stream stream, types::decode_buffer_type &buffer);
 	void stop_decode();
 	float percent_so_far();
-
-	template<typename Functor>
-	void on_sample_rate_change(Functor callback)
-	{
-		m_on_rate_change = std::move(callback);
-	}
 private:
-	std::function<void(long long)> m_on_rate_change;
+	bool convert(SwrContext* resampler, const uint8_t** input, int input_frames,
+		types::decode_buffer_type &buffer);
+	bool convert_directly(const AVFrame& frame, AVSampleFormat format, 
+		int channels, types::decode_buffer_type &buffer);
+	bool receive_frames(AVCodecContext* ctx, SwrContext* resampler, 
+		types::decode_buffer_type &buffer);
+
+	const unsigned m_sample_rate;
+	// Reused across packets and songs
+	std::shared_ptr<AVPacket> m_packet;
+	std::shared_ptr<AVFrame> m_frame;
 	std::atomic<bool> m_running;
+	std::atomic<float> m_percent;
 };
 
 #endif // SHAPLIM_GENERIC_DECODER_H
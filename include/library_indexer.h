@@ -0,0 +1,87 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_LIBRARY_INDEXER_H
+#define SHAPLIM_LIBRARY_INDEXER_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include "directory.h"
+
+class sharing_manager;
+class song_database;
+
+/*
+ * Walks every shared directory in the background, loading the directory
+ * tree and parsing every song's metadata so clients never have to wait 
+ * for the disk. Directory listings and parsed files are both limited to a
+ * number of operations per second, and workers use the idle IO class, 
+ * so playback always gets the disk first.
+ */
+class library_indexer {
+public:
+	enum class state {
+		idle,
+		running,
+		finished,
+		stopped
+	};
+
+	struct status {
+		state current_state;
+		uint64_t directories_indexed;
+		uint64_t pending_directories;
+		uint64_t files_found;
+		uint64_t files_indexed;
+	};
+
+	library_indexer(const sharing_manager& manager, song_database& database,
+		size_t thread_count, size_t operations_per_second);
+	~library_indexer();
+
+	void start();
+	void stop();
+	status current_status() const;
+private:
+	using clock_type = std::chrono::steady_clock;
+	using locker_type = std::unique_lock<std::mutex>;
+
+	void worker_loop();
+	void index(const directory& dir);
+	bool acquire_budget();
+
+	const sharing_manager& m_manager;
+	song_database& m_database;
+	const size_t m_thread_count;
+	const clock_type::duration m_operation_interval;
+	std::vector<std::thread> m_workers;
+	std::deque<directory> m_pending;
+	size_t m_active_workers;
+	clock_type::time_point m_next_operation;
+	status m_status;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
+
+const char* to_string(library_indexer::state value);
+
+#endif // SHAPLIM_LIBRARY_INDEXER_H
@@ -0,0 +1,65 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_METADATA_CACHE_H
+#define SHAPLIM_METADATA_CACHE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+class song_information;
+
+// Identifies a version of a file's contents
+struct file_stamp {
+	int64_t mtime;
+	uint64_t size;
+
+	static bool from_file(const std::string& path, file_stamp& output);
+
+	bool operator==(const file_stamp& rhs) const;
+	bool operator!=(const file_stamp& rhs) const;
+};
+
+struct cached_song_information {
+	file_stamp stamp;
+	std::shared_ptr<const song_information> info;
+};
+
+/*
+ * Append-only log of parsed song metadata, one JSON object per line. The 
+ * last line for a path wins. Entries are keyed by path and stamp, so they
+ * become stale as soon as the file changes.
+ */
+class metadata_cache {
+public:
+	using entries_type = std::map<std::string, cached_song_information>;
+
+	// Loads every entry in the file and keeps it open for appending
+	entries_type open(const std::string& file_path);
+	void append(const std::string& path, const cached_song_information& entry);
+	bool is_open() const;
+private:
+	bool rewrite(const entries_type& entries);
+
+	std::string m_file_path;
+	std::ofstream m_output;
+};
+
+#endif // SHAPLIM_METADATA_CACHE_H
@@ -0,0 +1,68 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_METADATA_FETCHER_H
+#define SHAPLIM_METADATA_FETCHER_H
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "song_database.h"
+
+/*
+ * Parses song metadata on a pool of worker threads. Requests for a path
+ * that's already being parsed wait for that same parse.
+ */
+class metadata_fetcher {
+public:
+	using info_ptr = song_database::info_ptr;
+	// Gets a null pointer if the file couldn't be parsed
+	using callback_type = std::function<void(info_ptr)>;
+	// Gets one pointer per requested path, in the same order
+	using batch_callback_type = std::function<void(std::vector<info_ptr>)>;
+
+	metadata_fetcher(song_database& database, size_t thread_count);
+	~metadata_fetcher();
+
+	// Calls callback right away if the information is cached, otherwise
+	// it's called on a worker thread.
+	void fetch(const std::string& path, callback_type callback);
+	// Calls callback once every path is available. Missing ones are all 
+	// queued at once, so they're parsed in parallel.
+	void fetch_all(const std::vector<std::string>& paths, batch_callback_type callback);
+	void stop();
+private:
+	using locker_type = std::unique_lock<std::mutex>;
+
+	void worker_loop();
+	void enqueue(const std::string& path, callback_type callback);
+
+	song_database& m_database;
+	std::map<std::string, std::vector<callback_type>> m_pending;
+	std::deque<std::string> m_queue;
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_running;
+};
+
+#endif // SHAPLIM_METADATA_FETCHER_H
@@ -21,7 +21,6 @@
 #include <array>
 #include <algorithm>
 #include <exception>
-#include <functional>
 #include <atomic>
 #include <mpg123.h>
 #include "types.h"
@@ -32,27 +31,19 @@ class ring_buffer;
 
 class mp3_decoder {
 public:
-	mp3_decoder();
+	mp3_decoder(unsigned sample_rate);
 
 	void decode(song_stream stream, types::decode_buffer_type &buffer);
 	void stop_decode();
 	float percent_so_far();
-
-	template<typename Functor>
-	void on_sample_rate_change(Functor callback)
-	{
-		m_on_rate_change = std::move(callback);
-	}
 private:
 	using handle_type = std::unique_ptr<mpg123_handle, decltype(&mpg123_delete)>;
-	using buffer_type = std::array<char, 4096>;
 	static constexpr size_t chunk_size = 4096;
 
 	void check_new_format();
 
 	handle_type m_handle;
-	buffer_type m_buffer;
-	std::function<void(long long)> m_on_rate_change;
+	const unsigned m_sample_rate;
 	std::atomic<off_t> m_total_size, m_start_offset, m_current_offset;
 	std::atomic<bool> m_running;
 };
@@ -0,0 +1,115 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_MSGPACK_H
+#define SHAPLIM_MSGPACK_H
+
+#include <string>
+#include <cstdint>
+#include <stdexcept>
+#include <boost/utility/string_ref.hpp>
+#include <jsoncpp/json/value.h>
+
+/*
+ * A small MessagePack codec for the binary protocol. Messages are framed 
+ * as a 32 bits big endian length followed by that many bytes holding a 
+ * single value. Only the types JSON can represent are supported; binary 
+ * strings are read as strings, extension types are rejected.
+ */
+
+class msgpack_error : public std::runtime_error {
+public:
+	msgpack_error(const std::string& message);
+};
+
+// Appends values to a string, no intermediate representation is built.
+class msgpack_writer {
+public:
+	msgpack_writer(std::string& output);
+
+	void write_nil();
+	void write_bool(bool value);
+	void write_int(int64_t value);
+	void write_uint(uint64_t value);
+	void write_double(double value);
+	void write_string(boost::string_ref value);
+	// Must be followed by size values
+	void begin_array(uint32_t size);
+	// Must be followed by size key/value pairs
+	void begin_map(uint32_t size);
+	void write(const Json::Value& value);
+private:
+	void write_header(uint8_t type, uint64_t value, size_t bytes);
+
+	std::string& m_output;
+};
+
+// Pulls values one at a time out of a buffer it doesn't own. Strings are 
+// returned as views into that buffer. Every function throws msgpack_error 
+// if the data is truncated or has an unexpected type.
+class msgpack_reader {
+public:
+	enum class value_type {
+		nil, boolean, integer, floating, string, array, map
+	};
+
+	msgpack_reader(const char* data, size_t size);
+
+	bool at_end() const;
+	value_type next_type() const;
+	void read_nil();
+	bool read_bool();
+	// Fails if the value doesn't fit
+	int64_t read_int();
+	uint64_t read_uint();
+	double read_double();
+	boost::string_ref read_string();
+	// The amount of values that follow
+	uint32_t read_array();
+	// The amount of key/value pairs that follow
+	uint32_t read_map();
+	void skip();
+	// Builds a DOM out of the next value, map keys must be strings
+	void read(Json::Value& output);
+
+	// Nested arrays and maps deeper than this are rejected
+	static constexpr size_t max_depth = 64;
+private:
+	uint8_t peek() const;
+	uint64_t read_big_endian(size_t bytes);
+	const char* consume(size_t bytes);
+	void skip(size_t depth);
+	void read(Json::Value& output, size_t depth);
+
+	const char* m_data;
+	const char* m_end;
+};
+
+// Frames larger than this are refused
+constexpr size_t msgpack_max_frame_size = 1 << 20;
+constexpr size_t msgpack_frame_header_size = 4;
+
+// The payload size in a frame header
+size_t msgpack_frame_size(const char* header);
+// Encodes a value as a single frame
+std::string msgpack_frame(const Json::Value& value);
+// Reads a frame's {"type": string, "params": any} request. Returns false 
+// if it's malformed.
+bool read_msgpack_request(const char* data, size_t size, std::string& type, 
+	Json::Value& params);
+
+#endif // SHAPLIM_MSGPACK_H
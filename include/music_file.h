@@ -18,15 +18,17 @@
 #ifndef SHAPLIM_MUSIC_FILE_H
 #define SHAPLIM_MUSIC_FILE_H
 
-#include <string>
+#include <boost/utility/string_ref.hpp>
+#include "name_pool.h"
 
+// The name is owned by the directory_tree the file belongs to
 class music_file {
 public:
-	music_file(std::string name);
+	music_file(name_pool::name_ref name);
 
-	const std::string& name() const;
+	boost::string_ref name() const;
 private:
-	std::string m_name;
+	name_pool::name_ref m_name;
 };
 
 bool operator<(const music_file& lhs, const music_file& rhs);
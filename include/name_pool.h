@@ -0,0 +1,75 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_NAME_POOL_H
+#define SHAPLIM_NAME_POOL_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <boost/utility/string_ref.hpp>
+
+/*
+ * Stores each distinct string once, packed into large chunks. Interned
+ * strings never move, so references to them stay valid for as long as
+ * the pool lives. Not thread safe.
+ */
+class name_pool {
+public:
+	// A string stored in a pool. The length is kept right before the 
+	// characters, so this is as big as a pointer.
+	class name_ref {
+	public:
+		// An empty string
+		name_ref();
+
+		boost::string_ref view() const;
+	private:
+		friend class name_pool;
+
+		name_ref(const char* entry);
+
+		const char* m_entry;
+	};
+
+	name_pool();
+
+	// Throws if the string is longer than max_length
+	name_ref intern(boost::string_ref name);
+	// The amount of distinct strings stored
+	size_t size() const;
+
+	static constexpr size_t max_length = 4096;
+private:
+	using length_type = uint16_t;
+	// Slots refer to entries by chunk index and offset inside the chunk
+	static constexpr size_t chunk_bits = 16;
+	static constexpr size_t chunk_size = size_t(1) << chunk_bits;
+	static constexpr uint32_t empty_slot = UINT32_MAX;
+
+	const char* entry_at(uint32_t location) const;
+	uint32_t store(boost::string_ref name);
+	void grow_slots();
+
+	std::vector<std::unique_ptr<char[]>> m_chunks;
+	size_t m_chunk_used;
+	// Open addressing table of entry locations
+	std::vector<uint32_t> m_slots;
+	size_t m_count;
+};
+
+#endif // SHAPLIM_NAME_POOL_H
@@ -20,25 +20,46 @@
 
 #include <memory>
 #include <atomic>
+#include <cstdint>
 #include <portaudio.h>
 #include "types.h"
 
 class playback_manager {
 public:
-	playback_manager(types::decode_buffer_type &buffer);
+	struct underrun_stats {
+		uint64_t underruns;
+		uint64_t frames;
+	};
+
+	playback_manager(types::decode_buffer_type &buffer, unsigned sample_rate);
 
-	void set_sample_rate(long rate);
 	bool play();
 	bool pause();
 	void stop();
 	bool is_stream_active() const;
+
+	// Called by the decoding thread right before it writes a song's first 
+	// samples and right after its last ones. Underruns are charged to the 
+	// song that's being played at the time, and only while it's playing.
+	void begin_song();
+	void end_song();
+	underrun_stats song_underruns() const;
+	underrun_stats total_underruns() const;
 private:
 	using handle_type = std::unique_ptr<PaStream, decltype(&Pa_CloseStream)>;
+	// Where a song's samples begin or end in the decode buffer
+	struct boundary {
+		size_t position;
+		bool begins;
+	};
+	static constexpr size_t max_boundaries = 64;
 
 	playback_manager(const playback_manager&) = delete;
 	playback_manager& operator=(const playback_manager&) = delete;
 
 	int callback(void *output_buffer, unsigned long frames_per_buffer);
+	void add_boundary(bool begins);
+	void apply_boundaries(size_t position);
 
 	static int proxy_callback(
 		const void *, 
@@ -55,8 +76,14 @@ private:
 	handle_type m_handle;
     PaStreamParameters m_params;
     types::decode_buffer_type &m_buffer;
-    unsigned m_current_rate;
+    // Added by the decoding thread, consumed by the callback
+    spsc_ring_buffer<boundary> m_boundaries;
     std::atomic<bool> m_playing;
+    std::atomic<uint64_t> m_song_underruns, m_song_short_frames;
+    std::atomic<uint64_t> m_total_underruns, m_total_short_frames;
+    // Only used by the callback
+    size_t m_song_start;
+    bool m_in_song, m_in_underrun;
 };
 
 #endif // SHAPLIM_PLAYBACK_MANAGER_H
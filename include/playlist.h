@@ -19,9 +19,14 @@
 #define SHAPLIM_PLAYLIST_H
 
 #include <vector>
+#include <deque>
 #include <random>
 #include <tuple>
+#include <memory>
+#include <functional>
+#include <cstdint>
 #include "song.h"
+#include "song_tree.h"
 
 class playlist {
 public:
@@ -30,15 +35,94 @@ public:
 		random_order
 	};
 
+	using version_type = uint64_t;
+
+	// A change to the song list, each one bumps the version by one
+	struct change {
+		enum class change_type {
+			add_songs,
+			insert_songs,
+			delete_songs,
+			move_song,
+			clear
+		};
+
+		change_type type;
+		// The songs added, for add_songs and insert_songs
+		std::vector<song> songs;
+		// Sorted indexes, as they were before deleting, for delete_songs
+		std::vector<size_t> indexes;
+		// Where songs were inserted, or where the song was moved from
+		size_t index;
+		// Where the song was moved to
+		size_t destination;
+	};
+	using change_ptr = std::shared_ptr<const change>;
+
+	// The songs as of a version. Never modified once handed out, so it can 
+	// be read without any locking.
+	struct snapshot {
+		version_type version;
+		std::vector<song> songs;
+	};
+	using snapshot_ptr = std::shared_ptr<const snapshot>;
+	// A snapshot and the changes that bring it up to date
+	struct snapshot_source {
+		snapshot_ptr base;
+		std::vector<change_ptr> changes;
+	};
+
+	/*
+	 * Logs how to undo every change made to the playlist while it's alive,
+	 * and undoes them in reverse order when it's destroyed unless commit() 
+	 * was called. The playlist shouldn't be used by anyone else meanwhile.
+	 */
+	class transaction {
+	public:
+		transaction(playlist& owner);
+		transaction(const transaction&) = delete;
+		transaction& operator=(const transaction&) = delete;
+		~transaction();
+
+		void commit();
+	private:
+		friend class playlist;
+
+		playlist& m_playlist;
+		std::vector<std::function<void()>> m_undo_log;
+		transaction* m_previous;
+	};
+
+	// Clients further behind than this need a whole snapshot
+	static constexpr size_t max_changes = 1024;
+
 	playlist();
+	playlist(const playlist&) = delete;
+	playlist& operator=(const playlist&) = delete;
 
-	void add_song(song a_song);
-	bool delete_song(size_t index);
-	const std::vector<song>& songs() const;
+	void add_songs(std::vector<song> songs);
+	// Inserts songs before the one at index
+	bool insert_songs(size_t index, std::vector<song> songs);
+	// Indexes must be sorted and unique, returns false otherwise or if any 
+	// of them is out of range
+	bool delete_songs(const std::vector<size_t>& indexes);
+	// Moves the song at from so that it ends up at index to
+	bool move_song(size_t from, size_t to);
+	// Doesn't copy any songs. latest, the newest snapshot built so far, 
+	// becomes the base if it's more recent than the current one.
+	snapshot_source prepare_snapshot(snapshot_ptr latest);
+	// Copies the base and applies the changes to it. Doesn't touch any 
+	// playlist, so it can be called without holding its lock.
+	static snapshot_ptr build_snapshot(const snapshot_source& source);
+	version_type version() const;
+	// Returns false if the changes after version are no longer kept
+	bool changes_since(version_type version, std::vector<change_ptr>& output) const;
 
 	void next();
 	void prev();
 	song current() const;
+	// The songs that will be played after the current one, in order.
+	std::vector<song> upcoming(size_t count) const;
 	bool has_current() const;
 	int current_index() const;
 	bool set_current_index(size_t index);
@@ -49,11 +133,26 @@ public:
 	size_t song_count() const;
 	bool empty() const;
 private:
-	std::vector<song> m_songs;
-	std::vector<unsigned int> m_songs_order;
+	using sequence = song_tree::sequence;
+
+	void insert_song(song a_song, size_t index);
+	song_tree::node_id current_node() const;
+	void add_change(change_ptr a_change);
+	// Only kept while there's a transaction
+	void log_undo(std::function<void()> action);
+	snapshot_ptr make_snapshot() const;
+
+	song_tree m_songs;
+	// Always has its changes after it kept in m_changes
+	snapshot_ptr m_base;
+	std::deque<change_ptr> m_changes;
+	version_type m_version;
 	std::mt19937 m_generator;
+	// Position of the current song in the play order, the amount of songs 
+	// if there's none
 	size_t m_current_index;
 	mode m_order;
+	transaction* m_transaction;
 };
 
 #endif // SHAPLIM_PLAYLIST_H
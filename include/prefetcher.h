@@ -0,0 +1,94 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_PREFETCHER_H
+#define SHAPLIM_PREFETCHER_H
+
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <tuple>
+#include <cstdint>
+#include "song.h"
+#include "song_stream.h"
+#include "decoder.h"
+#include "types.h"
+
+class sharing_manager;
+
+// Finds and opens the stream for a song.
+std::tuple<song_stream, decoder::song_type> open_song(const song& a_song, 
+	const sharing_manager& manager);
+
+/*
+ * Opens and decodes the beginning of the next songs in the playlist on
+ * worker threads, so that switching to them doesn't have to wait for 
+ * path resolution, probing or HTTP requests.
+ */
+class prefetcher {
+public:
+	prefetcher(const sharing_manager& manager, size_t songs_to_prefetch, 
+		size_t buffer_size, unsigned sample_rate);
+	~prefetcher();
+
+	// Starts preparing these songs, discarding any other prepared one.
+	void prefetch(const std::vector<song>& songs);
+	// Picks a_song as the one to be played, if it was prefetched. If 
+	// stop() was called after generation() returned generation, the song
+	// is still picked but play() won't feed it.
+	bool activate(const song& a_song, uint64_t generation);
+	// Feeds the activated song to the buffer until it's done or stop() is
+	// called.
+	void play(types::decode_buffer_type& buffer);
+	void stop();
+	// Changes every time stop() is called.
+	uint64_t generation() const;
+	bool is_playing() const;
+	float percent_so_far();
+private:
+	struct entry {
+		entry(song a_song, size_t buffer_size, unsigned sample_rate);
+
+		song prefetched_song;
+		decoder song_decoder;
+		types::decode_buffer_type buffer;
+		std::thread worker;
+		std::atomic<bool> finished;
+	};
+	using entry_ptr = std::unique_ptr<entry>;
+	using locker_type = std::lock_guard<std::mutex>;
+	static constexpr size_t chunk_size = 4096;
+
+	entry_ptr start(const song& a_song);
+	void cancel(entry_ptr ptr);
+	void reap_cancelled();
+
+	const sharing_manager& m_manager;
+	const size_t m_songs_to_prefetch, m_buffer_size;
+	const unsigned m_sample_rate;
+	std::vector<entry_ptr> m_entries;
+	std::list<entry_ptr> m_cancelled;
+	entry_ptr m_active;
+	std::atomic<bool> m_playing;
+	uint64_t m_generation;
+	mutable std::mutex m_mutex;
+};
+
+#endif // SHAPLIM_PREFETCHER_H
@@ -21,115 +21,362 @@
 #include <cstdint>
 #include <mutex>
 #include <condition_variable>
-#include <array>
+#include <memory>
 #include <atomic>
 #include <thread>
  #include <iostream>
 #include <chrono>
+#include <algorithm>
 
-template<typename T, size_t n>
-class lock_free_ring_buffer {
+/*
+ * A contiguous chunk of a ring buffer's storage.
+ */
+template<typename T>
+struct ring_buffer_span {
+	T* begin() const { return data; }
+	T* end() const { return data + size; }
+	bool empty() const { return size == 0; }
+
+	T* data;
+	size_t size;
+};
+
+/*
+ * Single producer, single consumer ring buffer whose capacity is chosen 
+ * at runtime. The producer parks until there's space instead of polling,
+ * the consumer can wait for data, and either side can be woken up 
+ * through interrupt or close.
+ * 
+ * The head (written by the producer) and tail (written by the consumer) 
+ * indexes increase monotonically and live on separate cache lines. Each 
+ * side keeps a cached copy of the other side's index so the shared one 
+ * is only loaded when the cached value says there's no room/data.
+ *
+ * Besides the copying put/get, the producer can write straight into the
+ * buffer's storage through reserve/commit, and the consumer can read from
+ * it through peek/release. Everything is counted in elements; producers 
+ * that only commit whole frames always get spans holding whole frames, 
+ * since the capacity is a power of two.
+ */
+template<typename T>
+class spsc_ring_buffer {
 public:
-	lock_free_ring_buffer();
+	using span = ring_buffer_span<T>;
+	using const_span = ring_buffer_span<const T>;
+
+	spsc_ring_buffer(size_t capacity, size_t low_water_mark);
+	spsc_ring_buffer(size_t capacity);
 
 	template<typename InputIterator>
 	bool put(InputIterator start, InputIterator end);
 
+	// Reads up to count elements and pads the rest with default_value.
+	// Returns the amount of elements actually read.
 	template<typename OutputIterator>
-	void get(OutputIterator output, size_t count, T default_value = T());
+	size_t get(OutputIterator output, size_t count, T default_value = T());
+
+	// Producer side. reserve blocks until there's free space and returns
+	// at most count writable elements; commit publishes the first count
+	// of them.
+	span reserve(size_t count);
+	void commit(size_t count);
+
+	// Consumer side. peek returns at most count readable elements, which
+	// may be less than what's available if the data wraps around, and 
+	// release frees the first count of them.
+	const_span peek(size_t count);
+	void release(size_t count);
+	// Blocks until there's something to read. Returns false if the buffer
+	// is empty and was either closed or interrupted.
+	bool wait_for_data();
+	// Producer side. Nothing else will be written, wakes up the consumer.
+	void close();
 
 	void clear();
+	// Makes the producer give up: reserve returns an empty span and put 
+	// returns false from then on.
+	void interrupt();
+	// Undoes interrupt and close. Neither side should be using the buffer.
+	void reset();
+	void low_water_mark(size_t value);
+	size_t capacity() const;
+	size_t size() const;
+	// How many elements have been written/read so far. Each one should only
+	// be called from its own side.
+	size_t write_position() const;
+	size_t read_position() const;
 private:
-	static constexpr size_t buffer_size = n;
-	using buffer_type = std::array<T, buffer_size>;
+	static constexpr size_t cache_line_size = 64;
 	using locker_type = std::unique_lock<std::mutex>;
-	using iterator = decltype(std::declval<buffer_type>().begin());
-    
-    iterator next(iterator iter) {
-        ++iter;
-        return (iter == std::end(m_buffer)) ? std::begin(m_buffer) : iter;
-    }
-
-	buffer_type m_buffer;
-	std::atomic<iterator> m_front, m_back;
-	std::atomic<size_t> m_available;
+
+	spsc_ring_buffer(const spsc_ring_buffer&) = delete;
+	spsc_ring_buffer& operator=(const spsc_ring_buffer&) = delete;
+
+	static size_t round_capacity(size_t capacity);
+	void wait_for_space();
+	void notify_space();
+	void notify_data();
+
+	const size_t m_capacity, m_mask;
+	const std::unique_ptr<T[]> m_buffer;
+	// Each side's data gets its own cache line. Allocating this with new 
+	// needs -faligned-new before C++17.
+	// Producer side
+	alignas(cache_line_size) std::atomic<size_t> m_head;
+	size_t m_cached_tail;
+	// Consumer side
+	alignas(cache_line_size) std::atomic<size_t> m_tail;
+	size_t m_cached_head;
+	// Producer and consumer parking
+	alignas(cache_line_size) std::atomic<size_t> m_low_water_mark;
+	std::atomic<bool> m_producer_waiting, m_consumer_waiting;
+	std::atomic<bool> m_interrupted, m_closed;
+	std::mutex m_mutex;
+	std::condition_variable m_space_cond, m_data_cond;
 };
 
-template<typename T, size_t n>
-lock_free_ring_buffer<T, n>::lock_free_ring_buffer()
-: m_front(std::begin(m_buffer)), m_back(std::begin(m_buffer)), m_available(0)
+template<typename T>
+spsc_ring_buffer<T>::spsc_ring_buffer(size_t capacity, size_t low_water_mark)
+: m_capacity(round_capacity(capacity)), m_mask(m_capacity - 1), 
+m_buffer(new T[m_capacity]()), m_head(0), m_cached_tail(0), m_tail(0),
+m_cached_head(0), m_low_water_mark(std::min(low_water_mark, m_capacity - 1)),
+m_producer_waiting(false), m_consumer_waiting(false), m_interrupted(false),
+m_closed(false)
+{
+
+}
+
+template<typename T>
+spsc_ring_buffer<T>::spsc_ring_buffer(size_t capacity)
+: spsc_ring_buffer(capacity, round_capacity(capacity) / 2)
+{
+
+}
+
+template<typename T>
+size_t spsc_ring_buffer<T>::round_capacity(size_t capacity)
+{
+	size_t output = 2;
+	while(output < capacity)
+		output <<= 1;
+	return output;
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::wait_for_space()
+{
+	locker_type lock(m_mutex);
+	m_producer_waiting = true;
+	m_space_cond.wait(
+		lock, 
+		[&] { 
+			return !m_producer_waiting || m_interrupted || 
+				size() <= m_low_water_mark; 
+		}
+	);
+	m_producer_waiting = false;
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::notify_space()
+{
+	// Pairs with the store to m_producer_waiting in wait_for_space.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_producer_waiting && size() <= m_low_water_mark) {
+		locker_type _(m_mutex);
+		m_space_cond.notify_one();
+	}
+}
+
+template<typename T>
+bool spsc_ring_buffer<T>::wait_for_data()
 {
+	locker_type lock(m_mutex);
+	m_consumer_waiting = true;
+	// Pairs with the fence in notify_data
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	m_data_cond.wait(
+		lock,
+		[&] {
+			return size() != 0 || m_interrupted || m_closed;
+		}
+	);
+	m_consumer_waiting = false;
+	return size() != 0;
+}
 
+template<typename T>
+void spsc_ring_buffer<T>::notify_data()
+{
+	// Pairs with the fence in wait_for_data
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_consumer_waiting) {
+		locker_type _(m_mutex);
+		m_data_cond.notify_one();
+	}
 }
 
-template<typename T, size_t n>
+template<typename T>
+auto spsc_ring_buffer<T>::reserve(size_t count) -> span
+{
+	const size_t head = m_head.load(std::memory_order_relaxed);
+	const size_t offset = head & m_mask;
+	span output;
+	output.data = m_buffer.get() + offset;
+	output.size = 0;
+	size_t space_left = m_capacity - (head - m_cached_tail);
+	while(space_left == 0) {
+		if(m_interrupted)
+			return output;
+		m_cached_tail = m_tail.load(std::memory_order_acquire);
+		space_left = m_capacity - (head - m_cached_tail);
+		if(space_left == 0)
+			wait_for_space();
+	}
+	if(m_interrupted)
+		return output;
+	output.size = std::min(std::min(count, space_left), m_capacity - offset);
+	return output;
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::commit(size_t count)
+{
+	if(count != 0) {
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		m_head.store(head + count, std::memory_order_release);
+		notify_data();
+	}
+}
+
+template<typename T>
+auto spsc_ring_buffer<T>::peek(size_t count) -> const_span
+{
+	const size_t tail = m_tail.load(std::memory_order_relaxed);
+	if(m_cached_head - tail < count) 
+		m_cached_head = m_head.load(std::memory_order_acquire);
+	const size_t offset = tail & m_mask;
+	const_span output;
+	output.data = m_buffer.get() + offset;
+	output.size = std::min(
+		std::min(count, m_cached_head - tail), 
+		m_capacity - offset
+	);
+	return output;
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::release(size_t count)
+{
+	if(count != 0) {
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		m_tail.store(tail + count, std::memory_order_release);
+		notify_space();
+	}
+}
+
+template<typename T>
 template<typename InputIterator>
-bool lock_free_ring_buffer<T, n>::put(InputIterator start, InputIterator end)
+bool spsc_ring_buffer<T>::put(InputIterator start, InputIterator end)
 {
-	auto size = std::distance(start, end);
-    iterator front = m_front;
+	size_t size = std::distance(start, end);
 	while(size != 0) {
-        iterator back = m_back;
-        // if it's full
-		while(next(front) == back) {
-            std::this_thread::sleep_for(
-            	std::chrono::milliseconds(10)
-            );
-            back = m_back;
-		}
-        
-		iterator buffer_end;
-        if(back > front)  {
-            buffer_end = back - 1;
-        }
-        else {
-            buffer_end = std::end(m_buffer);
-            if(back == std::begin(m_buffer)) {
-                --buffer_end;
-            }
-        }
-		auto space_left = std::distance(front, buffer_end);
-		auto amount_to_write = std::min(space_left, size);
-		front = std::copy(start, start + amount_to_write, front);
-		size -= amount_to_write;
-		start += amount_to_write;
-		if(front == std::end(m_buffer))
-			front = std::begin(m_buffer);
-        m_front = front;
-        m_available += amount_to_write;
+		auto output = reserve(size);
+		if(output.empty())
+			return false;
+		std::copy(start, start + output.size, output.begin());
+		commit(output.size);
+		start += output.size;
+		size -= output.size;
 	}
 	return true;
 }
 
-template<typename T, size_t n>
+template<typename T>
 template<typename OutputIterator>
-void lock_free_ring_buffer<T, n>::get(OutputIterator output, size_t count, T default_value)
+size_t spsc_ring_buffer<T>::get(OutputIterator output, size_t count, T default_value)
 {
-	if(m_available < count) {
-		std::fill(output, output + count, default_value);
-	}
-	else {
-	    iterator back = m_back;
-	    iterator front = m_front;
-		while(count != 0) {
-	        iterator buffer_end = (front > back) ? front : std::end(m_buffer);
-			auto space_left = std::distance(back, buffer_end);
-			auto amount_to_read = std::min(static_cast<size_t>(space_left), count);
-			output = std::copy(back, back + amount_to_read, output);
-			count -= amount_to_read;
-			back += amount_to_read;
-			if(back == std::end(m_buffer))
-				back = std::begin(m_buffer);
-			m_back = back;
-			m_available -= amount_to_read;
-		}
+	size_t amount_read = 0;
+	// At most two iterations, when the data wraps around
+	while(amount_read != count) {
+		auto input = peek(count - amount_read);
+		if(input.empty())
+			break;
+		output = std::copy(input.begin(), input.end(), output);
+		release(input.size);
+		amount_read += input.size;
 	}
+	std::fill(output, output + (count - amount_read), default_value);
+	return amount_read;
+}
+
+// Must be called either from the consumer thread or while the consumer
+// is not running.
+template<typename T>
+void spsc_ring_buffer<T>::clear()
+{
+	m_cached_head = m_head.load(std::memory_order_acquire);
+	m_tail.store(m_cached_head);
+	locker_type _(m_mutex);
+	m_producer_waiting = false;
+	m_space_cond.notify_one();
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::interrupt()
+{
+	m_interrupted = true;
+	locker_type _(m_mutex);
+	m_space_cond.notify_one();
+	m_data_cond.notify_one();
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::reset()
+{
+	m_interrupted = false;
+	m_closed = false;
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::close()
+{
+	m_closed = true;
+	locker_type _(m_mutex);
+	m_data_cond.notify_one();
+}
+
+template<typename T>
+void spsc_ring_buffer<T>::low_water_mark(size_t value)
+{
+	m_low_water_mark = std::min(value, m_capacity - 1);
+	locker_type _(m_mutex);
+	m_space_cond.notify_one();
+}
+
+template<typename T>
+size_t spsc_ring_buffer<T>::capacity() const
+{
+	return m_capacity;
+}
+
+template<typename T>
+size_t spsc_ring_buffer<T>::size() const
+{
+	return m_head.load(std::memory_order_acquire) - 
+		m_tail.load(std::memory_order_acquire);
+}
+
+template<typename T>
+size_t spsc_ring_buffer<T>::write_position() const
+{
+	return m_head.load(std::memory_order_relaxed);
 }
 
-template<typename T, size_t n>
-void lock_free_ring_buffer<T, n>::clear()
+template<typename T>
+size_t spsc_ring_buffer<T>::read_position() const
 {
-	m_back.store(m_front);
+	return m_tail.load(std::memory_order_relaxed);
 }
 
 #endif // SHAPLIM_RING_BUFFER_H
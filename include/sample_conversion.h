@@ -0,0 +1,73 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_SAMPLE_CONVERSION_H
+#define SHAPLIM_SAMPLE_CONVERSION_H
+
+#include <cstddef>
+
+/*
+ * Sample conversion kernels. Each one has a scalar implementation and, on
+ * x86, SSE2 and AVX2 ones. The best one the CPU supports is picked at 
+ * runtime.
+ */
+namespace sample_conversion {
+	enum class isa_level {
+		scalar,
+		sse2,
+		avx2
+	};
+
+	struct kernel_set {
+		// Interleaves two planes of [-1, 1] floats into 16 bit stereo,
+		// clipping anything out of range and turning NaNs into silence. 
+		// Pass the same plane twice to expand mono to stereo.
+		void (*planar_float_to_s16)(const float* left, const float* right, 
+			short* output, size_t frames);
+		// Duplicates every sample into both channels.
+		void (*mono_to_stereo_s16)(const short* input, short* output, 
+			size_t frames);
+		// Multiplies samples by gain in place, saturating the result.
+		void (*scale_s16)(short* samples, size_t count, float gain);
+	};
+
+	isa_level best_isa_level();
+	bool is_supported(isa_level level);
+	const char* name(isa_level level);
+	const kernel_set& kernels(isa_level level);
+	// The kernels for best_isa_level()
+	const kernel_set& kernels();
+
+	inline void planar_float_to_s16(const float* left, const float* right, 
+		short* output, size_t frames)
+	{
+		kernels().planar_float_to_s16(left, right, output, frames);
+	}
+
+	inline void mono_to_stereo_s16(const short* input, short* output, 
+		size_t frames)
+	{
+		kernels().mono_to_stereo_s16(input, output, frames);
+	}
+
+	inline void scale_s16(short* samples, size_t count, float gain)
+	{
+		kernels().scale_s16(samples, count, gain);
+	}
+}
+
+#endif // SHAPLIM_SAMPLE_CONVERSION_H
@@ -0,0 +1,82 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_SEARCH_INDEX_H
+#define SHAPLIM_SEARCH_INDEX_H
+
+#include <array>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+
+class song_information;
+
+/*
+ * In-memory inverted index over songs' file names and tags. Every field is
+ * split into trigrams; a query only looks at the songs that contain every
+ * trigram of its words, and then ranks them by where the words appear.
+ */
+class search_index {
+public:
+	struct result {
+		std::string path;
+		unsigned score;
+	};
+
+	search_index();
+
+	// info can be null if the song hasn't been parsed yet
+	void add_song(const std::string& path, const std::string& file_name, 
+		const song_information* info);
+	// Does nothing if the song isn't indexed
+	void update_tags(const std::string& path, const song_information& info);
+	void remove_song(const std::string& path);
+	// Removes every song inside this directory, recursively
+	void remove_directory(const std::string& path);
+	// Stores the total amount of matches in total_matches
+	std::vector<result> search(const std::string& query, size_t offset, 
+		size_t limit, size_t& total_matches) const;
+	size_t size() const;
+private:
+	using locker_type = std::lock_guard<std::mutex>;
+	using document_id = uint32_t;
+	using posting_list = std::vector<document_id>;
+	// Ordered by relevance: title, artist, album and file name
+	static constexpr size_t field_count = 4;
+	using fields_type = std::array<std::string, field_count>;
+
+	struct document {
+		std::string path;
+		fields_type fields;
+		bool alive;
+	};
+
+	void insert(std::string path, fields_type fields);
+	void remove(const std::string& path);
+	void rebuild();
+	unsigned score(const document& doc, const std::vector<std::string>& words) const;
+
+	std::vector<document> m_documents;
+	std::unordered_map<std::string, document_id> m_ids;
+	std::unordered_map<uint32_t, posting_list> m_postings;
+	size_t m_dead_documents;
+	mutable std::mutex m_mutex;
+};
+
+#endif // SHAPLIM_SEARCH_INDEX_H
@@ -22,27 +22,83 @@
 #include <string>
 #include <functional>
 #include <array>
+#include <map>
+#include <deque>
+#include <cstdint>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <jsoncpp/json/value.h>
 
 class session : public std::enable_shared_from_this<session> {
 public:
 	using socket_type = boost::asio::ip::tcp::socket;
-	using callback_type = std::function<Json::Value(session&, std::string)>;
+	// How requests are framed and replies encoded. Requests are newline 
+	// terminated JSON objects by default. msgpack requests are length 
+	// prefixed frames, see msgpack.h.
+	enum class encoding_type {
+		json, msgpack
+	};
+	// Must be called exactly once per request, from any thread
+	using reply_type = std::function<void(Json::Value)>;
+	// The request data, without its delimiter or frame header, is only 
+	// valid during the call.
+	using callback_type = std::function<
+		void(session&, encoding_type, const char*, size_t, reply_type)
+	>;
+
+	using shared_data = std::shared_ptr<const std::string>;
+
+	// Reading stops once this many requests are waiting for their replies
+	static constexpr size_t max_pending_requests = 64;
+	// A streaming client that falls this far behind is disconnected
+	static constexpr size_t max_queued_pushes = 1024;
 
 	session(socket_type sock, callback_type callback);
 	void start();
 	void close();
+	// Stops handling requests. Whatever the client sends from now on is 
+	// discarded, the connection only carries pushed data.
+	void start_streaming();
+	// Queues data to be sent after every pending reply. Can be called 
+	// from any thread, returns false if the session is closed.
+	bool push(shared_data data);
+	encoding_type encoding() const;
+	// Must be called while handling a request. That request is still 
+	// answered using the previous encoding, the ones after it use the new one.
+	void set_encoding(encoding_type encoding);
 private:
 	using buffer_type = boost::asio::streambuf;
+	using request_id = uint64_t;
 
 	void do_read();
+	void handle_requests();
+	bool next_request(const char*& data, size_t& size, size_t& consumed);
+	size_t pending_requests() const;
 	void do_write();
+	void reply(request_id id, encoding_type encoding, Json::Value result);
+	void queue_reply(request_id id, shared_data data);
+	void queue_push(shared_data data);
+	void flush_pushes();
 
 	socket_type m_socket;
+	// Every handler runs on this strand, so the members below don't need 
+	// locking even when the io_service runs on several threads.
+	boost::asio::io_service::strand m_strand;
 	buffer_type m_read_buffer;
-	std::string m_send_buffer;
 	callback_type m_callback;
+	// Replies that are ready, but wait for the ones before them
+	std::map<request_id, shared_data> m_finished;
+	// Pushed data that waits for the pending replies to be written
+	std::deque<shared_data> m_pushes;
+	std::deque<shared_data> m_write_queue;
+	request_id m_next_request;
+	request_id m_next_reply;
+	// The amount of replies at the front of m_write_queue being written
+	size_t m_writing;
+	bool m_reading;
+	bool m_streaming;
+	encoding_type m_encoding;
+	std::atomic<bool> m_closed;
 };
 
 class server {
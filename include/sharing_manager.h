@@ -21,16 +21,23 @@
 #include <vector>
 #include <string>
 #include "directory.h"
+#include "directory_tree.h"
 
 class sharing_manager {
 public:
 	sharing_manager(const std::vector<std::string>& shared_dirs);
 
 	std::vector<std::string> shared_directories();
-	const directory& find_directory(const std::string& full_path) const;
+	directory find_directory(const std::string& full_path) const;
 	std::string find_full_path(const std::string& shared_path) const;
+	// The inverse of find_full_path. Returns an empty string if the path 
+	// isn't inside any shared directory.
+	std::string shared_path(const std::string& full_path) const;
+	// Its subdirectories are the shared directories
+	directory root() const;
 private:
-	directory m_virtual_root;
+	// Loading directories is a lookup detail, it doesn't change what's shared
+	mutable directory_tree m_tree;
 };
 
 #endif // SHAPLIM_SHARING_MANAGER_H
@@ -39,4 +39,7 @@ private:
 	schema_type m_schema;
 };
 
+bool operator==(const song& lhs, const song& rhs);
+bool operator!=(const song& lhs, const song& rhs);
+
 #endif // SHAPLIM_SONG_H
@@ -20,8 +20,13 @@
 
 #include <map>
 #include <mutex>
+#include <memory>
 #include <string>
 #include <chrono>
+#include <array>
+#include <functional>
+#include "metadata_cache.h"
+#include "artwork_store.h"
 
 class song_information {
 public:
@@ -34,27 +39,66 @@ public:
 	void album(std::string data);
 	const std::string& title() const;
 	void title(std::string data);
-	const std::string& picture() const;
-	void picture(std::string data);
+	// The picture's id in artwork_store, empty if there's none
+	const std::string& picture_id() const;
+	void picture_id(std::string data);
 	const std::string& picture_mime() const;
+	void picture_mime(std::string data);
 	void length(std::chrono::seconds data);
 	const std::chrono::seconds& length() const;
 private:
-	std::string m_artist, m_album, m_title, m_picture, m_picture_mime;
+	std::string m_artist, m_album, m_title, m_picture_id, m_picture_mime;
 	std::chrono::seconds m_length;
 };
 
+// Reads the picture embedded in a song file. A file that can't be opened 
+// right now is unavailable, one that doesn't exist or has no picture is 
+// missing it.
+artwork_store::read_result read_embedded_picture(const std::string& file_name, 
+	std::string& mime, std::string& data);
+
 class song_database {
 public:
+	using info_ptr = std::shared_ptr<const song_information>;
+	// Called after a song is parsed
+	using update_observer_type = std::function<void(const std::string&, 
+		const info_ptr&)>;
+
 	static song_database instance;
 
-	const song_information& song_info(const std::string& path);
+	// Loads the persistent cache, new entries are appended to it
+	void load_cache(const std::string& file_path);
+	// Parses the file if there's no up to date entry for it
+	info_ptr song_info(const std::string& path);
+	// Never touches the file's contents. Returns null if there's no up 
+	// to date entry.
+	info_ptr cached_song_info(const std::string& path);
+	// Like cached_song_info, but doesn't check whether the entry is stale
+	info_ptr known_song_info(const std::string& path);
 	void set_song_info(std::string path, song_information data);
+	// Drops the in-memory entry, so it's looked up again next time
+	void invalidate(const std::string& path);
+	// Must be set before songs are looked up from other threads
+	void set_update_observer(update_observer_type observer);
 private:
-	using db_type = std::map<std::string, song_information>;
+	using db_type = metadata_cache::entries_type;
+	using locker_type = std::lock_guard<std::mutex>;
+
+	// Entries are spread over several maps, so lookups for different 
+	// paths rarely contend on the same lock.
+	struct shard {
+		db_type entries;
+		std::mutex lock;
+	};
+	static constexpr size_t shard_count = 32;
+
+	shard& shard_for(const std::string& path);
+	info_ptr find(const std::string& path, bool is_file, const file_stamp& stamp);
 
-	db_type m_db;
-	std::mutex m_lock;
+	std::array<shard, shard_count> m_shards;
+	metadata_cache m_cache;
+	std::mutex m_cache_lock;
+	update_observer_type m_update_observer;
 };
 
 #endif // SHAPLIM_SONG_DATABASE_H
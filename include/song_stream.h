@@ -40,6 +40,9 @@ public:
 	virtual size_t current_offset() = 0;
 	virtual void seek(size_t pos) = 0;
 	virtual void stop() { }
+	// Whether the whole stream is in memory, so reads and seeks are cheap
+	virtual bool is_memory_backed() { return false; }
+	virtual void advise_sequential() { }
 };
 
 class song_stream {
@@ -56,6 +59,8 @@ public:
 	bool bytes_left();
 	size_t current_offset();
 	void seek(size_t pos);
+	bool is_memory_backed();
+	void advise_sequential();
 private:
 	std::unique_ptr<song_stream_impl> m_impl;
 };
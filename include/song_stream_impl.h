@@ -33,6 +33,8 @@ public:
 	void seek(size_t pos);
 	bool bytes_left();
 	size_t current_offset();
+	bool is_memory_backed();
+	void advise_sequential();
 private:
 	boost::iostreams::mapped_file_source m_file;
 	const char* m_base_data, *m_data;
@@ -0,0 +1,93 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_SONG_TREE_H
+#define SHAPLIM_SONG_TREE_H
+
+#include <vector>
+#include <array>
+#include <random>
+#include <limits>
+#include <cstdint>
+#include "song.h"
+
+/*
+ * Songs kept in two sequences at once: the order in which they appear in 
+ * the playlist and the order in which they're played. Each sequence is an 
+ * implicit treap over the same nodes, with parent links, so finding the 
+ * song at a position, the position of a song, inserting, erasing and 
+ * moving take O(log n) in either of them.
+ */
+class song_tree {
+public:
+	using node_id = uint32_t;
+	enum class sequence {
+		listed,
+		played
+	};
+
+	static constexpr node_id no_node = std::numeric_limits<node_id>::max();
+
+	song_tree();
+
+	size_t size() const;
+	bool empty() const;
+	// Inserts the song at the given positions of each sequence
+	node_id insert(song value, size_t listed_position, size_t played_position);
+	void erase(node_id id);
+	// Moves the node to position within a single sequence
+	void move(node_id id, sequence which, size_t position);
+	node_id at(sequence which, size_t position) const;
+	size_t position(sequence which, node_id id) const;
+	// The node after id in a sequence, or no_node
+	node_id next(sequence which, node_id id) const;
+	const song& value(node_id id) const;
+	void clear();
+private:
+	struct links {
+		node_id left;
+		node_id right;
+		node_id parent;
+		uint32_t size;
+	};
+
+	struct node {
+		song value;
+		std::array<links, 2> sequences;
+		uint32_t priority;
+	};
+
+	links& get_links(node_id id, sequence which);
+	const links& get_links(node_id id, sequence which) const;
+	node_id& root(sequence which);
+	uint32_t subtree_size(node_id id, sequence which) const;
+	void update(node_id id, sequence which);
+	void set_left(node_id id, sequence which, node_id child);
+	void set_right(node_id id, sequence which, node_id child);
+	std::pair<node_id, node_id> split(node_id id, sequence which, size_t count);
+	node_id merge(node_id lhs, node_id rhs, sequence which);
+	void attach(node_id id, sequence which, size_t position);
+	void detach(node_id id, sequence which);
+
+	std::vector<node> m_nodes;
+	std::vector<node_id> m_free_nodes;
+	std::array<node_id, 2> m_roots;
+	size_t m_size;
+	std::mt19937 m_generator;
+};
+
+#endif // SHAPLIM_SONG_TREE_H
@@ -22,7 +22,10 @@
 
 namespace types {
 	//using decode_buffer_type = ring_buffer<short, 8192>;
-	using decode_buffer_type = lock_free_ring_buffer<short, 8192>;
+	using decode_buffer_type = spsc_ring_buffer<short>;
+
+	// Every decoder outputs interleaved stereo samples
+	constexpr unsigned output_channels = 2;
 }
 
 #endif // SHAPLIM_TYPES_H
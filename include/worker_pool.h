@@ -0,0 +1,53 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#ifndef SHAPLIM_WORKER_POOL_H
+#define SHAPLIM_WORKER_POOL_H
+
+#include <deque>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * Runs tasks on a fixed set of threads, in the order they were posted.
+ * Tasks that are still queued when the pool is stopped are dropped.
+ */
+class worker_pool {
+public:
+	using task_type = std::function<void()>;
+
+	worker_pool(size_t thread_count);
+	~worker_pool();
+
+	void post(task_type task);
+	void stop();
+private:
+	using locker_type = std::unique_lock<std::mutex>;
+
+	void worker_loop();
+
+	std::deque<task_type> m_tasks;
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_running;
+};
+
+#endif // SHAPLIM_WORKER_POOL_H
@@ -0,0 +1,377 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <iterator>
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+#include <boost/filesystem.hpp>
+#include "artwork_store.h"
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libswscale/swscale.h>
+}
+
+std::string base64_encode(const std::string& data)
+{
+	using base64_text =	boost::archive::iterators::base64_from_binary<
+		boost::archive::iterators::transform_width<
+			const char *,
+			6,
+			8
+		>
+	>;
+	std::string output;
+	output.reserve((data.size() + 2) / 3 * 4);
+	std::copy(
+		base64_text(data.data()),
+		base64_text(data.data() + data.size()),
+		std::back_inserter(output)
+	);
+	auto padding = data.size() % 3;
+	if(padding != 0)
+		output.insert(output.end(), 3 - padding, '=');
+	return output;
+}
+
+// *************
+// ** artwork **
+// *************
+
+artwork::artwork(std::string mime, std::string data, std::string thumbnail)
+: m_mime(std::move(mime)), m_data(std::move(data)), 
+m_thumbnail(std::move(thumbnail))
+{
+	m_thumbnail_mime = m_thumbnail.empty() ? m_mime : "image/jpeg";
+}
+
+const std::string& artwork::mime() const
+{
+	return m_mime;
+}
+
+const std::string& artwork::data() const
+{
+	return m_data;
+}
+
+const std::string& artwork::thumbnail() const
+{
+	return m_thumbnail.empty() ? m_data : m_thumbnail;
+}
+
+const std::string& artwork::thumbnail_mime() const
+{
+	return m_thumbnail_mime;
+}
+
+bool artwork::has_thumbnail() const
+{
+	return !m_thumbnail.empty();
+}
+
+// *******************
+// ** artwork_store **
+// *******************
+
+// Decodes the picture and encodes it back as a JPEG that fits in a 
+// thumbnail_size square. Returns an empty string if the picture is 
+// already that small or it can't be decoded.
+static std::string make_thumbnail(const std::string& data)
+{
+	AVCodecID codec_id;
+	if(data.compare(0, 2, "\xff\xd8") == 0)
+		codec_id = AV_CODEC_ID_MJPEG;
+	else if(data.compare(0, 4, "\x89PNG") == 0)
+		codec_id = AV_CODEC_ID_PNG;
+	else
+		return {};
+	const auto free_context = [](AVCodecContext* ptr) { avcodec_free_context(&ptr); };
+	const auto free_frame = [](AVFrame* ptr) { av_frame_free(&ptr); };
+	const auto free_packet = [](AVPacket* ptr) { av_packet_free(&ptr); };
+
+	const AVCodec* decoder = avcodec_find_decoder(codec_id);
+	if(!decoder)
+		return {};
+	std::shared_ptr<AVCodecContext> decoder_ctx(avcodec_alloc_context3(decoder), free_context);
+	std::shared_ptr<AVPacket> packet(av_packet_alloc(), free_packet);
+	std::shared_ptr<AVFrame> frame(av_frame_alloc(), free_frame);
+	if(!decoder_ctx || !packet || !frame || avcodec_open2(decoder_ctx.get(), decoder, nullptr) < 0)
+		return {};
+	if(av_new_packet(packet.get(), data.size()) < 0)
+		return {};
+	std::copy(data.begin(), data.end(), packet->data);
+	if(avcodec_send_packet(decoder_ctx.get(), packet.get()) < 0 ||
+	   avcodec_send_packet(decoder_ctx.get(), nullptr) < 0 ||
+	   avcodec_receive_frame(decoder_ctx.get(), frame.get()) < 0)
+		return {};
+	
+	const int longest_side = std::max(frame->width, frame->height);
+	if(longest_side <= artwork_store::thumbnail_size)
+		return {};
+	const int width = std::max(1, frame->width * artwork_store::thumbnail_size / longest_side);
+	const int height = std::max(1, frame->height * artwork_store::thumbnail_size / longest_side);
+	std::shared_ptr<SwsContext> scaler(
+		sws_getContext(
+			frame->width, 
+			frame->height, 
+			static_cast<AVPixelFormat>(frame->format),
+			width,
+			height,
+			AV_PIX_FMT_YUVJ420P,
+			SWS_AREA,
+			nullptr,
+			nullptr,
+			nullptr
+		),
+		&sws_freeContext
+	);
+	std::shared_ptr<AVFrame> scaled(av_frame_alloc(), free_frame);
+	if(!scaler || !scaled)
+		return {};
+	scaled->format = AV_PIX_FMT_YUVJ420P;
+	scaled->width = width;
+	scaled->height = height;
+	if(av_frame_get_buffer(scaled.get(), 0) < 0)
+		return {};
+	sws_scale(scaler.get(), frame->data, frame->linesize, 0, frame->height, 
+		scaled->data, scaled->linesize);
+
+	const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+	if(!encoder)
+		return {};
+	std::shared_ptr<AVCodecContext> encoder_ctx(avcodec_alloc_context3(encoder), free_context);
+	if(!encoder_ctx)
+		return {};
+	encoder_ctx->width = width;
+	encoder_ctx->height = height;
+	encoder_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+	encoder_ctx->time_base = AVRational{1, 1};
+	if(avcodec_open2(encoder_ctx.get(), encoder, nullptr) < 0)
+		return {};
+	av_packet_unref(packet.get());
+	if(avcodec_send_frame(encoder_ctx.get(), scaled.get()) < 0 ||
+	   avcodec_send_frame(encoder_ctx.get(), nullptr) < 0 ||
+	   avcodec_receive_packet(encoder_ctx.get(), packet.get()) < 0)
+		return {};
+	return std::string(packet->data, packet->data + packet->size);
+}
+
+// FNV-1a
+static std::string make_id(const std::string& data)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(unsigned char c : data) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	std::ostringstream output;
+	output << std::hex << std::setfill('0') << std::setw(16) << hash 
+		   << '-' << data.size();
+	return output.str();
+}
+
+artwork_store artwork_store::instance;
+
+void artwork_store::set_directory(const std::string& path)
+{
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(path, ec);
+	locker_type _(m_lock);
+	m_directory = path;
+}
+
+void artwork_store::set_reader(reader_type reader)
+{
+	locker_type _(m_lock);
+	m_reader = std::move(reader);
+}
+
+void artwork_store::add_source(const std::string& id, std::string song_path)
+{
+	locker_type _(m_lock);
+	if(!find_loaded(id))
+		m_sources[id] = std::move(song_path);
+}
+
+std::string artwork_store::add(std::string mime, std::string data)
+{
+	const std::string base_id = make_id(data);
+	std::string id = base_id;
+	// The size is part of the id, so collisions are pretty much 
+	// impossible. Still, make sure the contents are the same.
+	for(size_t suffix = 1; ; ++suffix) {
+		artwork_ptr existing;
+		{
+			locker_type _(m_lock);
+			existing = find_stored(id);
+		}
+		if(!existing)
+			break;
+		if(existing->data() == data)
+			return id;
+		id = base_id + "-" + std::to_string(suffix);
+	}
+	// Scaling doesn't need the lock. Two threads could end up doing this 
+	// for the same picture, the first one wins.
+	auto thumbnail = make_thumbnail(data);
+	auto picture = std::make_shared<artwork>(std::move(mime), std::move(data), 
+		std::move(thumbnail));
+	locker_type _(m_lock);
+	if(!find_loaded(id)) {
+		store(id, picture);
+		save(id, *picture);
+	}
+	m_sources.erase(id);
+	return id;
+}
+
+// The song is read without the lock, so two threads might read it at 
+// once. Its source is kept if it couldn't be read right now, so a busy 
+// file or a slow mount doesn't lose the picture.
+auto artwork_store::find(const std::string& id) -> artwork_ptr
+{
+	std::string song_path;
+	reader_type reader;
+	{
+		locker_type _(m_lock);
+		if(auto picture = find_stored(id))
+			return picture;
+		auto iter = m_sources.find(id);
+		if(iter == m_sources.end() || !m_reader)
+			return nullptr;
+		song_path = iter->second;
+		reader = m_reader;
+	}
+	std::string mime, data;
+	const auto result = reader(song_path, mime, data);
+	// The song might have changed since its id was recorded, in which 
+	// case add doesn't drop the source
+	if(result == read_result::found && add(std::move(mime), std::move(data)) == id) {
+		locker_type _(m_lock);
+		return find_loaded(id);
+	}
+	if(result != read_result::unavailable) {
+		locker_type _(m_lock);
+		auto iter = m_sources.find(id);
+		if(iter != m_sources.end() && iter->second == song_path)
+			m_sources.erase(iter);
+	}
+	return nullptr;
+}
+
+bool artwork_store::contains(const std::string& id)
+{
+	std::string directory;
+	{
+		locker_type _(m_lock);
+		if(find_loaded(id))
+			return true;
+		directory = m_directory;
+	}
+	boost::system::error_code ec;
+	return !directory.empty() && boost::filesystem::exists(directory + "/" + id, ec);
+}
+
+// Requires the lock to be held
+auto artwork_store::find_loaded(const std::string& id) -> artwork_ptr
+{
+	auto iter = m_artwork.find(id);
+	if(iter == m_artwork.end())
+		return nullptr;
+	if(iter->second.picture)
+		return iter->second.picture;
+	return iter->second.weak_picture.lock();
+}
+
+// Requires the lock to be held. Doesn't try the picture's source.
+auto artwork_store::find_stored(const std::string& id) -> artwork_ptr
+{
+	if(auto picture = find_loaded(id))
+		return picture;
+	auto picture = load(id);
+	if(picture)
+		store(id, picture);
+	return picture;
+}
+
+// Requires the lock to be held
+void artwork_store::store(const std::string& id, const artwork_ptr& picture)
+{
+	auto& output = m_artwork[id];
+	if(m_directory.empty())
+		output.picture = picture;
+	else
+		output.weak_picture = picture;
+}
+
+// Each picture is stored in a file named after its id, with the mime 
+// type on the first line and the raw bytes after it. Thumbnails use the 
+// same format, with a ".thumb" suffix.
+static bool read_picture(const std::string& path, std::string& mime, std::string& data)
+{
+	std::ifstream input(path, std::ios::binary);
+	if(!input || !std::getline(input, mime))
+		return false;
+	data.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+	return true;
+}
+
+static void write_picture(const std::string& path, const std::string& mime, 
+	const std::string& data)
+{
+	const std::string temp_path = path + ".tmp";
+	{
+		std::ofstream output(temp_path, std::ios::binary | std::ios::trunc);
+		output << mime << '\n';
+		output.write(data.data(), data.size());
+		if(!output)
+			return;
+	}
+	std::rename(temp_path.c_str(), path.c_str());
+}
+
+// Requires the lock to be held
+auto artwork_store::load(const std::string& id) -> artwork_ptr
+{
+	if(m_directory.empty())
+		return nullptr;
+	std::string mime, data, thumbnail_mime, thumbnail;
+	const std::string path = m_directory + "/" + id;
+	if(!read_picture(path, mime, data))
+		return nullptr;
+	read_picture(path + ".thumb", thumbnail_mime, thumbnail);
+	return std::make_shared<artwork>(std::move(mime), std::move(data), 
+		std::move(thumbnail));
+}
+
+// Requires the lock to be held
+void artwork_store::save(const std::string& id, const artwork& picture)
+{
+	if(m_directory.empty())
+		return;
+	const std::string path = m_directory + "/" + id;
+	write_picture(path, picture.mime(), picture.data());
+	if(picture.has_thumbnail())
+		write_picture(path + ".thumb", picture.thumbnail_mime(), picture.thumbnail());
+}
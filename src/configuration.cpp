@@ -0,0 +1,197 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <jsoncpp/json/reader.h>
+#include "configuration.h"
+#include "types.h"
+
+configuration::configuration()
+: m_sample_rate(44100), m_buffer_latency(200), m_buffer_low_water_percent(50),
+m_prefetch_songs(2), m_prefetch_length(5), m_metadata_threads(4),
+m_index_on_startup(false), m_index_threads(2), m_index_operations_per_second(100),
+m_watch_directories(true), m_watch_coalesce_delay(200), m_command_threads(2),
+m_io_threads(2), m_event_log_size(4096), m_event_log_max_age(3600)
+{
+
+}
+
+bool configuration::load(const std::string& file_path)
+{
+	Json::Value root;
+	Json::Reader reader;
+	std::ifstream input(file_path);
+	std::string data{std::istreambuf_iterator<char>(input),
+		std::istreambuf_iterator<char>()};
+	if(!reader.parse(data, root))
+		return false;
+	if(!root.isMember("shared_directories")) {
+		throw std::runtime_error("Configuration file missing 'shared_directories' key");
+	}
+	for(const auto& dir : root["shared_directories"]) {
+		m_shared_dirs.push_back(dir.asString());
+	}
+	if(root.isMember("sample_rate"))
+		m_sample_rate = root["sample_rate"].asUInt();
+	if(root.isMember("buffer_latency_ms"))
+		m_buffer_latency = std::chrono::milliseconds(root["buffer_latency_ms"].asUInt());
+	if(root.isMember("buffer_low_water_percent"))
+		m_buffer_low_water_percent = std::min(root["buffer_low_water_percent"].asUInt(), 100u);
+	if(root.isMember("prefetch_songs"))
+		m_prefetch_songs = root["prefetch_songs"].asUInt();
+	if(root.isMember("prefetch_seconds"))
+		m_prefetch_length = std::chrono::seconds(root["prefetch_seconds"].asUInt());
+	if(root.isMember("metadata_cache"))
+		m_metadata_cache = root["metadata_cache"].asString();
+	if(root.isMember("metadata_threads"))
+		m_metadata_threads = std::max(root["metadata_threads"].asUInt(), 1u);
+	if(root.isMember("artwork_directory"))
+		m_artwork_directory = root["artwork_directory"].asString();
+	if(root.isMember("index_on_startup"))
+		m_index_on_startup = root["index_on_startup"].asBool();
+	if(root.isMember("index_threads"))
+		m_index_threads = std::max(root["index_threads"].asUInt(), 1u);
+	if(root.isMember("index_operations_per_second"))
+		m_index_operations_per_second = std::max(root["index_operations_per_second"].asUInt(), 1u);
+	if(root.isMember("watch_directories"))
+		m_watch_directories = root["watch_directories"].asBool();
+	if(root.isMember("watch_coalesce_ms"))
+		m_watch_coalesce_delay = std::chrono::milliseconds(root["watch_coalesce_ms"].asUInt());
+	if(root.isMember("command_threads"))
+		m_command_threads = std::max(root["command_threads"].asUInt(), 1u);
+	if(root.isMember("io_threads"))
+		m_io_threads = std::max(root["io_threads"].asUInt(), 1u);
+	if(root.isMember("event_log_size"))
+		m_event_log_size = std::max(root["event_log_size"].asUInt(), 1u);
+	if(root.isMember("event_log_max_age_seconds"))
+		m_event_log_max_age = std::chrono::seconds(root["event_log_max_age_seconds"].asUInt());
+	if(m_sample_rate == 0 || m_buffer_latency.count() == 0)
+		throw std::runtime_error("Invalid 'sample_rate' or 'buffer_latency_ms' value");
+	return true;
+}
+
+auto configuration::shared_directories() const -> const shared_dirs_list&
+{
+	return m_shared_dirs;
+}
+
+unsigned configuration::sample_rate() const
+{
+	return m_sample_rate;
+}
+
+std::chrono::milliseconds configuration::buffer_latency() const
+{
+	return m_buffer_latency;
+}
+
+unsigned configuration::buffer_low_water_percent() const
+{
+	return m_buffer_low_water_percent;
+}
+
+size_t configuration::prefetch_songs() const
+{
+	return m_prefetch_songs;
+}
+
+std::chrono::seconds configuration::prefetch_length() const
+{
+	return m_prefetch_length;
+}
+
+const std::string& configuration::metadata_cache() const
+{
+	return m_metadata_cache;
+}
+
+size_t configuration::metadata_threads() const
+{
+	return m_metadata_threads;
+}
+
+const std::string& configuration::artwork_directory() const
+{
+	return m_artwork_directory;
+}
+
+bool configuration::index_on_startup() const
+{
+	return m_index_on_startup;
+}
+
+size_t configuration::index_threads() const
+{
+	return m_index_threads;
+}
+
+size_t configuration::index_operations_per_second() const
+{
+	return m_index_operations_per_second;
+}
+
+bool configuration::watch_directories() const
+{
+	return m_watch_directories;
+}
+
+std::chrono::milliseconds configuration::watch_coalesce_delay() const
+{
+	return m_watch_coalesce_delay;
+}
+
+size_t configuration::command_threads() const
+{
+	return m_command_threads;
+}
+
+size_t configuration::io_threads() const
+{
+	return m_io_threads;
+}
+
+size_t configuration::event_log_size() const
+{
+	return m_event_log_size;
+}
+
+std::chrono::seconds configuration::event_log_max_age() const
+{
+	return m_event_log_max_age;
+}
+
+// The ring buffer only holds powers of two, so this rounds down to one 
+// rather than letting it round up past the configured latency.
+size_t configuration::decode_buffer_size() const
+{
+	const size_t frames = static_cast<size_t>(m_sample_rate) * 
+		m_buffer_latency.count() / 1000;
+	const size_t samples = frames * types::output_channels;
+	size_t output = 2;
+	while(output * 2 <= samples)
+		output *= 2;
+	return output;
+}
+
+size_t configuration::prefetch_buffer_size() const
+{
+	return static_cast<size_t>(m_sample_rate) * m_prefetch_length.count() * 
+		types::output_channels;
+}
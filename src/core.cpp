@@ -20,29 +20,68 @@
 #include <jsoncpp/json/writer.h>
 #include <boost/algorithm/string/predicate.hpp>
 #include "core.h"
+#include "msgpack.h"
 
 using boost::algorithm::starts_with;
-using boost::algorithm::ends_with;
 using locker_type = std::lock_guard<std::mutex>;
+using playlist_locker_type = std::lock_guard<std::mutex>;
 
 std::map<std::string, core::command_type> core::m_commands = {
 	{ "next_song", std::mem_fn(&core::next_song) },
 	{ "previous_song", std::mem_fn(&core::previous_song) },
 	{ "playlist_mode", std::mem_fn(&core::playlist_mode) },
 	{ "set_playlist_mode", std::mem_fn(&core::set_playlist_mode) },
-	{ "show_playlist", std::mem_fn(&core::show_playlist) },
+	{ "playlist_delta", std::mem_fn(&core::playlist_delta) },
 	{ "clear_playlist", std::mem_fn(&core::clear_playlist) },
 	{ "pause", std::mem_fn(&core::pause) },
 	{ "play", std::mem_fn(&core::play) },
-	{ "list_shared_dirs", std::mem_fn(&core::list_shared_dirs) },
-	{ "list_directory", std::mem_fn(&core::list_directory) },
 	{ "add_shared_songs", std::mem_fn(&core::add_shared_songs) },
 	{ "new_events", std::mem_fn(&core::new_events) },
 	{ "player_status", std::mem_fn(&core::player_status) },
 	{ "delete_songs", std::mem_fn(&core::delete_songs) },
+	{ "insert_songs", std::mem_fn(&core::insert_songs) },
+	{ "move_song", std::mem_fn(&core::move_song) },
+	{ "batch", std::mem_fn(&core::batch) },
 	{ "set_current_song", std::mem_fn(&core::set_current_song) },
-	{ "song_info", std::mem_fn(&core::song_info) },
 	{ "add_youtube_songs", std::mem_fn(&core::add_youtube_songs) },
+	{ "underrun_stats", std::mem_fn(&core::underrun_stats) },
+};
+
+// The bodies of the commands that lock m_playlist_mutex, for batches to run 
+// while already holding it. Every such command in m_commands must be here.
+std::map<std::string, core::command_type> core::m_unlocked_commands = {
+	{ "next_song", std::mem_fn(&core::next_song_unlocked) },
+	{ "previous_song", std::mem_fn(&core::previous_song_unlocked) },
+	{ "playlist_mode", std::mem_fn(&core::playlist_mode_unlocked) },
+	{ "set_playlist_mode", std::mem_fn(&core::set_playlist_mode_unlocked) },
+	{ "playlist_delta", std::mem_fn(&core::playlist_delta_unlocked) },
+	{ "clear_playlist", std::mem_fn(&core::clear_playlist_unlocked) },
+	{ "add_shared_songs", std::mem_fn(&core::add_shared_songs_unlocked) },
+	{ "player_status", std::mem_fn(&core::player_status_unlocked) },
+	{ "delete_songs", std::mem_fn(&core::delete_songs_unlocked) },
+	{ "insert_songs", std::mem_fn(&core::insert_songs_unlocked) },
+	{ "move_song", std::mem_fn(&core::move_song_unlocked) },
+	{ "set_current_song", std::mem_fn(&core::set_current_song_unlocked) },
+	{ "add_youtube_songs", std::mem_fn(&core::add_youtube_songs_unlocked) },
+};
+
+// These don't touch the playlist, so they run on m_command_pool
+std::map<std::string, core::command_type> core::m_pooled_commands = {
+	{ "list_shared_dirs", std::mem_fn(&core::list_shared_dirs) },
+	{ "list_directory", std::mem_fn(&core::list_directory) },
+	{ "artwork", std::mem_fn(&core::artwork) },
+	{ "indexer_status", std::mem_fn(&core::indexer_status) },
+	{ "search", std::mem_fn(&core::search) },
+};
+
+std::map<std::string, core::async_command_type> core::m_async_commands = {
+	{ "song_info", std::mem_fn(&core::song_info) },
+	{ "show_playlist", std::mem_fn(&core::show_playlist) },
+};
+
+std::map<std::string, core::session_command_type> core::m_session_commands = {
+	{ "subscribe", std::mem_fn(&core::subscribe) },
+	{ "set_encoding", std::mem_fn(&core::set_encoding) },
 };
 
 class fatal_exception : public std::exception {
@@ -52,20 +91,43 @@ public:
 	}
 };
 
-core::core(const shared_dirs_list& shared_dirs)
+core::core(const configuration& config)
 : m_server(m_io_service, 1337), m_discovery_server(m_io_service, 21283), 
-m_playback(m_buffer), m_sharing_manager(shared_dirs), 
-m_next_action(playlist_actions::none), m_running(false)
+m_buffer(config.decode_buffer_size()),
+m_decoder(config.sample_rate()), m_playback(m_buffer, config.sample_rate()), 
+m_sharing_manager(config.shared_directories()), 
+m_prefetcher(
+	m_sharing_manager, 
+	config.prefetch_songs(), 
+	config.prefetch_buffer_size(),
+	config.sample_rate()
+),
+m_metadata_fetcher(song_database::instance, config.metadata_threads()),
+m_indexer(
+	m_sharing_manager, 
+	song_database::instance, 
+	config.index_threads(),
+	config.index_operations_per_second()
+),
+m_command_pool(config.command_threads()),
+m_next_action(playlist_actions::none), 
+m_event_manager(config.event_log_size(), config.event_log_max_age()),
+m_in_atomic_batch(false), m_stop_deferred(false), m_prefetch_deferred(false), 
+m_running(false), 
+m_songs_to_prefetch(config.prefetch_songs()),
+m_index_on_startup(config.index_on_startup()),
+m_io_threads(config.io_threads())
 {
-	m_decoder.on_sample_rate_change(
-		std::bind(&playback_manager::set_sample_rate, &m_playback, std::placeholders::_1)
-	);
+	m_buffer.low_water_mark(m_buffer.capacity() * config.buffer_low_water_percent() / 100);
 	m_server.on_data_available(
 		std::bind(
 			&core::callback, 
 			this, 
 			std::placeholders::_1, 
-			std::placeholders::_2
+			std::placeholders::_2,
+			std::placeholders::_3,
+			std::placeholders::_4,
+			std::placeholders::_5
 		)
 	);
 	Json::Value object(Json::objectValue);
@@ -74,13 +136,71 @@ m_next_action(playlist_actions::none), m_running(false)
 	object["server_name"] = "shaplim";
 	Json::FastWriter writer;
 	m_discovery_server.set_data_to_answer(writer.write(object));
+	// Songs are indexed as directories are loaded and parsed
+	directory::set_change_observer(
+		[&](directory::change_type type, const std::string& full_path) {
+			using change_type = directory::change_type;
+			if(type == change_type::file_added) {
+				auto info = song_database::instance.known_song_info(full_path);
+				auto file_name = boost::filesystem::path(full_path).filename().string();
+				m_search_index.add_song(full_path, file_name, info.get());
+			}
+			else if(type == change_type::file_removed)
+				m_search_index.remove_song(full_path);
+			else
+				m_search_index.remove_directory(full_path);
+		}
+	);
+	song_database::instance.set_update_observer(
+		[&](const std::string& full_path, const song_database::info_ptr& info) {
+			m_search_index.update_tags(full_path, *info);
+		}
+	);
+	if(config.watch_directories()) {
+		try {
+			m_watcher.reset(
+				new directory_watcher(
+					song_database::instance, 
+					config.watch_coalesce_delay()
+				)
+			);
+		}
+		catch(std::exception& ex) {
+			std::cout << "Not watching shared directories: " << ex.what() << std::endl;
+		}
+	}
+	// Cached metadata refers to stored pictures, so this goes first
+	if(!config.artwork_directory().empty())
+		artwork_store::instance.set_directory(config.artwork_directory());
+	artwork_store::instance.set_reader(&read_embedded_picture);
+	if(!config.metadata_cache().empty())
+		song_database::instance.load_cache(config.metadata_cache());
 }
 
 void core::run()
 {
 	m_running = true;
 	m_decode_thread = std::thread(&core::decode_loop, this);
-	m_io_service.run();
+	if(m_index_on_startup)
+		m_indexer.start();
+	// This thread is one of them
+	std::vector<std::thread> io_threads;
+	for(size_t i = 1; i < m_io_threads; ++i)
+		io_threads.emplace_back(&core::run_io_service, this);
+	run_io_service();
+	for(auto& io_thread : io_threads)
+		io_thread.join();
+}
+
+void core::run_io_service()
+{
+	try {
+		m_io_service.run();
+	}
+	catch(std::exception& ex) {
+		std::cout << "Error: " << ex.what() << std::endl;
+		stop();
+	}
 }
 
 void core::stop()
@@ -88,26 +208,34 @@ void core::stop()
 	if(m_running) {
 		m_running = false;
 		m_playback.stop();
-		m_buffer.clear();
+		// Nothing drains the buffer anymore, so a producer waiting for 
+		// space in it would never wake up
+		m_buffer.interrupt();
 		m_io_service.stop();
+		m_command_pool.stop();
+		m_indexer.stop();
+		if(m_watcher)
+			m_watcher->stop();
 
 		{
-			std::lock_guard<std::mutex> _(m_playlist_mutex);
+			playlist_locker_type _(m_playlist_mutex);
 			m_playlist_cond.notify_one();
+			stop_decoding();
 		}
 
-		m_decoder.stop_decode();
 		m_decode_thread.join();
+		m_buffer.reset();
+		m_buffer.clear();
 	}
 }
 
 void core::decode_loop()
 {
 	while(m_running) {
-		song_stream stream;
 		try {
 			song song_to_play;
 			int current_index;
+			bool prefetched;
 
 			{
 				std::unique_lock<std::mutex> lock(m_playlist_mutex);
@@ -123,35 +251,42 @@ void core::decode_loop()
 				song_to_play = m_playlist.current();
 				current_index = m_playlist.current_index();
 				m_next_action = playlist_actions::next;
+				// Still under the lock, so a skip or stop can't land before 
+				// the song is activated and update_prefetch can't be 
+				// overwritten by a stale list. Grab the current song before 
+				// the prefetcher moves on.
+				prefetched = m_prefetcher.activate(
+					song_to_play, 
+					m_prefetcher.generation()
+				);
+				m_prefetcher.prefetch(m_playlist.upcoming(m_songs_to_prefetch));
 			}
 			m_event_manager.add_play_song_event(current_index);
-			decoder::song_type song_type = decoder::song_type::generic;
-
-			if(song_to_play.schema() == song::schema_type::file) {
-				auto full_path = m_sharing_manager.find_full_path(song_to_play.path());
-				if(ends_with(full_path, "mp3"))
-					song_type = decoder::song_type::mp3;
-				std::cout << full_path << std::endl;
-				stream = make_file_song_stream(full_path);
-			}
-			else if(song_to_play.schema() == song::schema_type::youtube_stream) {
-				std::cout << "youtube://" << song_to_play.path() << std::endl;
-				stream = make_youtube_song_stream(song_to_play.path());
+			std::cout << song_to_play.to_string() << std::endl;
+
+			m_playback.begin_song();
+			if(prefetched) {
+				m_prefetcher.play(m_buffer);
 			}
 			else {
-				std::cout << "Unknown schema for " << song_to_play.path() << std::endl;
+				auto opened = open_song(song_to_play, m_sharing_manager);
+				m_decoder.decode(
+					std::move(std::get<0>(opened)), 
+					m_buffer, 
+					std::get<1>(opened)
+				);
 			}
-			m_decoder.decode(std::move(stream), m_buffer, song_type);
 		}
 		catch(std::exception& ex) {
 			std::cout << "Error: " << ex.what() << std::endl;
 		}
+		m_playback.end_song();
 	}
 }
 
 void core::execute_next_action()
 {
-	switch(m_next_action) {
+	switch(m_next_action.exchange(playlist_actions::none)) {
 		case playlist_actions::next:
 			m_playlist.next();
 			break;
@@ -161,24 +296,82 @@ void core::execute_next_action()
 		default:
 			break;
 	}
-	m_next_action = playlist_actions::none;
 }
 
-Json::Value core::callback(session& sess, std::string data)
+// m_playlist_mutex should be locked when calling this. Atomic batches 
+// hold the stop back until they commit, so rolling one back never cuts 
+// the current song short.
+void core::stop_decoding()
+{
+	if(m_in_atomic_batch) {
+		m_stop_deferred = true;
+		return;
+	}
+	m_decoder.stop_decode();
+	m_prefetcher.stop();
+}
+
+// m_playlist_mutex should be locked when calling this. Like stopping, it's 
+// held back during atomic batches so a rollback keeps the prefetched songs.
+void core::update_prefetch()
+{
+	if(m_in_atomic_batch) {
+		m_prefetch_deferred = true;
+		return;
+	}
+	m_prefetcher.prefetch(m_playlist.upcoming(m_songs_to_prefetch));
+}
+
+float core::percent_so_far()
+{
+	if(m_prefetcher.is_playing())
+		return m_prefetcher.percent_so_far();
+	else
+		return m_decoder.percent_so_far();
+}
+
+void core::callback(session& sess, session::encoding_type encoding, const char* data, 
+	size_t size, session::reply_type reply)
 {
 	Json::Value result(Json::objectValue);
 	try {
-		Json::Value root;
-		Json::Reader reader;
-		if(!reader.parse(data, root) || !root.isMember("type"))
+		std::string type;
+		Json::Value params;
+		if(encoding == session::encoding_type::json) {
+			Json::Value root;
+			Json::Reader reader;
+			if(!reader.parse(data, data + size, root) || !root.isMember("type"))
+				throw fatal_exception();
+			type = root["type"].asString();
+			params.swap(root["params"]);
+		}
+		else if(!read_msgpack_request(data, size, type, params))
 			throw fatal_exception();
-		else {
-			std::string type = root["type"].asString();
-			auto iter = m_commands.find(type);
-			if(iter == m_commands.end())
-				throw std::runtime_error("Invalid command type");
-			result = iter->second(this, root["params"]);
+		auto async_iter = m_async_commands.find(type);
+		if(async_iter != m_async_commands.end()) {
+			// The command replies by itself
+			async_iter->second(this, params, reply);
+			return;
 		}
+		auto pooled_iter = m_pooled_commands.find(type);
+		if(pooled_iter != m_pooled_commands.end()) {
+			auto command = pooled_iter->second;
+			m_command_pool.post(
+				[this, command, params, reply]() {
+					reply(run_command(command, params));
+				}
+			);
+			return;
+		}
+		auto session_iter = m_session_commands.find(type);
+		if(session_iter != m_session_commands.end()) {
+			reply(session_iter->second(this, sess, params));
+			return;
+		}
+		auto iter = m_commands.find(type);
+		if(iter == m_commands.end())
+			throw std::runtime_error("Invalid command type");
+		result = iter->second(this, params);
 	}
 	catch(fatal_exception& ex) {
 		std::cout << "Fatal\n";
@@ -188,7 +381,17 @@ Json::Value core::callback(session& sess, std::string data)
 		result["result"] = false;
 		result["message"] = ex.what();
 	}
-	return result;
+	reply(std::move(result));
+}
+
+Json::Value core::run_command(const command_type& command, const Json::Value& params)
+{
+	try {
+		return command(this, params);
+	}
+	catch(std::exception& ex) {
+		return json_error(ex.what());
+	}
 }
 
 Json::Value core::json_success() const
@@ -206,78 +409,314 @@ Json::Value core::json_error(std::string error_msg) const
 	return output;
 }
 
-event_manager::time_point core::time_point_from_json(const Json::Value& value)
+auto core::sequence_from_json(const Json::Value& value) -> sequence_type
 {
-	const auto param = value.asUInt64();
-	const auto duration = event_manager::time_point::duration(param);
-	return event_manager::time_point(duration);
+	return value.asUInt64();
+}
+
+// Clients send back the "timestamp" they got, which is a sequence number 
+// in the event log.
+Json::Value core::event_range_to_json(const event_manager::event_range& range)
+{
+	Json::Value output(Json::objectValue);
+	if(range.resync_required) {
+		output = json_error("Resync required");
+		output["resync"] = true;
+	}
+	else {
+		output = json_success();
+		output["events"] = Json::Value(Json::arrayValue);
+		for(const auto& event : range.events)
+			output["events"].append(event.json_data());
+	}
+	output["timestamp"] = static_cast<Json::UInt64>(range.next);
+	return output;
 }
 
-bool core::is_index_still_valid(const time_point& timestamp, size_t index)
+// Deleting, inserting or moving a song shifts every song after it, so any 
+// of those at or before index since timestamp makes it stale.
+bool core::is_index_still_valid(sequence_type timestamp, size_t index)
 {
-	auto erase_events = m_event_manager.find_new_events(timestamp, "delete_song");
-	for(const auto& event : erase_events) {
-		// TODO: create a class for events
+	auto deletions = m_event_manager.find_new_events(timestamp, event_kind::delete_songs);
+	auto insertions = m_event_manager.find_new_events(timestamp, event_kind::insert_songs);
+	auto moves = m_event_manager.find_new_events(timestamp, event_kind::move_song);
+	if(deletions.resync_required || insertions.resync_required || moves.resync_required)
+		return false;
+	for(const auto& event : deletions.events) {
+		for(const auto& deleted : event.json_data()["indexes"]) {
+			if(deleted.asUInt64() <= index)
+				return false;
+		}
+	}
+	for(const auto& event : insertions.events) {
 		if(event.json_data()["index"].asUInt64() <= index)
 			return false;
 	}
+	for(const auto& event : moves.events) {
+		const auto& data = event.json_data();
+		if(std::min(data["from"].asUInt64(), data["to"].asUInt64()) <= index)
+			return false;
+	}
 	return true;
 }
 
 // Commands
 
-Json::Value core::next_song(const Json::Value&) 
+Json::Value core::next_song(const Json::Value& params) 
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return next_song_unlocked(params);
+}
+
+Json::Value core::next_song_unlocked(const Json::Value&) 
+{
+	m_next_action = playlist_actions::next;
+	stop_decoding();
+	return json_success();
+}
+
+Json::Value core::previous_song(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return previous_song_unlocked(params);
+}
+
+Json::Value core::previous_song_unlocked(const Json::Value&)
 {
+	m_next_action = playlist_actions::prev;
+	stop_decoding();
+	m_playlist_cond.notify_one();
+	return json_success();
+}
+
+// Songs are plain strings unless fields are requested, in which case each 
+// one is an object holding its metadata.
+void core::show_playlist(const Json::Value& params, session::reply_type reply)
+{
+	static const Json::UInt max_limit_with_fields = 500;
+	if(!params.isNull() && !params.isObject())
+		return reply(json_error("'params' should be an object"));
+	if(!params.get("offset", 0).isUInt() || !params.get("limit", 0).isUInt())
+		return reply(json_error("'offset' and 'limit' should be unsigned integers"));
+	if(params.isMember("fields") && !params["fields"].isArray())
+		return reply(json_error("The 'fields' key should contain an array"));
+	std::set<std::string> fields;
+	for(const auto& field : params["fields"])
+		fields.insert(field.asString());
+	auto sequence = m_event_manager.next_sequence();
+	playlist::snapshot_source source;
+	Json::Value output = json_success();
 	{
-		locker_type _(m_playlist_mutex);
-		m_next_action = playlist_actions::next;
-		m_decoder.stop_decode();
+		playlist_locker_type _(m_playlist_mutex);
+		source = m_playlist.prepare_snapshot(std::atomic_load(&m_snapshot));
+		output["current"] = static_cast<Json::Int>(m_playlist.current_index());
+		output["version"] = static_cast<Json::UInt64>(m_playlist.version());
 	}
-	return json_success();
+	auto snapshot = publish_snapshot(source);
+	// Keeps the whole snapshot alive
+	std::shared_ptr<const std::vector<song>> songs(snapshot, &snapshot->songs);
+	output["timestamp"] = static_cast<Json::UInt64>(sequence);
+	const size_t offset = std::min<size_t>(params.get("offset", 0).asUInt(), songs->size());
+	size_t limit = songs->size();
+	if(params.isMember("limit"))
+		limit = params["limit"].asUInt();
+	if(!fields.empty())
+		limit = std::min<size_t>(limit, max_limit_with_fields);
+	const size_t end = offset + std::min(limit, songs->size() - offset);
+	output["offset"] = static_cast<Json::UInt64>(offset);
+	output["total"] = static_cast<Json::UInt64>(songs->size());
+	output["songs"] = Json::Value(Json::arrayValue);
+	if(fields.empty()) {
+		for(size_t i = offset; i < end; ++i)
+			output["songs"].append((*songs)[i].to_string());
+		return reply(std::move(output));
+	}
+	// Resolving paths and looking up the cache hits the filesystem
+	m_command_pool.post(
+		[this, songs, offset, end, fields, output, reply]() mutable {
+			std::vector<std::string> paths;
+			std::vector<size_t> positions;
+			for(size_t i = offset; i < end; ++i) {
+				const auto& item = (*songs)[i];
+				if(item.schema() != song::schema_type::file)
+					continue;
+				try {
+					paths.push_back(m_sharing_manager.find_full_path(item.path()));
+					positions.push_back(i);
+				}
+				catch(std::exception&) {
+					// No longer shared, it goes without metadata
+				}
+			}
+			auto on_infos = [this, songs, offset, end, fields, output, reply, positions]
+				(std::vector<metadata_fetcher::info_ptr> infos) mutable 
+			{
+				auto info_iter = infos.begin();
+				auto position_iter = positions.begin();
+				for(size_t i = offset; i < end; ++i) {
+					Json::Value entry(Json::objectValue);
+					entry["path"] = (*songs)[i].to_string();
+					if(position_iter != positions.end() && *position_iter == i) {
+						if(*info_iter)
+							add_song_fields(entry, **info_iter, fields);
+						++info_iter;
+						++position_iter;
+					}
+					output["songs"].append(std::move(entry));
+				}
+				reply(std::move(output));
+			};
+			try {
+				m_metadata_fetcher.fetch_all(paths, on_infos);
+			}
+			catch(std::exception& ex) {
+				reply(json_error(ex.what()));
+			}
+		}
+	);
 }
 
-Json::Value core::previous_song(const Json::Value&)
+// Clients replay the changes after the version they have. When they're too 
+// far behind, they page through a snapshot and continue from its version.
+Json::Value core::playlist_delta(const Json::Value& params)
 {
+	playlist::snapshot_source source;
+	Json::Value output;
 	{
-		locker_type _(m_playlist_mutex);
-		m_next_action = playlist_actions::prev;
-		m_decoder.stop_decode();
-		m_playlist_cond.notify_one();
+		playlist_locker_type _(m_playlist_mutex);
+		output = read_playlist_delta(params, source);
 	}
-	return json_success();
+	return complete_playlist_delta(params, std::move(output), source);
 }
 
-Json::Value core::show_playlist(const Json::Value& params)
+// Batches hold the lock all along anyway, so the snapshot is built with it
+Json::Value core::playlist_delta_unlocked(const Json::Value& params)
 {
-	auto now = event_manager::clock_type::now();
+	playlist::snapshot_source source;
+	auto output = read_playlist_delta(params, source);
+	return complete_playlist_delta(params, std::move(output), source);
+}
+
+// m_playlist_mutex should be locked when calling this. Fills source if a 
+// snapshot of the current version has to be built.
+Json::Value core::read_playlist_delta(const Json::Value& params, 
+	playlist::snapshot_source& source)
+{
+	if(!params.isObject() || !params["version"].isUInt64())
+		return json_error("Expected 'version' key");
+	if(!params.get("offset", 0).isUInt() || !params.get("limit", 0).isUInt())
+		return json_error("'offset' and 'limit' should be unsigned integers");
+	const auto version = params["version"].asUInt64();
+	const bool paging = params.isMember("offset");
+	const auto current_version = m_playlist.version();
+	std::vector<playlist::change_ptr> changes;
+	Json::Value output = json_success();
+	if(!paging && m_playlist.changes_since(version, changes)) {
+		output["changes"] = Json::Value(Json::arrayValue);
+		for(const auto& item : changes)
+			output["changes"].append(change_to_json(*item));
+	}
+	else if(!paging || version == current_version) {
+		source = m_playlist.prepare_snapshot(std::atomic_load(&m_snapshot));
+	}
+	else {
+		return output;
+	}
+	output["version"] = static_cast<Json::UInt64>(current_version);
+	output["current"] = static_cast<Json::Int>(m_playlist.current_index());
+	return output;
+}
+
+// Doesn't need m_playlist_mutex, the snapshot is built from source or 
+// taken from the last one published.
+Json::Value core::complete_playlist_delta(const Json::Value& params, Json::Value output, 
+	const playlist::snapshot_source& source)
+{
+	static const Json::UInt max_limit = 5000;
+	if(!output["result"].asBool() || output.isMember("changes"))
+		return output;
+	playlist::snapshot_ptr snapshot;
+	if(!output.isMember("version")) {
+		// Keep paging through the same snapshot, even if the playlist changed
+		const auto version = params["version"].asUInt64();
+		snapshot = std::atomic_load(&m_snapshot);
+		if(!snapshot || snapshot->version != version)
+			return json_error("Snapshot no longer available");
+		output["version"] = static_cast<Json::UInt64>(version);
+	}
+	else {
+		snapshot = publish_snapshot(source);
+	}
+	const auto& songs = snapshot->songs;
+	const size_t offset = std::min<size_t>(params.get("offset", 0).asUInt(), songs.size());
+	const size_t limit = std::min(params.get("limit", 1000).asUInt(), max_limit);
+	const size_t end = std::min(songs.size(), offset + limit);
+	Json::Value& page = output["snapshot"];
+	page["songs"] = Json::Value(Json::arrayValue);
+	for(size_t i = offset; i < end; ++i)
+		page["songs"].append(songs[i].to_string());
+	page["offset"] = static_cast<Json::UInt64>(offset);
+	page["total"] = static_cast<Json::UInt64>(songs.size());
+	return output;
+}
+
+// Builds the snapshot without holding the playlist lock. It's published 
+// unless a newer one already was, so the next one starts from it.
+playlist::snapshot_ptr core::publish_snapshot(const playlist::snapshot_source& source)
+{
+	auto output = playlist::build_snapshot(source);
+	auto latest = std::atomic_load(&m_snapshot);
+	while(!latest || latest->version < output->version) {
+		if(std::atomic_compare_exchange_weak(&m_snapshot, &latest, output))
+			break;
+	}
+	return output;
+}
+
+Json::Value core::change_to_json(const playlist::change& a_change)
+{
+	using change_type = playlist::change::change_type;
 	Json::Value output(Json::objectValue);
-	{
-		// Lock to retrieve songs
-		locker_type _(m_playlist_mutex);
-		const auto& songs = m_playlist.songs();
+	if(a_change.type == change_type::add_songs) {
+		output["type"] = "add_songs";
 		output["songs"] = Json::Value(Json::arrayValue);
-		for(const auto& item : songs) {
+		for(const auto& item : a_change.songs)
 			output["songs"].append(item.to_string());
-		}
-		output["current"] = static_cast<Json::Int>(m_playlist.current_index());
 	}
-	output["result"] = true;
-	output["timestamp"] = static_cast<Json::UInt64>(
-		now.time_since_epoch().count()
-	);
+	else if(a_change.type == change_type::insert_songs) {
+		output["type"] = "insert_songs";
+		output["index"] = static_cast<Json::UInt64>(a_change.index);
+		output["songs"] = Json::Value(Json::arrayValue);
+		for(const auto& item : a_change.songs)
+			output["songs"].append(item.to_string());
+	}
+	else if(a_change.type == change_type::move_song) {
+		output["type"] = "move_song";
+		output["from"] = static_cast<Json::UInt64>(a_change.index);
+		output["to"] = static_cast<Json::UInt64>(a_change.destination);
+	}
+	else if(a_change.type == change_type::delete_songs) {
+		output["type"] = "delete_songs";
+		output["indexes"] = Json::Value(Json::arrayValue);
+		for(auto index : a_change.indexes)
+			output["indexes"].append(static_cast<Json::UInt64>(index));
+	}
+	else
+		output["type"] = "clear";
 	return output;
 }
 
-Json::Value core::playlist_mode(const Json::Value&)
+Json::Value core::playlist_mode(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return playlist_mode_unlocked(params);
+}
+
+Json::Value core::playlist_mode_unlocked(const Json::Value&)
 {
-	playlist::mode mode;
-	{
-		locker_type _(m_playlist_mutex);
-		mode = m_playlist.playlist_mode();
-	}
 	Json::Value output(Json::objectValue);
 	output["result"] = true;
-	if(mode == playlist::mode::random_order)
+	if(m_playlist.playlist_mode() == playlist::mode::random_order)
 		output["mode"] = "shuffle";
 	else
 		output["mode"] = "default";
@@ -285,9 +724,14 @@ Json::Value core::playlist_mode(const Json::Value&)
 }
 
 Json::Value core::set_playlist_mode(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return set_playlist_mode_unlocked(params);
+}
+
+Json::Value core::set_playlist_mode_unlocked(const Json::Value& params)
 {
 	auto param = params.asString();
-	locker_type _(m_playlist_mutex);
 	if(param == "shuffle")
 		m_playlist.playlist_mode(playlist::mode::random_order);
 	else if(param == "default")
@@ -298,14 +742,19 @@ Json::Value core::set_playlist_mode(const Json::Value& params)
 	return json_success();
 }
 
-Json::Value core::clear_playlist(const Json::Value&)
+Json::Value core::clear_playlist(const Json::Value& params)
 {
-	{
-		locker_type _(m_playlist_mutex);
-		m_next_action = playlist_actions::none;
-		m_decoder.stop_decode();
-		m_playlist.clear();
-	}
+	playlist_locker_type _(m_playlist_mutex);
+	return clear_playlist_unlocked(params);
+}
+
+Json::Value core::clear_playlist_unlocked(const Json::Value&)
+{
+	m_next_action = playlist_actions::none;
+	stop_decoding();
+	m_playlist.clear();
+	// Nothing's upcoming, so every prefetched song is discarded
+	update_prefetch();
 	return json_success();
 }
 
@@ -323,24 +772,40 @@ Json::Value core::play(const Json::Value&)
 	return json_success();
 }
 
-Json::Value core::player_status(const Json::Value&)
+Json::Value core::player_status(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return player_status_unlocked(params);
+}
+
+Json::Value core::player_status_unlocked(const Json::Value&)
 {
-	playlist::mode mode;
-	{
-		locker_type _(m_playlist_mutex);
-		mode = m_playlist.playlist_mode();
-	}
 	Json::Value output(Json::objectValue);
 	output["result"] = true;
 	output["status"] = m_playback.is_stream_active() ? "playing" : "paused";
-	output["current_song_percent"] = m_decoder.percent_so_far();
-	if(mode == playlist::mode::random_order)
+	output["current_song_percent"] = percent_so_far();
+	if(m_playlist.playlist_mode() == playlist::mode::random_order)
 		output["playlist_mode"] = "shuffle";
 	else
 		output["playlist_mode"] = "default";
 	return output;
 }
 
+Json::Value core::underrun_stats(const Json::Value&)
+{
+	auto to_json = [](const playback_manager::underrun_stats& stats) {
+		Json::Value output(Json::objectValue);
+		output["underruns"] = static_cast<Json::UInt64>(stats.underruns);
+		output["frames"] = static_cast<Json::UInt64>(stats.frames);
+		return output;
+	};
+	Json::Value output(Json::objectValue);
+	output["result"] = true;
+	output["song"] = to_json(m_playback.song_underruns());
+	output["total"] = to_json(m_playback.total_underruns());
+	return output;
+}
+
 Json::Value core::list_shared_dirs(const Json::Value&)
 {
 	auto dirs = m_sharing_manager.shared_directories();
@@ -355,56 +820,80 @@ Json::Value core::list_shared_dirs(const Json::Value&)
 Json::Value core::list_directory(const Json::Value& params)
 {
 	auto param = params.asString();
-	const auto& root_dir = m_sharing_manager.find_directory(param);
+	auto root_dir = m_sharing_manager.find_directory(param);
 	Json::Value output(Json::objectValue);
 	output["directories"] = Json::Value(Json::arrayValue);
 	output["files"] = Json::Value(Json::arrayValue);
 	for(const auto& dir : root_dir.directories()) {
-		output["directories"].append(dir.name().string());
+		output["directories"].append(dir.name().to_string());
 	}
 	for(const auto& file : root_dir.files())
-		output["files"].append(file.name());
+		output["files"].append(file.name().to_string());
 	output["result"] = true;
 	return output;
 }
 
 Json::Value core::add_shared_songs(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return add_shared_songs_unlocked(params);
+}
+
+Json::Value core::add_shared_songs_unlocked(const Json::Value& params)
 {
 	if(!params.isObject() || !params.isMember("base_path") || !params.isMember("songs"))
 		return json_error("Expected 'base_path' and 'songs' keys");
 	auto base_path = params["base_path"].asString();
-	const auto& root_dir = m_sharing_manager.find_directory(base_path);
+	try {
+		m_sharing_manager.find_directory(base_path);
+	}
+	catch(std::exception&) {
+		return json_error("Base path not found");
+	}
 	std::vector<std::string> songs;
-	locker_type _(m_playlist_mutex);
+	std::vector<song> to_add;
 	for(const auto& key : params["songs"]) {
-		// TODO: check if it exists
 		auto song_path = base_path + "/" + key.asString();
-		m_playlist.add_song(song_path);
+		to_add.emplace_back(song_path);
 		songs.push_back(std::move(song_path));
 	}
+	m_playlist.add_songs(std::move(to_add));
 	// If the playlist was empty, awaken the decoding thread
 	if(!m_playlist.has_current()) {
 		m_next_action = playlist_actions::next;
 	}
+	else {
+		update_prefetch();
+	}
 	m_event_manager.add_songs_add_event(songs);
 	m_playlist_cond.notify_one();
 	return json_success();
 }
 
 Json::Value core::add_youtube_songs(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return add_youtube_songs_unlocked(params);
+}
+
+Json::Value core::add_youtube_songs_unlocked(const Json::Value& params)
 {
 	if(!params.isArray())
 		return json_error("'params' should be an array of identifiers.");
 	std::vector<std::string> songs;
-	locker_type _(m_playlist_mutex);
+	std::vector<song> to_add;
 	for(const auto& item : params) {
 		auto id = item.asString();
-		m_playlist.add_song(song(id, song::schema_type::youtube_stream));
+		to_add.emplace_back(id, song::schema_type::youtube_stream);
 		songs.push_back("youtube://" + id);
 	}
+	m_playlist.add_songs(std::move(to_add));
 	if(!m_playlist.has_current()) {
 		m_next_action = playlist_actions::next;
 	}
+	else {
+		update_prefetch();
+	}
 	m_event_manager.add_songs_add_event(songs);
 	m_playlist_cond.notify_one();
 	return json_success();
@@ -412,59 +901,243 @@ Json::Value core::add_youtube_songs(const Json::Value& params)
 
 Json::Value core::new_events(const Json::Value& params)
 {
-	auto events_tuple = m_event_manager.get_new_events(
-		time_point_from_json(params)
+	return event_range_to_json(
+		m_event_manager.get_new_events(sequence_from_json(params))
 	);
-	Json::Value output(Json::objectValue);
-	output["events"] = Json::Value(Json::arrayValue);
-	for(const auto& event : std::get<0>(events_tuple))
-		output["events"].append(event.json_data());
-	output["result"] = true;
-	output["timestamp"] = static_cast<Json::UInt64>(
-		std::get<1>(events_tuple).time_since_epoch().count()
+}
+
+// The session only holds a weak reference, so once it's gone the next 
+// event unsubscribes it.
+Json::Value core::subscribe(session& sess, const Json::Value& params)
+{
+	auto start = params.isNull() ? event_manager::from_now : sequence_from_json(params);
+	std::weak_ptr<session> weak_session = sess.shared_from_this();
+	const bool use_msgpack = sess.encoding() == session::encoding_type::msgpack;
+	sess.start_streaming();
+	return event_range_to_json(
+		m_event_manager.subscribe(
+			[weak_session, use_msgpack](const event_manager::serialized_event& data) {
+				auto target = weak_session.lock();
+				return target && target->push(use_msgpack ? data.msgpack() : data.json());
+			},
+			start
+		)
 	);
-	return output;
+}
+
+Json::Value core::set_encoding(session& sess, const Json::Value& params)
+{
+	if(!params.isObject() || !params["encoding"].isString())
+		return json_error("Expected 'encoding' key");
+	const auto name = params["encoding"].asString();
+	if(name == "json")
+		sess.set_encoding(session::encoding_type::json);
+	else if(name == "msgpack")
+		sess.set_encoding(session::encoding_type::msgpack);
+	else
+		return json_error("Unknown encoding");
+	return json_success();
 }
 
 Json::Value core::delete_songs(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return delete_songs_unlocked(params);
+}
+
+Json::Value core::delete_songs_unlocked(const Json::Value& params)
 {
 	if(!params.isObject() || !params.isMember("timestamp") || !params.isMember("indexes"))
 		return json_error("Expected 'timestamp' and 'index' keys");
 	if(!params["indexes"].isArray() || params["indexes"].empty())
 		return json_error("Expected a list of integers.");
-	auto timestamp = time_point_from_json(params["timestamp"]);
+	auto timestamp = sequence_from_json(params["timestamp"]);
 	std::vector<size_t> indexes;
 	const auto& json_indexes = params["indexes"];
 	for(const auto& index : json_indexes) {
 		indexes.push_back(index.asUInt64());
 	}
 	std::sort(indexes.begin(), indexes.end());
-	bool should_alter_decoder = false;
-
-	{
-		locker_type _(m_playlist_mutex);
-		if(!is_index_still_valid(timestamp, indexes.back()) || indexes.back() >= m_playlist.song_count())
-			return json_error("Indexes have been altered");
-		for(auto iter = indexes.rbegin(); iter != indexes.rend(); ++iter) {
-			if(static_cast<int>(*iter) == m_playlist.current_index())
-				should_alter_decoder = true;
-			m_playlist.delete_song(*iter);
-		}
-	}
+	indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+	if(!is_index_still_valid(timestamp, indexes.back()) || indexes.back() >= m_playlist.song_count())
+		return json_error("Indexes have been altered");
+	const auto current = m_playlist.current_index();
+	const bool should_alter_decoder = current != -1 && std::binary_search(
+		indexes.begin(), 
+		indexes.end(), 
+		static_cast<size_t>(current)
+	);
+	m_playlist.delete_songs(indexes);
+	update_prefetch();
 	m_event_manager.add_delete_songs_event(indexes);
 	if(should_alter_decoder) {
 		m_next_action = playlist_actions::none;
-		m_decoder.stop_decode();
+		stop_decoding();
+	}
+	return json_success();
+}
+
+Json::Value core::insert_songs(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return insert_songs_unlocked(params);
+}
+
+Json::Value core::insert_songs_unlocked(const Json::Value& params)
+{
+	if(!params.isObject() || !params.isMember("timestamp") || !params.isMember("index"))
+		return json_error("Expected 'timestamp' and 'index' keys");
+	if(!params.isMember("base_path") || !params["songs"].isArray())
+		return json_error("Expected 'base_path' and 'songs' keys");
+	auto timestamp = sequence_from_json(params["timestamp"]);
+	const auto index = params["index"].asUInt64();
+	auto base_path = params["base_path"].asString();
+	try {
+		m_sharing_manager.find_directory(base_path);
+	}
+	catch(std::exception&) {
+		return json_error("Base path not found");
+	}
+	std::vector<std::string> songs;
+	std::vector<song> to_add;
+	for(const auto& key : params["songs"]) {
+		auto song_path = base_path + "/" + key.asString();
+		to_add.emplace_back(song_path);
+		songs.push_back(std::move(song_path));
 	}
+	if(!is_index_still_valid(timestamp, index) || !m_playlist.insert_songs(index, std::move(to_add)))
+		return json_error("Index has been altered");
+	if(!m_playlist.has_current()) {
+		m_next_action = playlist_actions::next;
+	}
+	else {
+		update_prefetch();
+	}
+	m_event_manager.add_insert_songs_event(index, songs);
+	m_playlist_cond.notify_one();
 	return json_success();
 }
 
+Json::Value core::move_song(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return move_song_unlocked(params);
+}
+
+Json::Value core::move_song_unlocked(const Json::Value& params)
+{
+	if(!params.isObject() || !params.isMember("timestamp") || !params.isMember("from") 
+		|| !params.isMember("to"))
+	{
+		return json_error("Expected 'timestamp', 'from' and 'to' keys");
+	}
+	auto timestamp = sequence_from_json(params["timestamp"]);
+	const auto from = params["from"].asUInt64();
+	const auto to = params["to"].asUInt64();
+	if(!is_index_still_valid(timestamp, std::max(from, to)) || !m_playlist.move_song(from, to))
+		return json_error("Indexes have been altered");
+	update_prefetch();
+	m_event_manager.add_move_song_event(from, to);
+	return json_success();
+}
+
+// Steps run in order on the calling thread. Playlist commands share a 
+// single acquisition of the playlist lock; atomic batches hold it all along 
+// and undo their playlist changes and events if any step fails. Decoding 
+// is only stopped once they commit.
+Json::Value core::batch(const Json::Value& params)
+{
+	static const Json::ArrayIndex max_commands = 64;
+	// These act on the audio output, which can't be rolled back
+	static const std::set<std::string> irreversible_commands = { "play", "pause" };
+	if(!params.isObject() || !params["commands"].isArray())
+		return json_error("Expected 'commands' key");
+	if(params["commands"].size() > max_commands)
+		return json_error("Too many commands in a batch");
+	if(!params.get("atomic", false).isBool())
+		return json_error("The 'atomic' key should contain a boolean");
+	const bool atomic = params.get("atomic", false).asBool();
+	std::unique_lock<std::mutex> lock(m_playlist_mutex);
+	std::unique_ptr<playlist::transaction> changes;
+	std::unique_ptr<event_manager::transaction> events;
+	const auto next_action = m_next_action.load();
+	if(atomic) {
+		changes.reset(new playlist::transaction(m_playlist));
+		events.reset(new event_manager::transaction(m_event_manager));
+		m_in_atomic_batch = true;
+		m_stop_deferred = false;
+		m_prefetch_deferred = false;
+	}
+	Json::Value output = json_success();
+	Json::Value& results = output["results"] = Json::Value(Json::arrayValue);
+	for(const auto& step : params["commands"]) {
+		const auto type = (step.isObject() && step["type"].isString()) ? 
+			step["type"].asString() : std::string();
+		auto unlocked_iter = m_unlocked_commands.find(type);
+		auto iter = m_commands.find(type);
+		auto pooled_iter = m_pooled_commands.find(type);
+		Json::Value result;
+		if(type == "batch" || (iter == m_commands.end() && pooled_iter == m_pooled_commands.end()))
+			result = json_error("Command can't be batched");
+		else if(atomic && irreversible_commands.count(type))
+			result = json_error("Command can't be undone");
+		else if(unlocked_iter != m_unlocked_commands.end())
+			result = run_command(unlocked_iter->second, step["params"]);
+		else if(iter != m_commands.end())
+			result = run_command(iter->second, step["params"]);
+		else {
+			// These don't use the playlist, so there's no need to block it
+			if(!atomic)
+				lock.unlock();
+			result = run_command(pooled_iter->second, step["params"]);
+			if(!atomic)
+				lock.lock();
+		}
+		const bool failed = !result["result"].asBool();
+		results.append(std::move(result));
+		if(failed) {
+			output["result"] = false;
+			if(atomic) {
+				// The events are discarded along with the transaction, the 
+				// prefetcher was never touched
+				m_in_atomic_batch = false;
+				changes.reset();
+				m_next_action = next_action;
+				// Snapshots of the rolled back versions don't match the 
+				// playlist anymore
+				auto latest = std::atomic_load(&m_snapshot);
+				while(latest && latest->version > m_playlist.version()) {
+					if(std::atomic_compare_exchange_weak(&m_snapshot, &latest, playlist::snapshot_ptr()))
+						break;
+				}
+				output["message"] = "Batch rolled back";
+				return output;
+			}
+		}
+	}
+	if(atomic) {
+		m_in_atomic_batch = false;
+		changes->commit();
+		if(m_stop_deferred)
+			stop_decoding();
+		if(m_prefetch_deferred)
+			update_prefetch();
+		events->commit();
+	}
+	return output;
+}
+
 Json::Value core::set_current_song(const Json::Value& params)
+{
+	playlist_locker_type _(m_playlist_mutex);
+	return set_current_song_unlocked(params);
+}
+
+Json::Value core::set_current_song_unlocked(const Json::Value& params)
 {
 	if(!params.isObject() || !params.isMember("timestamp") || !params.isMember("index"))
 		return json_error("Expected 'timestamp' and 'index' keys");
-	auto timestamp = time_point_from_json(params["timestamp"]);
-	locker_type _(m_playlist_mutex);
+	auto timestamp = sequence_from_json(params["timestamp"]);
 	const auto index = params["index"].asUInt64();
 	if(!is_index_still_valid(timestamp, index))
 		return json_error("Index has been altered");
@@ -472,18 +1145,81 @@ Json::Value core::set_current_song(const Json::Value& params)
 		return json_error("Failed to set song");
 	else {
 		m_next_action = playlist_actions::none;
-		m_decoder.stop_decode();
+		stop_decoding();
 		m_playlist_cond.notify_one();
 		return json_success();
 	}
 }
 
-Json::Value core::song_info(const Json::Value& params)
+Json::Value core::artwork(const Json::Value& params)
+{
+	if(!params.isObject() || !params["id"].isString())
+		return json_error("Expected 'id' key");
+	if(params.isMember("thumbnail") && !params["thumbnail"].isBool())
+		return json_error("The 'thumbnail' key should contain a boolean");
+	auto picture = artwork_store::instance.find(params["id"].asString());
+	if(!picture)
+		return json_error("Artwork not found");
+	Json::Value output(Json::objectValue);
+	output["result"] = true;
+	if(params.get("thumbnail", false).asBool()) {
+		output["mime"] = picture->thumbnail_mime();
+		output["data"] = base64_encode(picture->thumbnail());
+	}
+	else {
+		output["mime"] = picture->mime();
+		output["data"] = base64_encode(picture->data());
+	}
+	return output;
+}
+
+Json::Value core::indexer_status(const Json::Value&)
+{
+	auto status = m_indexer.current_status();
+	Json::Value output(Json::objectValue);
+	output["result"] = true;
+	output["state"] = to_string(status.current_state);
+	output["directories_indexed"] = Json::UInt64(status.directories_indexed);
+	output["pending_directories"] = Json::UInt64(status.pending_directories);
+	output["files_found"] = Json::UInt64(status.files_found);
+	output["files_indexed"] = Json::UInt64(status.files_indexed);
+	return output;
+}
+
+Json::Value core::search(const Json::Value& params)
+{
+	static const Json::UInt max_limit = 500;
+	if(!params.isObject() || !params.isMember("query") || !params["query"].isString())
+		return json_error("Expected 'query' key");
+	if(!params.get("offset", 0).isUInt() || !params.get("limit", 0).isUInt())
+		return json_error("'offset' and 'limit' should be unsigned integers");
+	auto offset = params.get("offset", 0).asUInt();
+	auto limit = std::min(params.get("limit", 50).asUInt(), max_limit);
+	size_t total = 0;
+	auto matches = m_search_index.search(params["query"].asString(), offset, limit, total);
+	Json::Value output(Json::objectValue);
+	output["result"] = true;
+	output["total"] = Json::UInt64(total);
+	output["songs"] = Json::Value(Json::arrayValue);
+	for(const auto& match : matches) {
+		Json::Value song(Json::objectValue);
+		song["path"] = m_sharing_manager.shared_path(match.path);
+		if(auto info = song_database::instance.known_song_info(match.path)) {
+			song["title"] = info->title();
+			song["artist"] = info->artist();
+			song["album"] = info->album();
+		}
+		output["songs"].append(std::move(song));
+	}
+	return output;
+}
+
+void core::song_info(const Json::Value& params, session::reply_type reply)
 {
 	if(!params.isObject() || !params.isMember("song"))
-		return json_error("Expected 'song' key");
+		return reply(json_error("Expected 'song' key"));
 	if(params.isMember("fields") && !params["fields"].isArray())
-		return json_error("The 'fields' key should contain an array");
+		return reply(json_error("The 'fields' key should contain an array"));
 	auto song_path = params["song"].asString();
 	std::set<std::string> to_retrieve;
 	if(params.isMember("fields") && params["fields"].size() > 0) {
@@ -497,7 +1233,7 @@ Json::Value core::song_info(const Json::Value& params)
 			"artist",
 			"title",
 			"length",
-			"picture",
+			"picture_id",
 			"picture_mime"
 		};
 	}
@@ -509,20 +1245,35 @@ Json::Value core::song_info(const Json::Value& params)
 	else {
 		full_path = m_sharing_manager.find_full_path(song_path);
 	}
-	const auto& info = song_database::instance.song_info(full_path);
-	Json::Value output(Json::objectValue);
-	output["result"] = true;
-	if(to_retrieve.count("album"))
+	// Either called right away or on a metadata worker thread
+	auto on_info = [this, to_retrieve, reply](metadata_fetcher::info_ptr info) {
+		if(!info)
+			return reply(json_error("Failed to read song information"));
+		Json::Value output(Json::objectValue);
+		output["result"] = true;
+		add_song_fields(output, *info, to_retrieve);
+		reply(std::move(output));
+	};
+	m_metadata_fetcher.fetch(full_path, on_info);
+}
+
+void core::add_song_fields(Json::Value& output, const song_information& info, 
+	const std::set<std::string>& fields)
+{
+	if(fields.count("album"))
 		output["album"] = info.album();
-	if(to_retrieve.count("artist"))
+	if(fields.count("artist"))
 		output["artist"] = info.artist();
-	if(to_retrieve.count("title"))
+	if(fields.count("title"))
 		output["title"] = info.title();
-	if(to_retrieve.count("length"))
+	if(fields.count("length"))
 		output["length"] = Json::UInt64(info.length().count());
-	if(to_retrieve.count("picture"))
-		output["picture"] = info.picture();
-	if(to_retrieve.count("picture_mime"))
+	if(fields.count("picture_id"))
+		output["picture_id"] = info.picture_id();
+	if(fields.count("picture_mime"))
 		output["picture_mime"] = info.picture_mime();
-	return output;
+	if(fields.count("picture")) {
+		auto picture = artwork_store::instance.find(info.picture_id());
+		output["picture"] = picture ? base64_encode(picture->data()) : "";
+	}
 }
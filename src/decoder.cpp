@@ -22,8 +22,9 @@
 
 // TODO: create a base class for decoders.
 
-decoder::decoder()
-: m_current_song_type(song_type::none)
+decoder::decoder(unsigned sample_rate)
+: m_mp3_decoder(sample_rate), m_generic_decoder(sample_rate), 
+m_current_song_type(song_type::none)
 {
 
 }
@@ -31,6 +32,7 @@ decoder::decoder()
 void decoder::decode(song_stream stream, types::decode_buffer_type& buffer, song_type type)
 {
 	m_current_song_type = type;
+	stream.advise_sequential();
 	if(m_current_song_type == song_type::mp3)
 		m_mp3_decoder.decode(std::move(stream), buffer);
 	else
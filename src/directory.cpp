@@ -15,106 +15,104 @@
  * MA 02110-1301, USA.
  */
 
-#include <boost/filesystem.hpp>
-#include <algorithm>
+#include <set>
+#include <stdexcept>
 #include "directory.h"
+#include "directory_tree.h"
 
-using lock_guard = std::lock_guard<std::mutex>;
-using namespace boost::filesystem;
+directory::load_observer_type directory::load_observer;
+directory::change_observer_type directory::change_observer;
 
-directory::directory(path_type full_path)
-: m_path(std::move(full_path)), m_mutex(new std::mutex()), m_loaded(false)
+directory::directory()
+: m_tree(nullptr), m_id(0), m_generation(0)
 {
-	m_name = m_path.end();
-	--m_name;
+
 }
 
-directory::directory(path_type full_path, only_for_search)
-: m_path(std::move(full_path))
+directory::directory(directory_tree* tree, uint32_t id, uint32_t generation)
+: m_tree(tree), m_id(id), m_generation(generation)
 {
-	m_name = m_path.end();
-	--m_name;
+
 }
 
-auto directory::name() const -> const path_type&
+boost::string_ref directory::name() const
 {
-	return *m_name;
+	return m_tree ? m_tree->name(*this) : boost::string_ref();
 }
 
-auto directory::path() const -> const path_type&
+auto directory::path() const -> path_type
 {
-	return m_path;
+	return m_tree ? path_type(m_tree->path(*this)) : path_type();
 }
 
-auto directory::directories() const -> const directories_list&
+auto directory::directories() const -> directories_list
 {
-	load();
-	return m_directories;
+	return m_tree ? m_tree->directories(*this) : directories_list();
 }
 
-auto directory::files() const -> const files_list&
+auto directory::files() const -> files_list
 {
-	load();
-	return m_files;
+	return m_tree ? m_tree->files(*this) : files_list();
 }
 
-const directory& directory::find_directory(path_type::iterator start, 
-	path_type::iterator end) const
+void directory::load() const
 {
-	if(start == end)
-		return *this;
-	else {
-		load();
-		auto to_search = directory(*start, only_for_search());
-		auto iter = std::lower_bound(
-			m_directories.begin(),
-			m_directories.end(),
-			to_search
-		);
-		if(iter == m_directories.end() || iter->name() != to_search.name())
-			throw std::runtime_error("path not found");
-		++start;
-		return iter->find_directory(start, end);
-	}
+	if(m_tree)
+		m_tree->load(*this);
 }
 
-void directory::load() const
+bool directory::is_loaded() const
 {
-	lock_guard _(*m_mutex);
-	if(m_loaded)
-		return;
-	directory_iterator end;
-  	for(directory_iterator iter(m_path); iter != end; ++iter) {
-  		if (is_directory(*iter)) {
-        	m_directories.emplace_back(iter->path());
-     	}
-     	// TODO: move the extension check to some object
-     	else if(is_regular_file(*iter) && is_media_file(extension(*iter))) {
-     		m_files.emplace_back(iter->path().filename().string());
-     	}
-   	}
-   	std::sort(m_directories.begin(), m_directories.end());
-   	std::sort(m_files.begin(), m_files.end());
-	m_loaded = true;
+	return m_tree && m_tree->is_loaded(*this);
 }
 
-bool directory::is_media_file(const std::string& extension)
+bool directory::is_valid() const
 {
-	static std::set<std::string> extensions = { ".mp3", ".mp4", ".avi" };
-	return extensions.count(extension) == 1;
+	return m_tree && m_tree->is_valid(*this);
+}
+
+void directory::refresh_entry(const std::string& name) const
+{
+	if(m_tree)
+		m_tree->refresh_entry(*this, name);
+}
+
+void directory::unload() const
+{
+	if(m_tree)
+		m_tree->unload(*this);
+}
+
+std::string directory::path_for_file(boost::string_ref file_name) const
+{
+	std::string output = m_tree ? m_tree->path(*this) : std::string();
+	output += '/';
+	output.append(file_name.data(), file_name.size());
+	return output;
 }
 
-void directory::add_directory(directory dir)
+directory directory::find_directory(boost::string_ref relative_path) const
 {
-	m_directories.push_back(std::move(dir));
+	if(!m_tree)
+		throw std::runtime_error("path not found");
+	return m_tree->find_directory(*this, relative_path);
 }
 
-std::string directory::path_for_file(const std::string& file_name) const
+void directory::set_load_observer(load_observer_type observer)
 {
-	return (m_path / file_name).string();
+	load_observer = std::move(observer);
 }
 
-bool operator<(const directory& lhs, const directory& rhs)
+void directory::set_change_observer(change_observer_type observer)
 {
-	return lhs.name() < rhs.name();
+	change_observer = std::move(observer);
+}
+
+bool directory::is_media_file(const std::string& extension)
+{
+	static std::set<std::string> extensions = { 
+		".mp3", ".mp4", ".avi", ".m4a", ".aac", ".ogg", ".oga", ".opus", 
+		".flac", ".wav", ".wma"
+	};
+	return extensions.count(extension) == 1;
 }
@@ -0,0 +1,499 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "directory_tree.h"
+
+using namespace boost::filesystem;
+
+// Unused slots are only reclaimed once there's a fair amount of them
+static const size_t min_unused_to_compact = 4096;
+
+// Ranges can only grow when they're at the end of the storage, so they 
+// are moved there first if needed. The old slots become unused.
+template<typename T>
+static void move_range_to_end(std::vector<T>& storage, uint32_t& first, 
+	uint32_t count, size_t& unused)
+{
+	if(first + count == storage.size())
+		return;
+	if(storage.capacity() < storage.size() + count + 1)
+		storage.reserve(std::max(storage.capacity() * 2, storage.size() + count + 1));
+	const uint32_t old_first = first;
+	first = storage.size();
+	for(uint32_t i = 0; i < count; ++i)
+		storage.push_back(storage[old_first + i]);
+	unused += count;
+}
+
+template<typename T>
+static void insert_into_range(std::vector<T>& storage, uint32_t& first, 
+	uint32_t& count, size_t& unused, uint32_t position, T value)
+{
+	move_range_to_end(storage, first, count, unused);
+	storage.insert(storage.begin() + first + position, std::move(value));
+	++count;
+}
+
+template<typename T>
+static void erase_from_range(std::vector<T>& storage, uint32_t first, 
+	uint32_t& count, size_t& unused, uint32_t position)
+{
+	auto start = storage.begin() + first;
+	std::move(start + position + 1, start + count, start + position);
+	--count;
+	if(first + count + 1 == storage.size())
+		storage.pop_back();
+	else
+		++unused;
+}
+
+template<typename T>
+static void release_range(std::vector<T>& storage, uint32_t first, 
+	uint32_t& count, size_t& unused)
+{
+	if(count > 0 && first + count == storage.size())
+		storage.erase(storage.begin() + first, storage.end());
+	else
+		unused += count;
+	count = 0;
+}
+
+static void notify(const std::vector<std::pair<directory::change_type, std::string>>& changes,
+	const directory::change_observer_type& observer)
+{
+	if(observer) {
+		for(const auto& change : changes)
+			observer(change.first, change.second);
+	}
+}
+
+constexpr directory_tree::node_id directory_tree::root_id;
+constexpr directory_tree::node_id directory_tree::no_node;
+
+directory_tree::directory_tree(const std::vector<std::string>& shared_dirs)
+: m_unused_children(0), m_unused_files(0)
+{
+	m_nodes.push_back(node{name_pool::name_ref(), root_id, 0, 0, 0, 0, 0, true, true});
+	for(auto dir : shared_dirs) {
+		// Otherwise the directory's name would be empty
+		while(dir.size() > 1 && dir.back() == '/')
+			dir.pop_back();
+		m_children.push_back(allocate_node(m_names.intern(dir), root_id));
+	}
+	std::sort(
+		m_children.begin(),
+		m_children.end(),
+		[&](node_id lhs, node_id rhs) {
+			return node_name(lhs) < node_name(rhs);
+		}
+	);
+	m_nodes[root_id].child_count = m_children.size();
+}
+
+directory directory_tree::root()
+{
+	locker_type _(m_mutex);
+	return directory(this, root_id, m_nodes[root_id].generation);
+}
+
+directory directory_tree::find_directory(string_ref shared_path)
+{
+	return find_directory(root(), shared_path);
+}
+
+std::string directory_tree::find_full_path(string_ref shared_path)
+{
+	const auto slash = shared_path.find('/');
+	locker_type _(m_mutex);
+	auto child = find_child(m_nodes[root_id], shared_path.substr(0, slash));
+	if(child == no_node)
+		throw std::runtime_error("path not found");
+	std::string output = node_path(child);
+	if(slash != string_ref::npos)
+		output.append(shared_path.data() + slash, shared_path.size() - slash);
+	return output;
+}
+
+void directory_tree::populate(const directory& dir, std::vector<std::string> directories, 
+	std::vector<std::string> files)
+{
+	std::sort(directories.begin(), directories.end());
+	std::sort(files.begin(), files.end());
+	changes_list changes;
+	{
+		locker_type _(m_mutex);
+		auto target = find_node(dir);
+		if(!target || target->loaded)
+			return;
+		const node_id id = dir.m_id;
+		// Allocating nodes might move them around
+		const uint32_t first_child = m_children.size();
+		for(const auto& name : directories)
+			m_children.push_back(allocate_node(m_names.intern(name), id));
+		const uint32_t first_file = m_files.size();
+		for(const auto& name : files)
+			m_files.emplace_back(m_names.intern(name));
+		auto& current = m_nodes[id];
+		current.first_child = first_child;
+		current.child_count = directories.size();
+		current.first_file = first_file;
+		current.file_count = files.size();
+		current.loaded = true;
+		if(directory::change_observer) {
+			const auto dir_path = node_path(id);
+			for(const auto& name : files)
+				changes.emplace_back(directory::change_type::file_added, dir_path + "/" + name);
+		}
+	}
+	notify(changes, directory::change_observer);
+}
+
+auto directory_tree::name(const directory& dir) -> string_ref
+{
+	locker_type _(m_mutex);
+	return find_node(dir) ? node_name(dir.m_id) : string_ref();
+}
+
+std::string directory_tree::path(const directory& dir)
+{
+	locker_type _(m_mutex);
+	return find_node(dir) ? node_path(dir.m_id) : std::string();
+}
+
+directory::directories_list directory_tree::directories(const directory& dir)
+{
+	load(dir);
+	directory::directories_list output;
+	locker_type _(m_mutex);
+	if(auto target = find_node(dir)) {
+		output.reserve(target->child_count);
+		for(uint32_t i = 0; i < target->child_count; ++i) {
+			auto child = m_children[target->first_child + i];
+			output.push_back(directory(this, child, m_nodes[child].generation));
+		}
+	}
+	return output;
+}
+
+directory::files_list directory_tree::files(const directory& dir)
+{
+	load(dir);
+	locker_type _(m_mutex);
+	auto target = find_node(dir);
+	if(!target)
+		return directory::files_list();
+	auto start = m_files.begin() + target->first_file;
+	return directory::files_list(start, start + target->file_count);
+}
+
+void directory_tree::load(const directory& dir)
+{
+	std::string dir_path;
+	{
+		locker_type _(m_mutex);
+		auto target = find_node(dir);
+		if(!target || target->loaded)
+			return;
+		dir_path = node_path(dir.m_id);
+	}
+	// Notify before reading, so that any change made while reading is 
+	// still seen by the observer.
+	if(directory::load_observer)
+		directory::load_observer(dir);
+	std::vector<std::string> directories, files;
+	directory_iterator end;
+	for(directory_iterator iter(dir_path); iter != end; ++iter) {
+		if(is_directory(*iter))
+			directories.push_back(iter->path().filename().string());
+		// TODO: move the extension check to some object
+		else if(is_regular_file(*iter) && directory::is_media_file(extension(*iter)))
+			files.push_back(iter->path().filename().string());
+	}
+	populate(dir, std::move(directories), std::move(files));
+}
+
+bool directory_tree::is_loaded(const directory& dir)
+{
+	locker_type _(m_mutex);
+	auto target = find_node(dir);
+	return target && target->loaded;
+}
+
+bool directory_tree::is_valid(const directory& dir)
+{
+	locker_type _(m_mutex);
+	return find_node(dir) != nullptr;
+}
+
+void directory_tree::refresh_entry(const directory& dir, const std::string& name)
+{
+	std::string entry_path;
+	{
+		locker_type _(m_mutex);
+		auto target = find_node(dir);
+		if(!target || !target->loaded)
+			return;
+		entry_path = node_path(dir.m_id) + "/" + name;
+	}
+	boost::system::error_code ec;
+	const auto entry_status = status(entry_path, ec);
+	const bool is_dir = is_directory(entry_status);
+	const bool is_file = !is_dir && is_regular_file(entry_status) && 
+		directory::is_media_file(boost::filesystem::path(name).extension().string());
+	changes_list changes;
+	{
+		locker_type _(m_mutex);
+		auto target = find_node(dir);
+		if(!target || !target->loaded)
+			return;
+		const node_id id = dir.m_id;
+		auto position = child_position(*target, name);
+		const bool has_dir = position < target->child_count && 
+			node_name(m_children[target->first_child + position]) == name;
+		if(has_dir && !is_dir) {
+			free_node(m_children[target->first_child + position]);
+			erase_from_range(m_children, target->first_child, target->child_count, 
+				m_unused_children, position);
+			changes.emplace_back(directory::change_type::directory_removed, entry_path);
+		}
+		// An existing directory keeps whatever it had already loaded
+		else if(!has_dir && is_dir) {
+			auto child = allocate_node(m_names.intern(name), id);
+			auto& current = m_nodes[id];
+			insert_into_range(m_children, current.first_child, current.child_count, 
+				m_unused_children, position, child);
+		}
+		auto& current = m_nodes[id];
+		position = file_position(current, name);
+		const bool has_file = position < current.file_count && 
+			m_files[current.first_file + position].name() == name;
+		if(has_file && !is_file) {
+			erase_from_range(m_files, current.first_file, current.file_count, 
+				m_unused_files, position);
+			changes.emplace_back(directory::change_type::file_removed, entry_path);
+		}
+		else if(!has_file && is_file) {
+			insert_into_range(m_files, current.first_file, current.file_count, 
+				m_unused_files, position, music_file(m_names.intern(name)));
+			changes.emplace_back(directory::change_type::file_added, entry_path);
+		}
+		compact();
+	}
+	notify(changes, directory::change_observer);
+}
+
+void directory_tree::unload(const directory& dir)
+{
+	// The shared directories never go away
+	if(dir.m_id == root_id)
+		return;
+	changes_list changes;
+	{
+		locker_type _(m_mutex);
+		if(!find_node(dir))
+			return;
+		free_children(dir.m_id);
+		compact();
+		changes.emplace_back(directory::change_type::directory_removed, node_path(dir.m_id));
+	}
+	notify(changes, directory::change_observer);
+}
+
+directory directory_tree::find_directory(const directory& dir, string_ref relative_path)
+{
+	directory current = dir;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while(!relative_path.empty()) {
+		const auto slash = relative_path.find('/');
+		const auto component = relative_path.substr(0, slash);
+		relative_path.remove_prefix(
+			slash == string_ref::npos ? relative_path.size() : slash + 1
+		);
+		if(component.empty() || component == ".")
+			continue;
+		auto target = find_node(current);
+		// Reading a directory can't be done while holding the lock
+		if(target && !target->loaded) {
+			lock.unlock();
+			load(current);
+			lock.lock();
+			target = find_node(current);
+		}
+		auto child = target ? find_child(*target, component) : no_node;
+		if(child == no_node)
+			throw std::runtime_error("path not found");
+		current = directory(this, child, m_nodes[child].generation);
+	}
+	return current;
+}
+
+auto directory_tree::find_node(const directory& dir) -> node*
+{
+	if(dir.m_tree != this || dir.m_id >= m_nodes.size())
+		return nullptr;
+	auto& target = m_nodes[dir.m_id];
+	if(!target.alive || target.generation != dir.m_generation)
+		return nullptr;
+	return &target;
+}
+
+// Shared directories are named after the last component of their path
+auto directory_tree::node_name(node_id id) const -> string_ref
+{
+	const auto& target = m_nodes[id];
+	const auto name = target.name.view();
+	if(id == root_id || target.parent != root_id)
+		return name;
+	const auto slash = name.rfind('/');
+	if(slash == string_ref::npos || slash + 1 == name.size())
+		return name;
+	return name.substr(slash + 1);
+}
+
+std::string directory_tree::node_path(node_id id) const
+{
+	std::vector<string_ref> components;
+	size_t length = 0;
+	for(auto current = id; current != root_id; current = m_nodes[current].parent) {
+		components.push_back(m_nodes[current].name.view());
+		length += components.back().size() + 1;
+	}
+	std::string output;
+	output.reserve(length);
+	for(auto iter = components.rbegin(); iter != components.rend(); ++iter) {
+		if(!output.empty() && output.back() != '/')
+			output.push_back('/');
+		output.append(iter->data(), iter->size());
+	}
+	return output;
+}
+
+uint32_t directory_tree::child_position(const node& parent, string_ref name) const
+{
+	auto start = m_children.begin() + parent.first_child;
+	auto iter = std::lower_bound(
+		start,
+		start + parent.child_count,
+		name,
+		[&](node_id child, string_ref name) {
+			return node_name(child) < name;
+		}
+	);
+	return iter - start;
+}
+
+uint32_t directory_tree::file_position(const node& parent, string_ref name) const
+{
+	auto start = m_files.begin() + parent.first_file;
+	auto iter = std::lower_bound(
+		start,
+		start + parent.file_count,
+		name,
+		[](const music_file& file, string_ref name) {
+			return file.name() < name;
+		}
+	);
+	return iter - start;
+}
+
+auto directory_tree::find_child(const node& parent, string_ref name) const -> node_id
+{
+	auto position = child_position(parent, name);
+	if(position == parent.child_count)
+		return no_node;
+	auto child = m_children[parent.first_child + position];
+	return node_name(child) == name ? child : no_node;
+}
+
+auto directory_tree::allocate_node(name_pool::name_ref name, node_id parent) -> node_id
+{
+	if(!m_free_nodes.empty()) {
+		auto id = m_free_nodes.back();
+		m_free_nodes.pop_back();
+		auto& target = m_nodes[id];
+		target = node{name, parent, target.generation, 0, 0, 0, 0, false, true};
+		return id;
+	}
+	m_nodes.push_back(node{name, parent, 0, 0, 0, 0, 0, false, true});
+	return m_nodes.size() - 1;
+}
+
+// Bumping the generation invalidates every handle to this node
+void directory_tree::free_node(node_id id)
+{
+	free_children(id);
+	auto& target = m_nodes[id];
+	target.alive = false;
+	++target.generation;
+	m_free_nodes.push_back(id);
+}
+
+void directory_tree::free_children(node_id id)
+{
+	std::vector<node_id> pending(1, id);
+	while(!pending.empty()) {
+		auto& target = m_nodes[pending.back()];
+		pending.pop_back();
+		for(uint32_t i = 0; i < target.child_count; ++i) {
+			auto child = m_children[target.first_child + i];
+			auto& child_node = m_nodes[child];
+			child_node.alive = false;
+			++child_node.generation;
+			m_free_nodes.push_back(child);
+			pending.push_back(child);
+		}
+		release_range(m_children, target.first_child, target.child_count, m_unused_children);
+		release_range(m_files, target.first_file, target.file_count, m_unused_files);
+		target.loaded = false;
+	}
+}
+
+// Packs every range together once enough slots are unused
+void directory_tree::compact()
+{
+	if(m_unused_children >= min_unused_to_compact && m_unused_children * 2 > m_children.size()) {
+		std::vector<node_id> children;
+		children.reserve(m_children.size() - m_unused_children);
+		for(auto& current : m_nodes) {
+			const auto first = current.first_child;
+			current.first_child = children.size();
+			if(current.child_count > 0) {
+				auto start = m_children.begin() + first;
+				children.insert(children.end(), start, start + current.child_count);
+			}
+		}
+		m_children.swap(children);
+		m_unused_children = 0;
+	}
+	if(m_unused_files >= min_unused_to_compact && m_unused_files * 2 > m_files.size()) {
+		std::vector<music_file> files;
+		files.reserve(m_files.size() - m_unused_files);
+		for(auto& current : m_nodes) {
+			const auto first = current.first_file;
+			current.first_file = files.size();
+			if(current.file_count > 0) {
+				auto start = m_files.begin() + first;
+				files.insert(files.end(), start, start + current.file_count);
+			}
+		}
+		m_files.swap(files);
+		m_unused_files = 0;
+	}
+}
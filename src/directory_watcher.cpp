@@ -0,0 +1,194 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include "directory_watcher.h"
+#include "song_database.h"
+
+using clock_type = std::chrono::steady_clock;
+
+static const uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | 
+	IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+directory_watcher::directory_watcher(song_database& database, 
+	std::chrono::milliseconds coalesce_delay)
+: m_database(database), m_coalesce_delay(coalesce_delay), m_running(true),
+m_reported_limit(false)
+{
+	m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(m_inotify_fd < 0)
+		throw std::runtime_error("Failed to initialize inotify");
+	m_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_stop_fd < 0) {
+		close(m_inotify_fd);
+		throw std::runtime_error("Failed to create eventfd");
+	}
+	directory::set_load_observer(
+		[this](const directory& dir) {
+			watch(dir);
+		}
+	);
+	m_thread = std::thread(&directory_watcher::run, this);
+}
+
+directory_watcher::~directory_watcher()
+{
+	stop();
+	close(m_inotify_fd);
+	close(m_stop_fd);
+}
+
+void directory_watcher::stop()
+{
+	if(m_running) {
+		m_running = false;
+		directory::set_load_observer(nullptr);
+		uint64_t value = 1;
+		if(write(m_stop_fd, &value, sizeof(value)) < 0)
+			std::cout << "Failed to stop directory watcher" << std::endl;
+		if(m_thread.joinable())
+			m_thread.join();
+	}
+}
+
+void directory_watcher::watch(const directory& dir)
+{
+	int wd = inotify_add_watch(m_inotify_fd, dir.path().c_str(), watch_mask);
+	locker_type _(m_mutex);
+	if(wd < 0) {
+		if(errno == ENOSPC && !m_reported_limit) {
+			std::cout << "Ran out of inotify watches, raise " 
+					  << "fs.inotify.max_user_watches to see every change" 
+					  << std::endl;
+			m_reported_limit = true;
+		}
+		return;
+	}
+	// Watching the same path again gives back the same descriptor
+	m_watches[wd] = dir;
+}
+
+void directory_watcher::run()
+{
+	std::set<pending_entry> pending;
+	clock_type::time_point deadline, burst_deadline;
+	while(m_running) {
+		int timeout = -1;
+		if(!pending.empty()) {
+			auto wait_until = std::min(deadline, burst_deadline);
+			timeout = std::max<int64_t>(
+				0, 
+				std::chrono::duration_cast<std::chrono::milliseconds>(
+					wait_until - clock_type::now()
+				).count()
+			);
+		}
+		pollfd fds[2] = { { m_inotify_fd, POLLIN, 0 }, { m_stop_fd, POLLIN, 0 } };
+		if(poll(fds, 2, timeout) < 0 && errno != EINTR)
+			break;
+		if(fds[1].revents & POLLIN)
+			break;
+		if(fds[0].revents & POLLIN) {
+			auto now = clock_type::now();
+			if(pending.empty())
+				burst_deadline = now + m_coalesce_delay * 10;
+			// Wait until there's a quiet period, but don't let an endless 
+			// stream of events delay everything forever
+			deadline = now + m_coalesce_delay;
+			read_events(pending);
+		}
+		auto now = clock_type::now();
+		if(!pending.empty() && (now >= deadline || now >= burst_deadline)) {
+			apply(pending);
+			pending.clear();
+		}
+	}
+}
+
+void directory_watcher::read_events(std::set<pending_entry>& pending)
+{
+	alignas(inotify_event) char buffer[16384];
+	while(true) {
+		ssize_t length = read(m_inotify_fd, buffer, sizeof(buffer));
+		if(length <= 0)
+			return;
+		for(char* ptr = buffer; ptr < buffer + length; ) {
+			auto event = reinterpret_cast<const inotify_event*>(ptr);
+			ptr += sizeof(inotify_event) + event->len;
+			if(event->mask & IN_Q_OVERFLOW) {
+				// A negative descriptor means everything has to be reloaded
+				pending.insert(pending_entry(-1, std::string()));
+			}
+			else if(event->mask & IN_IGNORED) {
+				locker_type _(m_mutex);
+				m_watches.erase(event->wd);
+			}
+			else if(event->len > 0) {
+				pending.insert(pending_entry(event->wd, event->name));
+			}
+		}
+	}
+}
+
+void directory_watcher::apply(const std::set<pending_entry>& pending)
+{
+	if(pending.begin()->first == -1) {
+		reload_everything();
+		return;
+	}
+	for(const auto& entry : pending) {
+		directory dir;
+		{
+			locker_type _(m_mutex);
+			auto iter = m_watches.find(entry.first);
+			if(iter == m_watches.end())
+				continue;
+			dir = iter->second;
+			// The directory is no longer part of the tree
+			if(!dir.is_valid()) {
+				inotify_rm_watch(m_inotify_fd, entry.first);
+				m_watches.erase(iter);
+				continue;
+			}
+		}
+		dir.refresh_entry(entry.second);
+		m_database.invalidate(dir.path_for_file(entry.second));
+	}
+}
+
+// Some events were lost. Every watched directory is read again the next
+// time it's used.
+void directory_watcher::reload_everything()
+{
+	std::vector<directory> directories;
+	{
+		locker_type _(m_mutex);
+		for(const auto& watch : m_watches)
+			directories.push_back(watch.second);
+	}
+	// Invalid handles are simply ignored
+	for(const auto& dir : directories)
+		dir.unload();
+}
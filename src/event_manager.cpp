@@ -15,12 +15,15 @@
  * MA 02110-1301, USA.
  */
 
+#include <algorithm>
+#include <jsoncpp/json/writer.h>
 #include "event_manager.h"
+#include "msgpack.h"
 
 using locker_type = std::lock_guard<std::mutex>;
 
-event::event(std::shared_ptr<Json::Value> data)
-: m_data(std::move(data))
+event::event(event_kind kind, std::shared_ptr<Json::Value> data)
+: m_data(std::move(data)), m_kind(kind)
 {
 
 }
@@ -30,9 +33,74 @@ const Json::Value& event::json_data() const
 	return *m_data;
 }
 
-std::string event::event_type() const
+event_kind event::kind() const
 {
-	return (*m_data)["type"].asString();
+	return m_kind;
+}
+
+// event_manager::serialized_event
+
+event_manager::serialized_event::serialized_event(const Json::Value& data)
+: m_data(data)
+{
+
+}
+
+auto event_manager::serialized_event::json() const 
+	-> const std::shared_ptr<const std::string>&
+{
+	if(!m_json) {
+		Json::FastWriter writer;
+		m_json = std::make_shared<std::string>(writer.write(m_data));
+	}
+	return m_json;
+}
+
+auto event_manager::serialized_event::msgpack() const 
+	-> const std::shared_ptr<const std::string>&
+{
+	if(!m_msgpack)
+		m_msgpack = std::make_shared<std::string>(msgpack_frame(m_data));
+	return m_msgpack;
+}
+
+// event_manager::transaction
+
+// The innermost transaction created by each thread
+static thread_local event_manager::transaction* current_transaction = nullptr;
+
+event_manager::transaction::transaction(event_manager& manager)
+: m_manager(manager), m_previous(current_transaction)
+{
+	current_transaction = this;
+}
+
+event_manager::transaction::~transaction()
+{
+	current_transaction = m_previous;
+}
+
+void event_manager::transaction::commit()
+{
+	auto events = std::move(m_events);
+	m_events.clear();
+	// Nested transactions hand their events to the outer one
+	current_transaction = m_previous;
+	for(auto& item : events)
+		m_manager.add_event(item.first, std::move(item.second));
+	current_transaction = this;
+}
+
+// event_manager
+
+constexpr event_manager::sequence_type event_manager::from_now;
+constexpr size_t event_manager::kind_count;
+
+event_manager::event_manager(size_t max_events, std::chrono::seconds max_age)
+: m_max_events(std::max<size_t>(max_events, 1)), m_max_age(max_age), 
+m_first(0), m_next(0), m_delivering(false)
+{
+	m_events.reserve(m_max_events);
 }
 
 void event_manager::add_songs_add_event(const std::vector<std::string>& songs)
@@ -45,10 +113,7 @@ void event_manager::add_songs_add_event(const std::vector<std::string>& songs)
 	event["songs"] = Json::Value(Json::arrayValue);
 	for(const auto& song : songs)
 		event["songs"].append(song);
-	locker_type _(m_mutex);
-	m_events.insert(
-		std::make_pair(clock_type::now(), std::move(event_ptr))
-	);
+	add_event(event_kind::add_songs, std::move(event_ptr));
 }
 
 void event_manager::add_play_song_event(int index)
@@ -59,10 +124,7 @@ void event_manager::add_play_song_event(int index)
 	Json::Value& event = *event_ptr;
 	event["type"] = "play_song";
 	event["index"] = index;
-	locker_type _(m_mutex);
-	m_events.insert(
-		std::make_pair(clock_type::now(), std::move(event_ptr))
-	);
+	add_event(event_kind::play_song, std::move(event_ptr));
 }
 
 void event_manager::add_delete_songs_event(const std::vector<size_t>& indexes)
@@ -76,24 +138,7 @@ void event_manager::add_delete_songs_event(const std::vector<size_t>& indexes)
 	auto &json_array = event["indexes"];
 	for(auto index : indexes)
 		json_array.append(static_cast<Json::UInt64>(index));
-	locker_type _(m_mutex);
-	m_events.insert(
-		std::make_pair(clock_type::now(), std::move(event_ptr))
-	);	
-}
-
-auto event_manager::get_new_events(time_point start_point) 
-	-> std::tuple<std::vector<event>, time_point>
-{
-	locker_type _(m_mutex);
-	auto iter = m_events.lower_bound(start_point);
-	auto now = clock_type::now();
-	std::vector<event> output;
-	while(iter != m_events.end()) {
-		output.push_back(iter->second);
-		++iter;
-	}
-	return std::make_tuple(std::move(output), now);
+	add_event(event_kind::delete_songs, std::move(event_ptr));
 }
 
 void event_manager::add_pause_event()
@@ -103,10 +148,7 @@ void event_manager::add_pause_event()
 	);
 	Json::Value& event = *event_ptr;
 	event["type"] = "pause";
-	locker_type _(m_mutex);
-	m_events.insert(
-		std::make_pair(clock_type::now(), std::move(event_ptr))
-	);
+	add_event(event_kind::pause, std::move(event_ptr));
 }
 
 void event_manager::add_play_event()
@@ -116,10 +158,7 @@ void event_manager::add_play_event()
 	);
 	Json::Value& event = *event_ptr;
 	event["type"] = "play";
-	locker_type _(m_mutex);
-	m_events.insert(
-		std::make_pair(clock_type::now(), std::move(event_ptr))
-	);
+	add_event(event_kind::play, std::move(event_ptr));
 }
 
 void event_manager::add_playlist_mode_changed_event(std::string value)
@@ -130,22 +169,188 @@ void event_manager::add_playlist_mode_changed_event(std::string value)
 	Json::Value& event = *event_ptr;
 	event["type"] = "playlist_mode_changed";
 	event["mode"] = std::move(value);
-	locker_type _(m_mutex);
-	m_events.insert(
-		std::make_pair(clock_type::now(), std::move(event_ptr))
+	add_event(event_kind::playlist_mode_changed, std::move(event_ptr));
+}
+
+void event_manager::add_insert_songs_event(size_t index, 
+	const std::vector<std::string>& songs)
+{
+	std::shared_ptr<Json::Value> event_ptr = std::make_shared<Json::Value>(
+		Json::objectValue
+	);
+	Json::Value& event = *event_ptr;
+	event["type"] = "insert_songs";
+	event["index"] = static_cast<Json::UInt64>(index);
+	event["songs"] = Json::Value(Json::arrayValue);
+	for(const auto& song : songs)
+		event["songs"].append(song);
+	add_event(event_kind::insert_songs, std::move(event_ptr));
+}
+
+void event_manager::add_move_song_event(size_t from, size_t to)
+{
+	std::shared_ptr<Json::Value> event_ptr = std::make_shared<Json::Value>(
+		Json::objectValue
 	);
+	Json::Value& event = *event_ptr;
+	event["type"] = "move_song";
+	event["from"] = static_cast<Json::UInt64>(from);
+	event["to"] = static_cast<Json::UInt64>(to);
+	add_event(event_kind::move_song, std::move(event_ptr));
 }
 
-std::vector<event> event_manager::find_new_events(time_point start_point, 
-	const std::string& type)
+auto event_manager::next_sequence() -> sequence_type
 {
 	locker_type _(m_mutex);
-	std::vector<event> output;
-	auto iter = m_events.lower_bound(start_point);
-	while(iter != m_events.end()) {
-		if(iter->second.event_type() == type)
-			output.push_back(iter->second);
-		++iter;
+	return m_next;
+}
+
+auto event_manager::get_new_events(sequence_type start) -> event_range
+{
+	locker_type _(m_mutex);
+	return new_events(start);
+}
+
+auto event_manager::find_new_events(sequence_type start, event_kind kind) 
+	-> event_range
+{
+	locker_type _(m_mutex);
+	drop_old_events(clock_type::now());
+	event_range output{ {}, m_next, start < m_first || start > m_next };
+	if(output.resync_required)
+		return output;
+	const auto& sequences = m_kind_index[static_cast<size_t>(kind)];
+	auto iter = std::lower_bound(sequences.begin(), sequences.end(), start);
+	for(; iter != sequences.end(); ++iter)
+		output.events.push_back(find_entry(*iter).data);
+	// Outer transactions hold the older events
+	std::vector<const transaction*> transactions;
+	for(auto ptr = current_transaction; ptr; ptr = ptr->m_previous) {
+		if(&ptr->m_manager == this)
+			transactions.push_back(ptr);
+	}
+	for(auto ptr = transactions.rbegin(); ptr != transactions.rend(); ++ptr) {
+		for(const auto& item : (*ptr)->m_events) {
+			if(item.first == kind)
+				output.events.emplace_back(item.first, item.second);
+		}
 	}
 	return output;
 }
+
+auto event_manager::subscribe(subscriber_type subscriber, sequence_type start) 
+	-> event_range
+{
+	locker_type _(m_mutex);
+	// Events still waiting to be delivered are before m_next, so they're 
+	// either part of the returned range or skipped by start
+	m_subscribers.push_back(std::make_shared<subscription>(
+		subscription{ std::move(subscriber), m_next, true }
+	));
+	if(start == from_now)
+		return event_range{ {}, m_next, false };
+	return new_events(start);
+}
+
+void event_manager::add_event(event_kind kind, std::shared_ptr<Json::Value> event_ptr)
+{
+	if(current_transaction && &current_transaction->m_manager == this) {
+		current_transaction->m_events.emplace_back(kind, std::move(event_ptr));
+		return;
+	}
+	const auto now = clock_type::now();
+	{
+		locker_type _(m_mutex);
+		drop_old_events(now);
+		if(m_next - m_first == m_max_events)
+			drop_first_event();
+		entry item{ m_next, now, event(kind, std::move(event_ptr)) };
+		if(!m_subscribers.empty())
+			m_undelivered.push_back(item);
+		if(m_events.size() < m_max_events)
+			m_events.push_back(std::move(item));
+		else
+			find_entry(m_next) = std::move(item);
+		m_kind_index[static_cast<size_t>(kind)].push_back(m_next);
+		++m_next;
+		if(m_delivering || m_undelivered.empty())
+			return;
+		m_delivering = true;
+	}
+	deliver();
+}
+
+// Only one thread delivers at a time, so subscribers see events in the 
+// order they're stored and never get called concurrently. Whoever adds 
+// an event while nobody is delivering takes over until the queue is 
+// empty. Each event is only encoded the way some subscriber wants it.
+void event_manager::deliver()
+{
+	std::vector<entry> events;
+	std::vector<subscription_ptr> subscribers;
+	while(true) {
+		{
+			locker_type _(m_mutex);
+			m_subscribers.erase(
+				std::remove_if(
+					m_subscribers.begin(), 
+					m_subscribers.end(), 
+					[](const subscription_ptr& ptr) { return !ptr->active; }
+				),
+				m_subscribers.end()
+			);
+			if(m_undelivered.empty()) {
+				m_delivering = false;
+				return;
+			}
+			events.swap(m_undelivered);
+			m_undelivered.clear();
+			subscribers = m_subscribers;
+		}
+		for(const auto& item : events) {
+			serialized_event data(item.data.json_data());
+			for(const auto& target : subscribers) {
+				if(!target->active || item.sequence < target->start)
+					continue;
+				// A failing subscriber is dropped, the rest still get it
+				try {
+					target->active = target->callback(data);
+				}
+				catch(std::exception&) {
+					target->active = false;
+				}
+			}
+		}
+	}
+}
+
+void event_manager::drop_old_events(clock_type::time_point now)
+{
+	if(m_max_age.count() == 0)
+		return;
+	while(m_first != m_next && now - find_entry(m_first).time > m_max_age)
+		drop_first_event();
+}
+
+void event_manager::drop_first_event()
+{
+	auto& item = find_entry(m_first);
+	m_kind_index[static_cast<size_t>(item.data.kind())].pop_front();
+	++m_first;
+}
+
+auto event_manager::find_entry(sequence_type sequence) -> entry&
+{
+	return m_events[sequence % m_max_events];
+}
+
+auto event_manager::new_events(sequence_type start) -> event_range
+{
+	drop_old_events(clock_type::now());
+	event_range output{ {}, m_next, start < m_first || start > m_next };
+	if(output.resync_required)
+		return output;
+	for(auto sequence = start; sequence != m_next; ++sequence)
+		output.events.push_back(find_entry(sequence).data);
+	return output;
+}
@@ -16,14 +16,22 @@
  */
 
 #include <stdexcept>
+#include <algorithm>
+#include <mutex>
 #include "generic_decoder.h"
 #include "song_stream.h"
+#include "sample_conversion.h"
+
+extern "C" {
+    #include <libavutil/channel_layout.h>
+    #include <libswresample/swresample.h>
+}
 
 int read_function(void* opaque, uint8_t* buf, int buf_size) 
 {
     auto& stream = *reinterpret_cast<song_stream*>(opaque);
     if(!stream.bytes_left())
-        return 0;
+        return AVERROR_EOF;
     auto available = stream.available();
     size_t bytes_to_copy = std::min(available, static_cast<size_t>(buf_size));
     std::copy(
@@ -35,47 +43,164 @@ int read_function(void* opaque, uint8_t* buf, int buf_size)
     return bytes_to_copy;
 }
 
+// FFmpeg 5.1 replaced the channel count and mask with AVChannelLayout
+static int channel_count(const AVCodecContext* ctx)
+{
+    #if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+    return ctx->ch_layout.nb_channels;
+    #else
+    return ctx->channels;
+    #endif
+}
+
+// Mono or stereo, planar float or 16 bit streams at the output rate don't 
+// need the resampler, the sample conversion kernels handle them.
+bool can_convert_directly(const AVCodecContext* ctx, unsigned sample_rate)
+{
+    const int channels = channel_count(ctx);
+    return static_cast<unsigned>(ctx->sample_rate) == sample_rate &&
+        (channels == 1 || channels == 2) &&
+        (ctx->sample_fmt == AV_SAMPLE_FMT_FLTP || ctx->sample_fmt == AV_SAMPLE_FMT_S16);
+}
+
+// Streams that don't say how their channels are laid out get the default 
+// layout for their channel count. Returns null on failure.
+static SwrContext* create_resampler(const AVCodecContext* ctx, unsigned sample_rate)
+{
+    #if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 24, 100)
+    AVChannelLayout input_layout = {};
+    AVChannelLayout output_layout = {};
+    if(ctx->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+        av_channel_layout_default(&input_layout, ctx->ch_layout.nb_channels);
+    else if(av_channel_layout_copy(&input_layout, &ctx->ch_layout) < 0)
+        return nullptr;
+    av_channel_layout_default(&output_layout, types::output_channels);
+    SwrContext* output = nullptr;
+    const int result = swr_alloc_set_opts2(
+        &output,
+        &output_layout,
+        AV_SAMPLE_FMT_S16,
+        sample_rate,
+        &input_layout,
+        ctx->sample_fmt,
+        ctx->sample_rate,
+        0,
+        nullptr
+    );
+    av_channel_layout_uninit(&input_layout);
+    return (result < 0) ? nullptr : output;
+    #else
+    const int64_t input_layout = ctx->channel_layout ? ctx->channel_layout :
+        av_get_default_channel_layout(ctx->channels);
+    return swr_alloc_set_opts(
+        nullptr,
+        AV_CH_LAYOUT_STEREO,
+        AV_SAMPLE_FMT_S16,
+        sample_rate,
+        input_layout,
+        ctx->sample_fmt,
+        ctx->sample_rate,
+        0,
+        nullptr
+    );
+    #endif
+}
+
+// Returns the new position, as libavformat expects.
 int64_t seek_function(void* opaque, int64_t offset, int whence)
 {
     auto& stream = *reinterpret_cast<song_stream*>(opaque);
-    if(whence == AVSEEK_SIZE) {
-        auto size = stream.size();
-        if(size > 0) {
-            return size;
-        }
+    const int64_t size = stream.size();
+    whence &= ~AVSEEK_FORCE;
+    if(whence == AVSEEK_SIZE)
+        return (size > 0) ? size : -1;
+    int64_t position;
+    switch(whence) {
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = stream.current_offset() + offset;
+            break;
+        case SEEK_END:
+            if(size <= 0)
+                return -1;
+            position = size + offset;
+            break;
+        default:
+            return -1;
     }
-    if(whence == SEEK_END)
+    if(position < 0 || (size > 0 && position > size))
         return -1;
-    if(stream.bytes_left()) {
-        stream.seek(offset);
-        return 1;
+    try {
+        stream.seek(position);
     }
-    else
+    catch(std::exception&) {
+        // Streams that can't be rewound
         return -1;
+    }
+    return position;
 }
 
-generic_decoder::generic_decoder()
+// Memory backed streams get a buffer big enough to hold most of a small
+// file, capped so huge files don't allocate a lot.
+size_t avio_buffer_size(song_stream& stream)
 {
+    const size_t default_size = 32 * 1024, max_size = 256 * 1024;
+    if(!stream.is_memory_backed())
+        return default_size;
+    return std::min(std::max(stream.size(), default_size), max_size);
+}
+
+generic_decoder::generic_decoder(unsigned sample_rate)
+: m_sample_rate(sample_rate), 
+m_packet(av_packet_alloc(), [](AVPacket* ptr) { av_packet_free(&ptr); }),
+m_frame(av_frame_alloc(), [](AVFrame* ptr) { av_frame_free(&ptr); }),
+m_running(false), m_percent(0)
+{
+	if(!m_packet || !m_frame)
+		throw std::runtime_error("Failed to allocate packet.");
+	#if LIBAVFORMAT_VERSION_INT < AV_VERSION_INT(58, 9, 100)
 	static std::once_flag flag;
 	std::call_once(flag, av_register_all);
+	#endif
 }
 
 void generic_decoder::decode(song_stream stream, types::decode_buffer_type &buffer)
 {
 	m_running = true;
+	m_percent = 0;
 
+    const size_t buffer_size = avio_buffer_size(stream);
+    auto avio_buffer = reinterpret_cast<unsigned char*>(av_malloc(buffer_size));
+    if(!avio_buffer)
+        throw std::runtime_error("Failed to allocate IO buffer.");
 	const std::shared_ptr<AVIOContext> avioContext(
         avio_alloc_context(
-            reinterpret_cast<unsigned char*>(av_malloc(8192)),
-            8192, 
+            avio_buffer,
+            buffer_size, 
             0, 
             &stream, 
             &read_function, 
             nullptr, 
             &seek_function
         ), 
-        &av_free
+        // libavformat may have replaced the buffer we gave it
+        [](AVIOContext* ptr) {
+            if(ptr)
+                av_freep(&ptr->buffer);
+            avio_context_free(&ptr);
+        }
     );
+    if(!avioContext) {
+        av_free(avio_buffer);
+        throw std::runtime_error("Failed to allocate IO context.");
+    }
+    // Reads of whole packets go straight from the mapped file into the 
+    // packet, skipping the intermediate buffer, and seeks are just pointer
+    // arithmetic.
+    if(stream.is_memory_backed())
+        avioContext->direct = 1;
 
     auto av_formatPtr = avformat_alloc_context();
     av_formatPtr->pb = avioContext.get();
@@ -85,11 +210,14 @@ void generic_decoder::decode(song_stream stream, types::decode_buffer_type &buff
         av_strerror(err_code, error, sizeof(error));
         throw std::runtime_error(error);
     }
-    const auto av_format = std::shared_ptr<AVFormatContext>(av_formatPtr, &avformat_free_context);
+    const auto av_format = std::shared_ptr<AVFormatContext>(
+        av_formatPtr, 
+        [](AVFormatContext* ptr) { avformat_close_input(&ptr); }
+    );
     
     int stream_id = -1;
     for (size_t i = 0; i < av_format->nb_streams; ++i) {
-        if (av_format->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+        if (av_format->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
             stream_id = i;
             break;
         }
@@ -97,40 +225,169 @@ void generic_decoder::decode(song_stream stream, types::decode_buffer_type &buff
     if(stream_id == -1) 
         throw std::runtime_error("Audio stream not found");
     
-    AVCodecContext *ctx = av_format->streams[stream_id]->codec;
-    AVCodec *codec = avcodec_find_decoder(ctx->codec_id);
-
+    const AVStream* av_stream = av_format->streams[stream_id];
+    const AVCodec *codec = avcodec_find_decoder(av_stream->codecpar->codec_id);
     if(codec == nullptr) {
         throw std::runtime_error("Failed to find codec.");
     }
-    if(avcodec_open2(ctx, codec, nullptr) < 0) {
+    const std::shared_ptr<AVCodecContext> ctx(
+        avcodec_alloc_context3(codec),
+        [](AVCodecContext* ptr) { avcodec_free_context(&ptr); }
+    );
+    if(!ctx || avcodec_parameters_to_context(ctx.get(), av_stream->codecpar) < 0) {
+        throw std::runtime_error("Failed to create codec context.");
+    }
+    ctx->pkt_timebase = av_stream->time_base;
+    if(avcodec_open2(ctx.get(), codec, nullptr) < 0) {
         throw std::runtime_error("Failed to open codec.");
     }
     
-    m_on_rate_change(ctx->sample_rate);
+    std::shared_ptr<SwrContext> resampler;
+    if(!can_convert_directly(ctx.get(), m_sample_rate)) {
+        resampler.reset(
+            create_resampler(ctx.get(), m_sample_rate),
+            [](SwrContext* ptr) { swr_free(&ptr); }
+        );
+        if(!resampler || swr_init(resampler.get()) < 0)
+            throw std::runtime_error("Failed to initialize resampler.");
+    }
+
+    // Progress is the last packet's timestamp against the stream's duration,
+    // falling back to the container's when the stream doesn't have one.
+    const double time_base = av_q2d(av_stream->time_base);
+    const int64_t start_time = (av_stream->start_time != AV_NOPTS_VALUE) ? 
+        av_stream->start_time : 0;
+    double duration = 0;
+    if(av_stream->duration != AV_NOPTS_VALUE && av_stream->duration > 0)
+        duration = av_stream->duration * time_base;
+    else if(av_format->duration != AV_NOPTS_VALUE && av_format->duration > 0)
+        duration = av_format->duration / double(AV_TIME_BASE);
 
-    AVPacket packet;
-    std::shared_ptr<AVFrame> frame{avcodec_alloc_frame(), &av_free};
-    av_init_packet(&packet);
-    while(m_running && av_read_frame(av_format.get(), &packet) >= 0)
+    AVPacket* packet = m_packet.get();
+    while(m_running && av_read_frame(av_format.get(), packet) >= 0)
     {
-        if(packet.stream_index == stream_id) {
-            int frame_decoded = 0;
-            avcodec_decode_audio4(ctx, frame.get(), &frame_decoded, &packet);
-            if(frame_decoded){
-                if(ctx->sample_fmt == AV_SAMPLE_FMT_S16) {
-                    buffer.put(
-                        (const uint16_t*)frame->extended_data[0], 
-                        (const uint16_t*)frame->extended_data[0] + frame->nb_samples * ctx->channels
-                    );
-                }
-                else {
-                    throw std::runtime_error("Needs resampling");
-                }
+        if(packet->stream_index == stream_id) {
+            const int64_t pts = (packet->pts != AV_NOPTS_VALUE) ? 
+                packet->pts : packet->dts;
+            if(duration > 0 && pts != AV_NOPTS_VALUE) {
+                const double position = (pts - start_time) * time_base;
+                m_percent = std::min(std::max(position / duration, 0.0), 1.0);
+            }
+            // We always drain every frame after sending, so the decoder
+            // can't be full here. Anything else is a broken packet, 
+            // which is just skipped.
+            if(avcodec_send_packet(ctx.get(), packet) == 0) {
+                if(!receive_frames(ctx.get(), resampler.get(), buffer))
+                    m_running = false;
+            }
+        }
+        av_packet_unref(packet);
+    }
+    // Flush the frames the decoder is still holding, and then whatever the
+    // resampler has buffered.
+    if(m_running && avcodec_send_packet(ctx.get(), nullptr) == 0) {
+        if(!receive_frames(ctx.get(), resampler.get(), buffer))
+            m_running = false;
+    }
+    if(m_running && resampler)
+        convert(resampler.get(), nullptr, 0, buffer);
+}
+
+// Converts every frame the decoder has ready. A single packet can 
+// contain several of them. Returns false if the buffer was interrupted.
+bool generic_decoder::receive_frames(AVCodecContext* ctx, SwrContext* resampler,
+    types::decode_buffer_type &buffer)
+{
+    AVFrame* frame = m_frame.get();
+    while(avcodec_receive_frame(ctx, frame) == 0) {
+        bool written;
+        if(resampler) {
+            written = convert(
+                resampler,
+                (const uint8_t**)frame->extended_data,
+                frame->nb_samples,
+                buffer
+            );
+        }
+        else {
+            written = convert_directly(
+                *frame, 
+                ctx->sample_fmt, 
+                channel_count(ctx), 
+                buffer
+            );
+        }
+        av_frame_unref(frame);
+        if(!written)
+            return false;
+    }
+    return true;
+}
+
+// Converts straight into the ring buffer's storage. Returns false if the 
+// buffer was interrupted.
+bool generic_decoder::convert(SwrContext* resampler, const uint8_t** input, 
+    int input_frames, types::decode_buffer_type &buffer)
+{
+    const size_t max_samples = (swr_get_out_samples(resampler, input_frames) + 1) * 
+        types::output_channels;
+    while(true) {
+        auto output = buffer.reserve(max_samples);
+        if(output.empty())
+            return false;
+        auto output_ptr = reinterpret_cast<uint8_t*>(output.data);
+        const int output_frames = output.size / types::output_channels;
+        int converted = swr_convert(
+            resampler, 
+            &output_ptr, 
+            output_frames, 
+            input, 
+            input_frames
+        );
+        if(converted < 0)
+            throw std::runtime_error("Failed to convert samples.");
+        buffer.commit(converted * types::output_channels);
+        if(converted < output_frames)
+            return true;
+        // The span was too small (e.g. it was at the end of the buffer). 
+        // A non null input with no frames retrieves what's been buffered 
+        // without flushing the resampler. 
+        if(input)
+            input_frames = 0;
+    }
+}
+
+// Same as convert, but without going through the resampler.
+bool generic_decoder::convert_directly(const AVFrame& frame, AVSampleFormat format,
+    int channels, types::decode_buffer_type &buffer)
+{
+    const size_t total_frames = frame.nb_samples;
+    size_t frames_done = 0;
+    while(frames_done < total_frames) {
+        auto output = buffer.reserve((total_frames - frames_done) * types::output_channels);
+        if(output.empty())
+            return false;
+        const size_t frames = output.size / types::output_channels;
+        if(format == AV_SAMPLE_FMT_FLTP) {
+            auto left = reinterpret_cast<const float*>(frame.extended_data[0]) + frames_done;
+            auto right = (channels == 2) ? 
+                reinterpret_cast<const float*>(frame.extended_data[1]) + frames_done :
+                left;
+            sample_conversion::planar_float_to_s16(left, right, output.data, frames);
+        }
+        else {
+            auto input = reinterpret_cast<const short*>(frame.extended_data[0]);
+            if(channels == 2) {
+                input += frames_done * 2;
+                std::copy(input, input + frames * 2, output.data);
             }
+            else
+                sample_conversion::mono_to_stereo_s16(input + frames_done, output.data, frames);
         }
-        av_free_packet(&packet);
+        buffer.commit(frames * types::output_channels);
+        frames_done += frames;
     }
+    return true;
 }
 
 void generic_decoder::stop_decode()
@@ -140,5 +397,5 @@ void generic_decoder::stop_decode()
 
 float generic_decoder::percent_so_far()
 {
-	return 0;
+	return m_percent;
 }
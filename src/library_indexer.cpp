@@ -0,0 +1,182 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <iostream>
+#include <algorithm>
+#ifdef __linux__
+	#include <unistd.h>
+	#include <sys/syscall.h>
+#endif
+#include "library_indexer.h"
+#include "sharing_manager.h"
+#include "song_database.h"
+
+// Moves the calling thread to the idle IO scheduling class, so it only 
+// gets disk time when nobody else wants it.
+static void lower_io_priority()
+{
+	#if defined(__linux__) && defined(SYS_ioprio_set)
+	const int ioprio_who_process = 1, ioprio_class_idle = 3, ioprio_class_shift = 13;
+	// A pid of 0 means the calling thread
+	syscall(SYS_ioprio_set, ioprio_who_process, 0, 
+		ioprio_class_idle << ioprio_class_shift);
+	#endif
+}
+
+library_indexer::library_indexer(const sharing_manager& manager, 
+	song_database& database, size_t thread_count, size_t operations_per_second)
+: m_manager(manager), m_database(database), 
+m_thread_count(std::max<size_t>(thread_count, 1)),
+m_operation_interval(
+	std::chrono::duration_cast<clock_type::duration>(std::chrono::seconds(1)) / 
+	std::max<size_t>(operations_per_second, 1)
+),
+m_active_workers(0), m_status{state::idle, 0, 0, 0, 0}
+{
+
+}
+
+library_indexer::~library_indexer()
+{
+	stop();
+}
+
+void library_indexer::start()
+{
+	locker_type _(m_mutex);
+	if(m_status.current_state != state::idle)
+		return;
+	for(const auto& root : m_manager.root().directories())
+		m_pending.push_back(root);
+	m_status.current_state = state::running;
+	m_status.pending_directories = m_pending.size();
+	m_next_operation = clock_type::now();
+	for(size_t i = 0; i < m_thread_count; ++i)
+		m_workers.emplace_back(&library_indexer::worker_loop, this);
+}
+
+void library_indexer::stop()
+{
+	{
+		locker_type _(m_mutex);
+		if(m_status.current_state == state::running)
+			m_status.current_state = state::stopped;
+		m_condition.notify_all();
+	}
+	for(auto& worker : m_workers) {
+		if(worker.joinable())
+			worker.join();
+	}
+}
+
+auto library_indexer::current_status() const -> status
+{
+	locker_type _(m_mutex);
+	return m_status;
+}
+
+void library_indexer::worker_loop()
+{
+	lower_io_priority();
+	locker_type lock(m_mutex);
+	while(m_status.current_state == state::running) {
+		if(m_pending.empty()) {
+			// Nothing left to do and nobody can add more work
+			if(m_active_workers == 0) {
+				m_status.current_state = state::finished;
+				m_condition.notify_all();
+			}
+			else
+				m_condition.wait(lock);
+			continue;
+		}
+		auto dir = std::move(m_pending.front());
+		m_pending.pop_front();
+		++m_active_workers;
+		lock.unlock();
+		try {
+			index(dir);
+		}
+		catch(std::exception& ex) {
+			std::cout << "Error indexing " << dir.path() << ": " << ex.what() << std::endl;
+		}
+		lock.lock();
+		--m_active_workers;
+		m_status.pending_directories = m_pending.size();
+		++m_status.directories_indexed;
+		m_condition.notify_all();
+	}
+}
+
+void library_indexer::index(const directory& dir)
+{
+	if(!acquire_budget())
+		return;
+	const auto directories = dir.directories();
+	const auto files = dir.files();
+	{
+		locker_type _(m_mutex);
+		for(const auto& child : directories)
+			m_pending.push_back(child);
+		m_status.pending_directories = m_pending.size();
+		m_status.files_found += files.size();
+		m_condition.notify_all();
+	}
+	for(const auto& file : files) {
+		if(!acquire_budget())
+			return;
+		const auto path = dir.path_for_file(file.name());
+		try {
+			m_database.song_info(path);
+		}
+		catch(std::exception& ex) {
+			std::cout << "Error indexing " << path << ": " << ex.what() << std::endl;
+		}
+		locker_type _(m_mutex);
+		++m_status.files_indexed;
+	}
+}
+
+// Operations are evenly spaced, every worker waits for its turn. Returns
+// false if the indexer was stopped meanwhile.
+bool library_indexer::acquire_budget()
+{
+	locker_type lock(m_mutex);
+	while(m_status.current_state == state::running) {
+		auto now = clock_type::now();
+		if(now >= m_next_operation) {
+			m_next_operation = std::max(m_next_operation, now) + m_operation_interval;
+			return true;
+		}
+		m_condition.wait_until(lock, m_next_operation);
+	}
+	return false;
+}
+
+const char* to_string(library_indexer::state value)
+{
+	switch(value) {
+		case library_indexer::state::running:
+			return "running";
+		case library_indexer::state::finished:
+			return "finished";
+		case library_indexer::state::stopped:
+			return "stopped";
+		default:
+			return "idle";
+	}
+}
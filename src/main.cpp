@@ -21,17 +21,15 @@
 #endif
 #include <thread>
 #include <vector>
-#include <fstream>
 #include <string>
 #include <functional>
-#include <iterator>
-#include <jsoncpp/json/reader.h>
 #include "types.h"
 #include "mp3_decoder.h"
 #include "song_stream.h"
 #include "playback_manager.h"
 #include "server.h"
 #include "core.h"
+#include "configuration.h"
 
 void init_audio() 
 {
@@ -39,34 +37,16 @@ void init_audio()
         throw std::runtime_error("Could not initialize PortAudio.");
 }
 
-bool read_configuration(const std::string& file_path, std::vector<std::string>& dirs) 
+configuration load_configuration() 
 {
-    Json::Value root;
-    Json::Reader reader;
-    std::ifstream input(file_path);
-    std::string data{std::istreambuf_iterator<char>(input),
-        std::istreambuf_iterator<char>()};
-    if(!reader.parse(data, root))
-        return false;
-    if(!root.isMember("shared_directories")) {
-        throw std::runtime_error("Configuration file missing 'shared_directories' key");
-    }
-    for(const auto& dir : root["shared_directories"]) {
-        dirs.push_back(dir.asString());
-    }
-    return true;
-}
-
-std::vector<std::string> load_shared_dirs() 
-{
-    std::vector<std::string> dirs;
     std::vector<std::string> config_files = {
         "shaplim.conf",
         "shaplim.conf.default"
     };
     for(const auto& config_file : config_files) {
-        if(read_configuration(config_file, dirs))
-            return dirs;
+        configuration config;
+        if(config.load(config_file))
+            return config;
     }
     throw std::runtime_error("Configuration file not found");
 }
@@ -79,9 +59,8 @@ int main()
     try {
         init_audio();
         audio_initialized = true;
-        std::vector<std::string> shared_dirs;
-        shared_dirs = load_shared_dirs();
-    	core c(shared_dirs);
+        auto config = load_configuration();
+    	core c(config);
         sig_handler = [&]() { c.stop(); };
         signal(SIGINT, [](int) { sig_handler(); });
     	c.run();
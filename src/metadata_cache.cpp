@@ -0,0 +1,170 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <cstdio>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <jsoncpp/json/reader.h>
+#include <jsoncpp/json/writer.h>
+#include "metadata_cache.h"
+#include "song_database.h"
+#include "artwork_store.h"
+
+// ****************
+// ** file_stamp **
+// ****************
+
+bool file_stamp::from_file(const std::string& path, file_stamp& output)
+{
+	struct stat info;
+	if(stat(path.c_str(), &info) != 0)
+		return false;
+	output.mtime = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + 
+		info.st_mtim.tv_nsec;
+	output.size = info.st_size;
+	return true;
+}
+
+bool file_stamp::operator==(const file_stamp& rhs) const
+{
+	return mtime == rhs.mtime && size == rhs.size;
+}
+
+bool file_stamp::operator!=(const file_stamp& rhs) const
+{
+	return !(*this == rhs);
+}
+
+// ********************
+// ** metadata_cache **
+// ********************
+
+static Json::Value to_json(const std::string& path, const cached_song_information& entry)
+{
+	const auto& info = *entry.info;
+	Json::Value output(Json::objectValue);
+	output["path"] = path;
+	output["mtime"] = Json::Int64(entry.stamp.mtime);
+	output["size"] = Json::UInt64(entry.stamp.size);
+	output["artist"] = info.artist();
+	output["album"] = info.album();
+	output["title"] = info.title();
+	output["length"] = Json::UInt64(info.length().count());
+	output["picture_id"] = info.picture_id();
+	output["picture_mime"] = info.picture_mime();
+	return output;
+}
+
+static bool from_json(const Json::Value& value, std::string& path, 
+	cached_song_information& entry)
+{
+	if(!value.isObject() || !value["path"].isString() || !value["mtime"].isIntegral() ||
+	   !value["size"].isIntegral())
+		return false;
+	// Entries from before pictures were stored separately
+	if(value.isMember("picture") && !value.isMember("picture_id"))
+		return false;
+	path = value["path"].asString();
+	// Pictures that aren't stored anymore, e.g. because they were only 
+	// kept in memory, are read back from the song when asked for
+	const auto picture_id = value["picture_id"].asString();
+	if(!picture_id.empty() && !artwork_store::instance.contains(picture_id))
+		artwork_store::instance.add_source(picture_id, path);
+	entry.stamp.mtime = value["mtime"].asInt64();
+	entry.stamp.size = value["size"].asUInt64();
+	auto info = std::make_shared<song_information>();
+	info->artist(value["artist"].asString());
+	info->album(value["album"].asString());
+	info->title(value["title"].asString());
+	info->length(std::chrono::seconds(value["length"].asUInt64()));
+	info->picture_id(picture_id);
+	info->picture_mime(value["picture_mime"].asString());
+	entry.info = std::move(info);
+	return true;
+}
+
+auto metadata_cache::open(const std::string& file_path) -> entries_type
+{
+	entries_type entries;
+	size_t lines = 0;
+	// Where the last complete line ends
+	off_t complete_size = 0;
+	bool truncated = false;
+	{
+		std::ifstream input(file_path);
+		std::string line;
+		Json::Reader reader;
+		while(std::getline(input, line)) {
+			// Only the last line can lack its newline, which means the 
+			// write was cut short by a crash
+			if(input.eof()) {
+				truncated = true;
+				break;
+			}
+			++lines;
+			complete_size += line.size() + 1;
+			Json::Value value;
+			std::string path;
+			cached_song_information entry;
+			if(reader.parse(line, value, false) && from_json(value, path, entry))
+				entries[std::move(path)] = std::move(entry);
+		}
+	}
+	m_file_path = file_path;
+	// Get rid of superseded lines once they're at least half the file
+	if(lines > entries.size() * 2)
+		truncated = !rewrite(entries) && truncated;
+	// Otherwise the next entry would be appended to the partial line
+	if(truncated && ::truncate(file_path.c_str(), complete_size) == 0)
+		truncated = false;
+	m_output.open(file_path, std::ios::app);
+	if(!m_output)
+		std::cout << "Failed to open metadata cache " << file_path << std::endl;
+	else if(truncated)
+		m_output << '\n' << std::flush;
+	return entries;
+}
+
+bool metadata_cache::rewrite(const entries_type& entries)
+{
+	const std::string temp_path = m_file_path + ".tmp";
+	{
+		std::ofstream output(temp_path, std::ios::trunc);
+		Json::FastWriter writer;
+		for(const auto& entry : entries)
+			output << writer.write(to_json(entry.first, entry.second));
+		if(!output)
+			return false;
+	}
+	return std::rename(temp_path.c_str(), m_file_path.c_str()) == 0;
+}
+
+void metadata_cache::append(const std::string& path, 
+	const cached_song_information& entry)
+{
+	if(!m_output)
+		return;
+	Json::FastWriter writer;
+	// A whole line per flush, so a crash can only truncate the last one
+	m_output << writer.write(to_json(path, entry)) << std::flush;
+}
+
+bool metadata_cache::is_open() const
+{
+	return m_output.is_open();
+}
@@ -0,0 +1,137 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include "metadata_fetcher.h"
+
+// Shared by the callbacks of a single fetch_all call
+struct batch_state {
+	std::vector<metadata_fetcher::info_ptr> infos;
+	std::atomic<size_t> remaining;
+	metadata_fetcher::batch_callback_type callback;
+};
+
+metadata_fetcher::metadata_fetcher(song_database& database, size_t thread_count)
+: m_database(database), m_running(true)
+{
+	for(size_t i = 0; i < std::max<size_t>(thread_count, 1); ++i)
+		m_workers.emplace_back(&metadata_fetcher::worker_loop, this);
+}
+
+metadata_fetcher::~metadata_fetcher()
+{
+	stop();
+}
+
+void metadata_fetcher::stop()
+{
+	{
+		locker_type _(m_mutex);
+		m_running = false;
+		m_condition.notify_all();
+	}
+	for(auto& worker : m_workers) {
+		if(worker.joinable())
+			worker.join();
+	}
+}
+
+void metadata_fetcher::fetch(const std::string& path, callback_type callback)
+{
+	if(auto info = m_database.cached_song_info(path)) {
+		callback(std::move(info));
+		return;
+	}
+	locker_type _(m_mutex);
+	enqueue(path, std::move(callback));
+	m_condition.notify_one();
+}
+
+void metadata_fetcher::fetch_all(const std::vector<std::string>& paths, 
+	batch_callback_type callback)
+{
+	auto state = std::make_shared<batch_state>();
+	state->infos.resize(paths.size());
+	state->callback = std::move(callback);
+	std::vector<size_t> missing;
+	for(size_t i = 0; i < paths.size(); ++i) {
+		state->infos[i] = m_database.cached_song_info(paths[i]);
+		if(!state->infos[i])
+			missing.push_back(i);
+	}
+	if(missing.empty()) {
+		state->callback(std::move(state->infos));
+		return;
+	}
+	// Every callback writes its own slot, the last one to finish replies
+	state->remaining = missing.size();
+	locker_type _(m_mutex);
+	for(auto index : missing) {
+		enqueue(
+			paths[index], 
+			[state, index](info_ptr info) {
+				state->infos[index] = std::move(info);
+				if(--state->remaining == 0)
+					state->callback(std::move(state->infos));
+			}
+		);
+	}
+	m_condition.notify_all();
+}
+
+// Must be called with m_mutex held
+void metadata_fetcher::enqueue(const std::string& path, callback_type callback)
+{
+	auto& callbacks = m_pending[path];
+	if(callbacks.empty())
+		m_queue.push_back(path);
+	callbacks.push_back(std::move(callback));
+}
+
+void metadata_fetcher::worker_loop()
+{
+	locker_type lock(m_mutex);
+	while(true) {
+		while(m_running && m_queue.empty())
+			m_condition.wait(lock);
+		if(!m_running)
+			break;
+		std::string path = std::move(m_queue.front());
+		m_queue.pop_front();
+		lock.unlock();
+
+		info_ptr info;
+		try {
+			info = m_database.song_info(path);
+		}
+		catch(std::exception& ex) {
+			std::cout << "Error reading " << path << ": " << ex.what() << std::endl;
+		}
+
+		lock.lock();
+		// Anyone asking for this path from now on finds it in the database
+		auto callbacks = std::move(m_pending[path]);
+		m_pending.erase(path);
+		lock.unlock();
+		for(const auto& callback : callbacks)
+			callback(info);
+		lock.lock();
+	}
+}
@@ -19,16 +19,19 @@
 #include <limits>
 #include "mp3_decoder.h"
 
-mp3_decoder::mp3_decoder()
-: m_handle(nullptr, &mpg123_delete), m_total_size(0), m_start_offset(0), 
-m_current_offset(0)
+mp3_decoder::mp3_decoder(unsigned sample_rate)
+: m_handle(nullptr, &mpg123_delete), m_sample_rate(sample_rate), m_total_size(0), 
+m_start_offset(0), m_current_offset(0)
 {
 	mpg123_init();
 	int err_code;
 	m_handle.reset(mpg123_new(0, &err_code));
 	if(!m_handle)
 		throw std::runtime_error(mpg123_plain_strerror(err_code));
-	mpg123_param(m_handle.get(), MPG123_ADD_FLAGS, MPG123_QUIET, 0);
+	mpg123_param(m_handle.get(), MPG123_ADD_FLAGS, MPG123_QUIET | MPG123_FORCE_STEREO, 0);
+	// Only accept the output format. mpg123 resamples anything else to it.
+	mpg123_format_none(m_handle.get());
+	mpg123_format(m_handle.get(), sample_rate, MPG123_STEREO, MPG123_ENC_SIGNED_16);
 }
 
 float mp3_decoder::percent_so_far() 
@@ -43,18 +46,16 @@ float mp3_decoder::percent_so_far()
 
 void mp3_decoder::check_new_format()
 {
-	if(m_on_rate_change) {
-		long rate;
-		int channels, enc;
-		mpg123_getformat(m_handle.get(), &rate, &channels, &enc);
-		m_on_rate_change(rate);
-	}
+	long rate;
+	int channels, enc;
+	mpg123_getformat(m_handle.get(), &rate, &channels, &enc);
+	if(rate != m_sample_rate || channels != MPG123_STEREO || enc != MPG123_ENC_SIGNED_16)
+		throw std::runtime_error("Unsupported output format");
 }
 
 void mp3_decoder::decode(song_stream stream, types::decode_buffer_type &buffer)
 {
 	size_t size;
-	const short* buf_ptr = (const short*)m_buffer.data();
 	m_running = true;
 	bool found_start = false;
 	mpg123_open_feed(m_handle.get());
@@ -62,15 +63,21 @@ void mp3_decoder::decode(song_stream stream, types::decode_buffer_type &buffer)
 	m_total_size = stream.size();
 	while(stream.bytes_left() && m_running) {
 		int ret_val;
-		size_t to_read = std::min(stream.available(), m_buffer.size());
+		size_t to_read = std::min(stream.available(), chunk_size);
 		auto read_ptr = (const unsigned char*)stream.buffer_ptr();
 		do { 
+			// Decode straight into the ring buffer's storage
+			auto output = buffer.reserve(chunk_size / sizeof(short));
+			if(output.empty()) {
+				m_total_size = 0;
+				return;
+			}
 			ret_val = mpg123_decode(
 				m_handle.get(), 
 				read_ptr, 
 				to_read, 
-				(unsigned char*)m_buffer.data(), 
-				m_buffer.size(), 
+				(unsigned char*)output.data, 
+				output.size * sizeof(short), 
 				&size
 			);
 			if(read_ptr != nullptr) {
@@ -89,10 +96,7 @@ void mp3_decoder::decode(song_stream stream, types::decode_buffer_type &buffer)
 				check_new_format();
 			}
 			else {
-	            buffer.put(
-					buf_ptr, 
-					buf_ptr + size / sizeof(short)
-				);
+				buffer.commit(size / sizeof(short));
 	        }
 		} while(ret_val != MPG123_ERR && ret_val != MPG123_NEED_MORE);
 		if(ret_val == MPG123_ERR)
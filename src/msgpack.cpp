@@ -0,0 +1,526 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <cstring>
+#include <limits>
+#include "msgpack.h"
+
+constexpr size_t msgpack_reader::max_depth;
+
+// Positive fixints and the uint family
+static bool is_unsigned_type(uint8_t type)
+{
+	return type <= 0x7f || (type >= 0xcc && type <= 0xcf);
+}
+
+msgpack_error::msgpack_error(const std::string& message)
+: std::runtime_error(message)
+{
+
+}
+
+// ********************
+// ** msgpack_writer **
+// ********************
+
+msgpack_writer::msgpack_writer(std::string& output)
+: m_output(output)
+{
+
+}
+
+void msgpack_writer::write_header(uint8_t type, uint64_t value, size_t bytes)
+{
+	m_output.push_back(static_cast<char>(type));
+	for(size_t i = bytes; i > 0; --i)
+		m_output.push_back(static_cast<char>(value >> ((i - 1) * 8)));
+}
+
+void msgpack_writer::write_nil()
+{
+	m_output.push_back(static_cast<char>(0xc0));
+}
+
+void msgpack_writer::write_bool(bool value)
+{
+	m_output.push_back(static_cast<char>(value ? 0xc3 : 0xc2));
+}
+
+void msgpack_writer::write_int(int64_t value)
+{
+	if(value >= 0)
+		write_uint(value);
+	else if(value >= -32)
+		m_output.push_back(static_cast<char>(value));
+	else if(value >= std::numeric_limits<int8_t>::min())
+		write_header(0xd0, value, 1);
+	else if(value >= std::numeric_limits<int16_t>::min())
+		write_header(0xd1, value, 2);
+	else if(value >= std::numeric_limits<int32_t>::min())
+		write_header(0xd2, value, 4);
+	else
+		write_header(0xd3, value, 8);
+}
+
+void msgpack_writer::write_uint(uint64_t value)
+{
+	if(value <= 0x7f)
+		m_output.push_back(static_cast<char>(value));
+	else if(value <= std::numeric_limits<uint8_t>::max())
+		write_header(0xcc, value, 1);
+	else if(value <= std::numeric_limits<uint16_t>::max())
+		write_header(0xcd, value, 2);
+	else if(value <= std::numeric_limits<uint32_t>::max())
+		write_header(0xce, value, 4);
+	else
+		write_header(0xcf, value, 8);
+}
+
+void msgpack_writer::write_double(double value)
+{
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	write_header(0xcb, bits, 8);
+}
+
+void msgpack_writer::write_string(boost::string_ref value)
+{
+	const size_t size = value.size();
+	if(size <= 31)
+		m_output.push_back(static_cast<char>(0xa0 | size));
+	else if(size <= std::numeric_limits<uint8_t>::max())
+		write_header(0xd9, size, 1);
+	else if(size <= std::numeric_limits<uint16_t>::max())
+		write_header(0xda, size, 2);
+	else if(size <= std::numeric_limits<uint32_t>::max())
+		write_header(0xdb, size, 4);
+	else
+		throw msgpack_error("String too long");
+	m_output.append(value.data(), size);
+}
+
+void msgpack_writer::begin_array(uint32_t size)
+{
+	if(size <= 15)
+		m_output.push_back(static_cast<char>(0x90 | size));
+	else if(size <= std::numeric_limits<uint16_t>::max())
+		write_header(0xdc, size, 2);
+	else
+		write_header(0xdd, size, 4);
+}
+
+void msgpack_writer::begin_map(uint32_t size)
+{
+	if(size <= 15)
+		m_output.push_back(static_cast<char>(0x80 | size));
+	else if(size <= std::numeric_limits<uint16_t>::max())
+		write_header(0xde, size, 2);
+	else
+		write_header(0xdf, size, 4);
+}
+
+void msgpack_writer::write(const Json::Value& value)
+{
+	switch(value.type()) {
+		case Json::nullValue:
+			write_nil();
+			break;
+		case Json::intValue:
+			write_int(value.asLargestInt());
+			break;
+		case Json::uintValue:
+			write_uint(value.asLargestUInt());
+			break;
+		case Json::realValue:
+			write_double(value.asDouble());
+			break;
+		case Json::stringValue:
+			{
+				const char* begin;
+				const char* end;
+				value.getString(&begin, &end);
+				write_string(boost::string_ref(begin, end - begin));
+			}
+			break;
+		case Json::booleanValue:
+			write_bool(value.asBool());
+			break;
+		case Json::arrayValue:
+			begin_array(value.size());
+			for(const auto& item : value)
+				write(item);
+			break;
+		case Json::objectValue:
+			begin_map(value.size());
+			for(auto iter = value.begin(); iter != value.end(); ++iter) {
+				const char* end;
+				const char* begin = iter.memberName(&end);
+				write_string(boost::string_ref(begin, end - begin));
+				write(*iter);
+			}
+			break;
+	}
+}
+
+// ********************
+// ** msgpack_reader **
+// ********************
+
+msgpack_reader::msgpack_reader(const char* data, size_t size)
+: m_data(data), m_end(data + size)
+{
+
+}
+
+bool msgpack_reader::at_end() const
+{
+	return m_data == m_end;
+}
+
+uint8_t msgpack_reader::peek() const
+{
+	if(at_end())
+		throw msgpack_error("Truncated msgpack data");
+	return static_cast<uint8_t>(*m_data);
+}
+
+const char* msgpack_reader::consume(size_t bytes)
+{
+	if(static_cast<size_t>(m_end - m_data) < bytes)
+		throw msgpack_error("Truncated msgpack data");
+	const char* output = m_data;
+	m_data += bytes;
+	return output;
+}
+
+uint64_t msgpack_reader::read_big_endian(size_t bytes)
+{
+	const char* data = consume(bytes);
+	uint64_t output = 0;
+	for(size_t i = 0; i < bytes; ++i)
+		output = (output << 8) | static_cast<uint8_t>(data[i]);
+	return output;
+}
+
+auto msgpack_reader::next_type() const -> value_type
+{
+	const uint8_t type = peek();
+	if(type <= 0x7f || type >= 0xe0 || (type >= 0xcc && type <= 0xd3))
+		return value_type::integer;
+	if(type <= 0x8f || type == 0xde || type == 0xdf)
+		return value_type::map;
+	if(type <= 0x9f || type == 0xdc || type == 0xdd)
+		return value_type::array;
+	if(type <= 0xbf || (type >= 0xd9 && type <= 0xdb) || (type >= 0xc4 && type <= 0xc6))
+		return value_type::string;
+	switch(type) {
+		case 0xc0:
+			return value_type::nil;
+		case 0xc2:
+		case 0xc3:
+			return value_type::boolean;
+		case 0xca:
+		case 0xcb:
+			return value_type::floating;
+		default:
+			throw msgpack_error("Unsupported msgpack type");
+	}
+}
+
+void msgpack_reader::read_nil()
+{
+	if(peek() != 0xc0)
+		throw msgpack_error("Expected nil");
+	consume(1);
+}
+
+bool msgpack_reader::read_bool()
+{
+	const uint8_t type = peek();
+	if(type != 0xc2 && type != 0xc3)
+		throw msgpack_error("Expected a boolean");
+	consume(1);
+	return type == 0xc3;
+}
+
+int64_t msgpack_reader::read_int()
+{
+	const uint8_t type = peek();
+	if(is_unsigned_type(type)) {
+		const uint64_t value = read_uint();
+		if(value > static_cast<uint64_t>(std::numeric_limits<int64_t>::max()))
+			throw msgpack_error("Integer out of range");
+		return value;
+	}
+	if(type >= 0xe0) {
+		consume(1);
+		return static_cast<int8_t>(type);
+	}
+	consume(1);
+	switch(type) {
+		case 0xd0:
+			return static_cast<int8_t>(read_big_endian(1));
+		case 0xd1:
+			return static_cast<int16_t>(read_big_endian(2));
+		case 0xd2:
+			return static_cast<int32_t>(read_big_endian(4));
+		case 0xd3:
+			return static_cast<int64_t>(read_big_endian(8));
+		default:
+			throw msgpack_error("Expected an integer");
+	}
+}
+
+uint64_t msgpack_reader::read_uint()
+{
+	const uint8_t type = peek();
+	if(!is_unsigned_type(type)) {
+		const int64_t value = read_int();
+		if(value < 0)
+			throw msgpack_error("Expected an unsigned integer");
+		return value;
+	}
+	consume(1);
+	if(type <= 0x7f)
+		return type;
+	return read_big_endian(size_t(1) << (type - 0xcc));
+}
+
+double msgpack_reader::read_double()
+{
+	const uint8_t type = peek();
+	if(type == 0xca) {
+		consume(1);
+		const uint32_t bits = read_big_endian(4);
+		float value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	if(type != 0xcb)
+		throw msgpack_error("Expected a float");
+	consume(1);
+	const uint64_t bits = read_big_endian(8);
+	double value;
+	std::memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+boost::string_ref msgpack_reader::read_string()
+{
+	const uint8_t type = peek();
+	size_t size;
+	if(type >= 0xa0 && type <= 0xbf) {
+		consume(1);
+		size = type & 0x1f;
+	}
+	else if(type == 0xd9 || type == 0xc4) {
+		consume(1);
+		size = read_big_endian(1);
+	}
+	else if(type == 0xda || type == 0xc5) {
+		consume(1);
+		size = read_big_endian(2);
+	}
+	else if(type == 0xdb || type == 0xc6) {
+		consume(1);
+		size = read_big_endian(4);
+	}
+	else
+		throw msgpack_error("Expected a string");
+	return boost::string_ref(consume(size), size);
+}
+
+uint32_t msgpack_reader::read_array()
+{
+	const uint8_t type = peek();
+	if(type >= 0x90 && type <= 0x9f) {
+		consume(1);
+		return type & 0x0f;
+	}
+	if(type != 0xdc && type != 0xdd)
+		throw msgpack_error("Expected an array");
+	consume(1);
+	return read_big_endian(type == 0xdc ? 2 : 4);
+}
+
+uint32_t msgpack_reader::read_map()
+{
+	const uint8_t type = peek();
+	if(type >= 0x80 && type <= 0x8f) {
+		consume(1);
+		return type & 0x0f;
+	}
+	if(type != 0xde && type != 0xdf)
+		throw msgpack_error("Expected a map");
+	consume(1);
+	return read_big_endian(type == 0xde ? 2 : 4);
+}
+
+void msgpack_reader::skip()
+{
+	skip(0);
+}
+
+void msgpack_reader::skip(size_t depth)
+{
+	if(depth > max_depth)
+		throw msgpack_error("msgpack data nested too deeply");
+	switch(next_type()) {
+		case value_type::nil:
+			read_nil();
+			break;
+		case value_type::boolean:
+			read_bool();
+			break;
+		case value_type::integer:
+			if(is_unsigned_type(peek()))
+				read_uint();
+			else
+				read_int();
+			break;
+		case value_type::floating:
+			read_double();
+			break;
+		case value_type::string:
+			read_string();
+			break;
+		case value_type::array:
+			for(uint32_t size = read_array(); size > 0; --size)
+				skip(depth + 1);
+			break;
+		case value_type::map:
+			for(uint32_t size = read_map(); size > 0; --size) {
+				skip(depth + 1);
+				skip(depth + 1);
+			}
+			break;
+	}
+}
+
+void msgpack_reader::read(Json::Value& output)
+{
+	read(output, 0);
+}
+
+// Integers get the same types Json::Reader would give them
+void msgpack_reader::read(Json::Value& output, size_t depth)
+{
+	if(depth > max_depth)
+		throw msgpack_error("msgpack data nested too deeply");
+	switch(next_type()) {
+		case value_type::nil:
+			read_nil();
+			output = Json::Value();
+			break;
+		case value_type::boolean:
+			output = read_bool();
+			break;
+		case value_type::integer:
+			if(is_unsigned_type(peek())) {
+				const uint64_t value = read_uint();
+				if(value <= static_cast<uint64_t>(Json::Value::maxInt))
+					output = Json::Value(static_cast<Json::LargestInt>(value));
+				else
+					output = Json::Value(static_cast<Json::LargestUInt>(value));
+			}
+			else
+				output = Json::Value(static_cast<Json::LargestInt>(read_int()));
+			break;
+		case value_type::floating:
+			output = read_double();
+			break;
+		case value_type::string:
+			{
+				auto value = read_string();
+				output = Json::Value(value.data(), value.data() + value.size());
+			}
+			break;
+		case value_type::array:
+			{
+				const uint32_t size = read_array();
+				output = Json::Value(Json::arrayValue);
+				for(uint32_t i = 0; i < size; ++i)
+					read(output[i], depth + 1);
+			}
+			break;
+		case value_type::map:
+			{
+				const uint32_t size = read_map();
+				output = Json::Value(Json::objectValue);
+				for(uint32_t i = 0; i < size; ++i) {
+					auto key = read_string();
+					read(output[key.to_string()], depth + 1);
+				}
+			}
+			break;
+	}
+}
+
+// ************
+// ** frames **
+// ************
+
+size_t msgpack_frame_size(const char* header)
+{
+	size_t output = 0;
+	for(size_t i = 0; i < msgpack_frame_header_size; ++i)
+		output = (output << 8) | static_cast<uint8_t>(header[i]);
+	return output;
+}
+
+std::string msgpack_frame(const Json::Value& value)
+{
+	std::string output(msgpack_frame_header_size, '\0');
+	msgpack_writer writer(output);
+	writer.write(value);
+	const size_t size = output.size() - msgpack_frame_header_size;
+	if(size > std::numeric_limits<uint32_t>::max())
+		throw msgpack_error("Frame too large");
+	for(size_t i = 0; i < msgpack_frame_header_size; ++i)
+		output[i] = static_cast<char>(size >> ((msgpack_frame_header_size - 1 - i) * 8));
+	return output;
+}
+
+// **************
+// ** requests **
+// **************
+
+// Reads the request map straight out of the frame, only the parameters 
+// are turned into a Json::Value, and only when there are any.
+bool read_msgpack_request(const char* data, size_t size, std::string& type, 
+	Json::Value& params)
+{
+	try {
+		msgpack_reader reader(data, size);
+		bool has_type = false;
+		for(uint32_t pairs = reader.read_map(); pairs > 0; --pairs) {
+			auto key = reader.read_string();
+			if(key == "type") {
+				type = reader.read_string().to_string();
+				has_type = true;
+			}
+			else if(key == "params")
+				reader.read(params);
+			else
+				reader.skip();
+		}
+		return has_type && reader.at_end();
+	}
+	catch(msgpack_error&) {
+		return false;
+	}
+}
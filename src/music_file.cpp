@@ -17,15 +17,15 @@
 
 #include "music_file.h"
 
-music_file::music_file(std::string name)
-: m_name(std::move(name))
+music_file::music_file(name_pool::name_ref name)
+: m_name(name)
 {
 
 }
 
-const std::string& music_file::name() const
+boost::string_ref music_file::name() const
 {
-	return m_name;
+	return m_name.view();
 }
 
 bool operator<(const music_file& lhs, const music_file& rhs)
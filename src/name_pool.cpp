@@ -0,0 +1,134 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <cstring>
+#include <stdexcept>
+#include "name_pool.h"
+
+constexpr size_t name_pool::max_length;
+constexpr size_t name_pool::chunk_bits;
+constexpr size_t name_pool::chunk_size;
+constexpr uint32_t name_pool::empty_slot;
+
+// FNV-1a
+static size_t hash_name(boost::string_ref name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(auto c : name) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// ***************
+// ** name_ref **
+// ***************
+
+name_pool::name_ref::name_ref()
+: m_entry(nullptr)
+{
+
+}
+
+name_pool::name_ref::name_ref(const char* entry)
+: m_entry(entry)
+{
+
+}
+
+boost::string_ref name_pool::name_ref::view() const
+{
+	if(!m_entry)
+		return boost::string_ref();
+	length_type length;
+	std::memcpy(&length, m_entry, sizeof(length));
+	return boost::string_ref(m_entry + sizeof(length), length);
+}
+
+// ***************
+// ** name_pool **
+// ***************
+
+name_pool::name_pool()
+: m_chunk_used(chunk_size), m_slots(1024, empty_slot), m_count(0)
+{
+
+}
+
+auto name_pool::intern(boost::string_ref name) -> name_ref
+{
+	if(name.size() > max_length)
+		throw std::runtime_error("name too long");
+	// Keep the table at most half full
+	if((m_count + 1) * 2 > m_slots.size())
+		grow_slots();
+	const size_t mask = m_slots.size() - 1;
+	size_t index = hash_name(name) & mask;
+	while(m_slots[index] != empty_slot) {
+		name_ref stored(entry_at(m_slots[index]));
+		if(stored.view() == name)
+			return stored;
+		index = (index + 1) & mask;
+	}
+	m_slots[index] = store(name);
+	++m_count;
+	return name_ref(entry_at(m_slots[index]));
+}
+
+size_t name_pool::size() const
+{
+	return m_count;
+}
+
+const char* name_pool::entry_at(uint32_t location) const
+{
+	return m_chunks[location >> chunk_bits].get() + (location & (chunk_size - 1));
+}
+
+uint32_t name_pool::store(boost::string_ref name)
+{
+	const size_t entry_size = sizeof(length_type) + name.size();
+	if(m_chunk_used + entry_size > chunk_size) {
+		if(m_chunks.size() == (size_t(1) << (32 - chunk_bits)))
+			throw std::runtime_error("name pool is full");
+		m_chunks.emplace_back(new char[chunk_size]);
+		m_chunk_used = 0;
+	}
+	char* ptr = m_chunks.back().get() + m_chunk_used;
+	const length_type length = name.size();
+	std::memcpy(ptr, &length, sizeof(length));
+	std::memcpy(ptr + sizeof(length), name.data(), name.size());
+	const uint32_t location = ((m_chunks.size() - 1) << chunk_bits) | m_chunk_used;
+	m_chunk_used += entry_size;
+	return location;
+}
+
+void name_pool::grow_slots()
+{
+	std::vector<uint32_t> slots(m_slots.size() * 2, empty_slot);
+	const size_t mask = slots.size() - 1;
+	for(auto location : m_slots) {
+		if(location == empty_slot)
+			continue;
+		size_t index = hash_name(name_ref(entry_at(location)).view()) & mask;
+		while(slots[index] != empty_slot)
+			index = (index + 1) & mask;
+		slots[index] = location;
+	}
+	m_slots.swap(slots);
+}
@@ -18,48 +18,41 @@
 #include <exception>
 #include "playback_manager.h"
 
+constexpr size_t playback_manager::max_boundaries;
 
-playback_manager::playback_manager(types::decode_buffer_type &buffer)
-: m_handle(nullptr, &Pa_CloseStream), m_buffer(buffer), m_current_rate(44100),
-m_playing(false)
+playback_manager::playback_manager(types::decode_buffer_type &buffer, 
+    unsigned sample_rate)
+: m_handle(nullptr, &Pa_CloseStream), m_buffer(buffer), 
+m_boundaries(max_boundaries), m_playing(false), 
+m_song_underruns(0), m_song_short_frames(0), m_total_underruns(0), 
+m_total_short_frames(0), m_song_start(0), m_in_song(false), 
+m_in_underrun(false)
 {
     m_params.device = Pa_GetDefaultOutputDevice();
     if (m_params.device == paNoDevice)
         throw std::runtime_error("Could not open audio device.");
-    m_params.channelCount = 2;       /* stereo output */
+    m_params.channelCount = types::output_channels;
     m_params.sampleFormat = paInt16; /* 16 bit signed integer output */
     m_params.suggestedLatency = Pa_GetDeviceInfo(m_params.device)->defaultHighOutputLatency;
     m_params.hostApiSpecificStreamInfo = NULL;
 
     PaStream *stream;
 
-    if(Pa_OpenStream(&stream, NULL, &m_params, 44100, paFramesPerBufferUnspecified, paNoFlag, proxy_callback, this) != paNoError)
+    // Decoders convert everything to this rate, so the stream is never 
+    // reopened.
+    if(Pa_OpenStream(&stream, NULL, &m_params, sample_rate, paFramesPerBufferUnspecified, paNoFlag, proxy_callback, this) != paNoError)
         throw std::runtime_error("Could not open PortAudio stream.");
    	m_handle.reset(stream);
     play();
 }
 
-void playback_manager::set_sample_rate(long rate)
-{
-    if(rate != m_current_rate) {
-        m_playing = false;
-        m_current_rate = rate;
-        if(is_stream_active()) {
-            Pa_StopStream(m_handle.get());
-        }
-        PaStream *stream;
-        if(Pa_OpenStream(&stream, NULL, &m_params, rate, paFramesPerBufferUnspecified, paNoFlag, proxy_callback, this) != paNoError)
-            throw std::runtime_error("Could not open PortAudio stream.");
-        m_handle.reset(stream);
-        play();
-    }
-}
-
+// These can be called from several threads at once, only one of them 
+// gets to change the state.
 bool playback_manager::play()
 {
-	if(!m_playing) {
+	bool expected = false;
+	if(m_playing.compare_exchange_strong(expected, true)) {
 		Pa_StartStream(m_handle.get());
-        m_playing = true;
         return true;
     }
     return false;
@@ -67,11 +60,7 @@ bool playback_manager::play()
 
 bool playback_manager::pause()
 {
-	if(m_playing) {
-        m_playing = false;
-        return true;
-    }
-    return false;
+    return m_playing.exchange(false);
 }
 
 void playback_manager::stop()
@@ -84,14 +73,85 @@ bool playback_manager::is_stream_active() const
     return Pa_IsStreamActive(m_handle.get());
 }
 
+void playback_manager::begin_song()
+{
+    add_boundary(true);
+}
+
+void playback_manager::end_song()
+{
+    add_boundary(false);
+}
+
+// The samples before a boundary are still in the buffer, so it only 
+// takes effect once the callback gets to it. Never blocks; if the 
+// callback is that far behind, the boundary is dropped.
+void playback_manager::add_boundary(bool begins)
+{
+    if(m_boundaries.size() == m_boundaries.capacity())
+        return;
+    const boundary item{ m_buffer.write_position(), begins };
+    m_boundaries.put(&item, &item + 1);
+}
+
+// Switches to the next song's stats once position is past its start
+void playback_manager::apply_boundaries(size_t position)
+{
+    while(true) {
+        auto next = m_boundaries.peek(1);
+        if(next.empty() || next.begin()->position > position)
+            return;
+        if(next.begin()->begins) {
+            m_song_underruns = 0;
+            m_song_short_frames = 0;
+            m_song_start = next.begin()->position;
+            m_in_song = true;
+            m_in_underrun = false;
+        }
+        else {
+            m_in_song = false;
+        }
+        m_boundaries.release(1);
+    }
+}
+
+auto playback_manager::song_underruns() const -> underrun_stats
+{
+    return { m_song_underruns, m_song_short_frames };
+}
+
+auto playback_manager::total_underruns() const -> underrun_stats
+{
+    return { m_total_underruns, m_total_short_frames };
+}
+
 int playback_manager::callback(void *output_buffer, unsigned long frames_per_buffer)
 {
     auto buffer_ptr = static_cast<short *>(output_buffer);
     if(m_playing) {
-    	m_buffer.get(
+        const size_t samples = frames_per_buffer * types::output_channels;
+        const size_t start = m_buffer.read_position();
+    	const size_t read = m_buffer.get(
     		buffer_ptr, 
-    		frames_per_buffer * 2
+    		samples
     	);
+        const size_t end = start + read;
+        apply_boundaries(end);
+        // Before the first samples of a song are played and after its 
+        // last ones an empty buffer is expected.
+        if(read < samples && m_in_song && end > m_song_start) {
+            const uint64_t short_frames = (samples - read) / types::output_channels;
+            if(!m_in_underrun) {
+                m_in_underrun = true;
+                ++m_song_underruns;
+                ++m_total_underruns;
+            }
+            m_song_short_frames += short_frames;
+            m_total_short_frames += short_frames;
+        }
+        else if(read == samples) {
+            m_in_underrun = false;
+        }
     }
     else {
         std::fill(
@@ -99,6 +159,8 @@ int playback_manager::callback(void *output_buffer, unsigned long frames_per_buf
             buffer_ptr + frames_per_buffer * 2,
             0
         );
+        // Songs that never produced anything are skipped while paused too
+        apply_boundaries(m_buffer.read_position());
     }
 	return paContinue;
 }
@@ -16,59 +16,259 @@
  */
 
 #include <limits>
+#include <algorithm>
+#include <functional>
 #include "playlist.h"
 
+constexpr size_t playlist::max_changes;
+
+// transaction
+
+playlist::transaction::transaction(playlist& owner)
+: m_playlist(owner), m_previous(owner.m_transaction)
+{
+	m_playlist.m_transaction = this;
+}
+
+playlist::transaction::~transaction()
+{
+	for(auto iter = m_undo_log.rbegin(); iter != m_undo_log.rend(); ++iter)
+		(*iter)();
+	m_playlist.m_transaction = m_previous;
+}
+
+void playlist::transaction::commit()
+{
+	// Nested transactions hand their log to the outer one
+	if(m_previous) {
+		for(auto& action : m_undo_log)
+			m_previous->m_undo_log.push_back(std::move(action));
+	}
+	m_undo_log.clear();
+}
+
+// playlist
+
 playlist::playlist()
-: m_current_index(), m_order(mode::default_order)
+: m_base(std::make_shared<snapshot>()), m_version(0), m_current_index(), 
+m_order(mode::default_order), m_transaction(nullptr)
 {
 	std::random_device rd;
 	m_generator.seed(rd());
 }
 
-void playlist::add_song(song a_song)
+void playlist::add_songs(std::vector<song> songs)
 {
-	m_songs.push_back(std::move(a_song));
-	m_songs_order.push_back(m_songs.size() - 1);
-	if(m_order == mode::random_order && m_songs.size() - m_current_index > 2) {
-		std::uniform_int_distribution<> dis(m_current_index + 1, m_songs_order.size() - 2);
-		std::swap(m_songs_order.back(), m_songs_order[dis(m_generator)]);
+	const auto current = m_current_index;
+	const auto count = songs.size();
+	for(const auto& item : songs)
+		insert_song(item, m_songs.size());
+	log_undo([this, current, count]() {
+		for(size_t i = 0; i < count; ++i)
+			m_songs.erase(m_songs.at(sequence::listed, m_songs.size() - 1));
+		m_current_index = current;
+	});
+	auto a_change = std::make_shared<change>();
+	a_change->type = change::change_type::add_songs;
+	a_change->songs = std::move(songs);
+	add_change(std::move(a_change));
+}
+
+bool playlist::insert_songs(size_t index, std::vector<song> songs)
+{
+	if(index > m_songs.size())
+		return false;
+	const auto current = m_current_index;
+	const auto count = songs.size();
+	for(size_t i = 0; i < songs.size(); ++i)
+		insert_song(songs[i], index + i);
+	log_undo([this, current, index, count]() {
+		for(size_t i = 0; i < count; ++i)
+			m_songs.erase(m_songs.at(sequence::listed, index));
+		m_current_index = current;
+	});
+	auto a_change = std::make_shared<change>();
+	a_change->type = change::change_type::insert_songs;
+	a_change->songs = std::move(songs);
+	a_change->index = index;
+	add_change(std::move(a_change));
+	return true;
+}
+
+bool playlist::delete_songs(const std::vector<size_t>& indexes)
+{
+	if(indexes.empty())
+		return true;
+	auto unsorted = std::adjacent_find(
+		indexes.begin(), 
+		indexes.end(), 
+		std::greater_equal<size_t>()
+	);
+	if(unsorted != indexes.end() || indexes.back() >= m_songs.size())
+		return false;
+	const auto current = m_current_index;
+	// Each song along with its listed and played positions
+	using deleted_song = std::tuple<song, size_t, size_t>;
+	auto deleted = std::make_shared<std::vector<deleted_song>>();
+	for(auto iter = indexes.rbegin(); iter != indexes.rend(); ++iter) {
+		auto id = m_songs.at(sequence::listed, *iter);
+		const auto played_position = m_songs.position(sequence::played, id);
+		// If the current song is deleted, the one after it takes its place
+		if(played_position < m_current_index)
+			m_current_index--;
+		if(m_transaction)
+			deleted->emplace_back(m_songs.value(id), *iter, played_position);
+		m_songs.erase(id);
 	}
+	log_undo([this, current, deleted]() {
+		for(auto iter = deleted->rbegin(); iter != deleted->rend(); ++iter)
+			m_songs.insert(std::get<0>(*iter), std::get<1>(*iter), std::get<2>(*iter));
+		m_current_index = current;
+	});
+	auto a_change = std::make_shared<change>();
+	a_change->type = change::change_type::delete_songs;
+	a_change->indexes = indexes;
+	add_change(std::move(a_change));
+	return true;
 }
 
-bool playlist::delete_song(size_t index)
+// The play order only follows the listing when not shuffling
+bool playlist::move_song(size_t from, size_t to)
 {
-	if(index >= m_songs.size())
+	if(from >= m_songs.size() || to >= m_songs.size())
 		return false;
-	size_t to_delete = 0;
-    for(size_t i = 0; i < m_songs_order.size(); ++i) {
-        if(m_songs_order[i] == index)
-            to_delete = i;
-        if(m_songs_order[i] > index)
-            m_songs_order[i]--;
-    }
-    m_songs.erase(m_songs.begin() + index);
-    m_songs_order.erase(m_songs_order.begin() + to_delete);
-    if(m_current_index > m_songs.size())
-        m_current_index = m_songs.size();
-    else if(index < m_current_index && m_current_index > 0)
-        m_current_index--;
-   	return true;
+	auto current = current_node();
+	auto id = m_songs.at(sequence::listed, from);
+	const auto current_index = m_current_index;
+	const auto played_before = m_songs.position(sequence::played, id);
+	log_undo([this, current_index, from, to, played_before]() {
+		auto moved = m_songs.at(sequence::listed, to);
+		m_songs.move(moved, sequence::listed, from);
+		m_songs.move(moved, sequence::played, played_before);
+		m_current_index = current_index;
+	});
+	m_songs.move(id, sequence::listed, to);
+	if(m_order == mode::default_order) {
+		auto following = m_songs.next(sequence::listed, id);
+		size_t played_position = m_songs.size() - 1;
+		if(following != song_tree::no_node) {
+			played_position = m_songs.position(sequence::played, following);
+			if(played_position > m_songs.position(sequence::played, id))
+				played_position--;
+		}
+		m_songs.move(id, sequence::played, played_position);
+		if(current != song_tree::no_node)
+			m_current_index = m_songs.position(sequence::played, current);
+	}
+	auto a_change = std::make_shared<change>();
+	a_change->type = change::change_type::move_song;
+	a_change->index = from;
+	a_change->destination = to;
+	add_change(std::move(a_change));
+	return true;
+}
+
+// New songs are played right before the song they're inserted in front of, 
+// or anywhere after the current one when shuffling.
+void playlist::insert_song(song a_song, size_t index)
+{
+	const size_t count = m_songs.size();
+	size_t played_position = count;
+	if(m_order == mode::random_order) {
+		const size_t first = has_current() ? m_current_index + 1 : m_current_index;
+		std::uniform_int_distribution<size_t> dis(first, count);
+		played_position = dis(m_generator);
+	}
+	else if(index < count) {
+		played_position = m_songs.position(
+			sequence::played, 
+			m_songs.at(sequence::listed, index)
+		);
+	}
+	// Songs appended after the last one played become the current one
+	if(played_position < m_current_index || (played_position == m_current_index && has_current()))
+		m_current_index++;
+	m_songs.insert(std::move(a_song), index, played_position);
+}
+
+auto playlist::current_node() const -> song_tree::node_id
+{
+	return m_songs.at(sequence::played, m_current_index);
+}
+
+void playlist::add_change(change_ptr a_change)
+{
+	change_ptr dropped;
+	auto base = m_base;
+	m_changes.push_back(std::move(a_change));
+	if(m_changes.size() > max_changes) {
+		dropped = std::move(m_changes.front());
+		m_changes.pop_front();
+	}
+	++m_version;
+	// Only happens if no snapshot was built during the last max_changes 
+	// changes, so the copy is spread over all of them
+	if(m_version - m_base->version > m_changes.size())
+		m_base = make_snapshot();
+	log_undo([this, dropped, base]() {
+		m_changes.pop_back();
+		if(dropped)
+			m_changes.push_front(dropped);
+		--m_version;
+		m_base = base;
+	});
+}
+
+void playlist::log_undo(std::function<void()> action)
+{
+	if(m_transaction)
+		m_transaction->m_undo_log.push_back(std::move(action));
+}
+
+auto playlist::make_snapshot() const -> snapshot_ptr
+{
+	auto output = std::make_shared<snapshot>();
+	output->version = m_version;
+	output->songs.reserve(m_songs.size());
+	auto id = m_songs.at(sequence::listed, 0);
+	while(id != song_tree::no_node) {
+		output->songs.push_back(m_songs.value(id));
+		id = m_songs.next(sequence::listed, id);
+	}
+	return output;
 }
 
 void playlist::next() 
 {
+	const auto current = m_current_index;
+	log_undo([this, current]() { m_current_index = current; });
 	m_current_index = std::min(m_current_index + 1, m_songs.size());
 }
 
 void playlist::prev() 
 {
+	const auto current = m_current_index;
+	log_undo([this, current]() { m_current_index = current; });
 	if(m_current_index > 0)
 		m_current_index--;
 }
 
 song playlist::current() const
 {
-	return m_songs[m_songs_order[m_current_index]];
+	return m_songs.value(current_node());
+}
+
+std::vector<song> playlist::upcoming(size_t count) const
+{
+	std::vector<song> output;
+	if(!has_current())
+		return output;
+	auto id = m_songs.next(sequence::played, current_node());
+	while(id != song_tree::no_node && output.size() < count) {
+		output.push_back(m_songs.value(id));
+		id = m_songs.next(sequence::played, id);
+	}
+	return output;
 }
 
 bool playlist::has_current() const
@@ -78,35 +278,124 @@ bool playlist::has_current() const
 
 int playlist::current_index() const
 {
-	if(m_current_index == m_songs.size())
+	if(!has_current())
 		return -1;
 	else 
-		return m_songs_order[m_current_index];
+		return m_songs.position(sequence::listed, current_node());
 }
 
 bool playlist::set_current_index(size_t index)
 {
-	if(index >= m_songs.size() || index == m_current_index)
+	if(index >= m_songs.size())
+		return false;
+	const auto played_position = m_songs.position(
+		sequence::played, 
+		m_songs.at(sequence::listed, index)
+	);
+	if(played_position == m_current_index)
 		return false;
-	m_current_index = index;
+	const auto current = m_current_index;
+	log_undo([this, current]() { m_current_index = current; });
+	m_current_index = played_position;
 	return true;
 }
 
 void playlist::clear()
 {
-	m_songs.clear();
-	m_songs_order.clear();
+	// Swapped out rather than copied, so undoing it is cheap
+	auto songs = std::make_shared<song_tree>();
+	std::swap(*songs, m_songs);
+	const auto current = m_current_index;
+	auto base = m_base;
+	log_undo([this, songs, current, base]() {
+		std::swap(*songs, m_songs);
+		m_current_index = current;
+		m_base = base;
+	});
 	m_current_index = 0;
+	auto a_change = std::make_shared<change>();
+	a_change->type = change::change_type::clear;
+	add_change(std::move(a_change));
+	m_base = make_snapshot();
 }
 
 bool playlist::songs_left() const 
 {
-	return m_current_index != m_songs.size();
+	return has_current();
+}
+
+auto playlist::prepare_snapshot(snapshot_ptr latest) -> snapshot_source
+{
+	if(latest && latest->version > m_base->version && latest->version <= m_version) {
+		auto base = m_base;
+		log_undo([this, base]() { m_base = base; });
+		m_base = std::move(latest);
+	}
+	snapshot_source output;
+	output.base = m_base;
+	changes_since(m_base->version, output.changes);
+	return output;
+}
+
+auto playlist::build_snapshot(const snapshot_source& source) -> snapshot_ptr
+{
+	using change_type = change::change_type;
+	if(source.changes.empty())
+		return source.base;
+	auto output = std::make_shared<snapshot>();
+	output->version = source.base->version + source.changes.size();
+	// Nothing before the last clear matters
+	auto first = std::find_if(
+		source.changes.rbegin(), 
+		source.changes.rend(),
+		[](const change_ptr& item) { return item->type == change_type::clear; }
+	).base();
+	if(first == source.changes.begin())
+		output->songs = source.base->songs;
+	auto& songs = output->songs;
+	for(auto iter = first; iter != source.changes.end(); ++iter) {
+		const auto& item = **iter;
+		if(item.type == change_type::add_songs) {
+			songs.insert(songs.end(), item.songs.begin(), item.songs.end());
+		}
+		else if(item.type == change_type::insert_songs) {
+			songs.insert(songs.begin() + item.index, item.songs.begin(), item.songs.end());
+		}
+		else if(item.type == change_type::delete_songs) {
+			// Indexes are sorted, so a single pass drops all of them
+			auto index = item.indexes.begin();
+			size_t kept = 0;
+			for(size_t i = 0; i < songs.size(); ++i) {
+				if(index != item.indexes.end() && *index == i) {
+					++index;
+					continue;
+				}
+				if(kept != i)
+					songs[kept] = std::move(songs[i]);
+				++kept;
+			}
+			songs.erase(songs.begin() + kept, songs.end());
+		}
+		else if(item.type == change_type::move_song) {
+			auto moved = std::move(songs[item.index]);
+			songs.erase(songs.begin() + item.index);
+			songs.insert(songs.begin() + item.destination, std::move(moved));
+		}
+	}
+	return output;
+}
+
+auto playlist::version() const -> version_type
+{
+	return m_version;
 }
 
-const std::vector<song>& playlist::songs() const
+bool playlist::changes_since(version_type version, std::vector<change_ptr>& output) const
 {
-	return m_songs;
+	if(version > m_version || m_version - version > m_changes.size())
+		return false;
+	output.assign(m_changes.end() - (m_version - version), m_changes.end());
+	return true;
 }
 
 auto playlist::playlist_mode() const -> mode
@@ -116,6 +405,8 @@ auto playlist::playlist_mode() const -> mode
 
 void playlist::playlist_mode(mode order)
 {
+	const auto previous = m_order;
+	log_undo([this, previous]() { m_order = previous; });
 	m_order = order;
 }
 
@@ -0,0 +1,226 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/algorithm/string/predicate.hpp>
+#include "prefetcher.h"
+#include "sharing_manager.h"
+
+using boost::algorithm::ends_with;
+
+std::tuple<song_stream, decoder::song_type> open_song(const song& a_song, 
+	const sharing_manager& manager)
+{
+	song_stream stream;
+	decoder::song_type song_type = decoder::song_type::generic;
+	if(a_song.schema() == song::schema_type::file) {
+		auto full_path = manager.find_full_path(a_song.path());
+		if(ends_with(full_path, "mp3"))
+			song_type = decoder::song_type::mp3;
+		stream = make_file_song_stream(full_path);
+	}
+	else if(a_song.schema() == song::schema_type::youtube_stream) {
+		stream = make_youtube_song_stream(a_song.path());
+	}
+	else {
+		throw std::runtime_error("Unknown schema for " + a_song.path());
+	}
+	return std::make_tuple(std::move(stream), song_type);
+}
+
+// ****************
+// ** prefetcher **
+// ****************
+
+prefetcher::entry::entry(song a_song, size_t buffer_size, unsigned sample_rate)
+: prefetched_song(std::move(a_song)), song_decoder(sample_rate), 
+buffer(buffer_size), finished(false)
+{
+
+}
+
+prefetcher::prefetcher(const sharing_manager& manager, size_t songs_to_prefetch, 
+	size_t buffer_size, unsigned sample_rate)
+: m_manager(manager), m_songs_to_prefetch(songs_to_prefetch), 
+m_buffer_size(buffer_size), m_sample_rate(sample_rate), m_playing(false),
+m_generation(0)
+{
+
+}
+
+prefetcher::~prefetcher()
+{
+	stop();
+	locker_type _(m_mutex);
+	for(auto& ptr : m_entries)
+		cancel(std::move(ptr));
+	if(m_active)
+		cancel(std::move(m_active));
+	for(auto& ptr : m_cancelled)
+		ptr->worker.join();
+}
+
+auto prefetcher::start(const song& a_song) -> entry_ptr
+{
+	entry_ptr output(new entry(a_song, m_buffer_size, m_sample_rate));
+	entry* ptr = output.get();
+	ptr->worker = std::thread(
+		[this, ptr]() {
+			try {
+				auto opened = open_song(ptr->prefetched_song, m_manager);
+				ptr->song_decoder.decode(
+					std::move(std::get<0>(opened)), 
+					ptr->buffer, 
+					std::get<1>(opened)
+				);
+			}
+			catch(std::exception& ex) {
+				std::cout << "Error prefetching " << ptr->prefetched_song.to_string() 
+						  << ": " << ex.what() << std::endl;
+			}
+			ptr->finished = true;
+			ptr->buffer.close();
+		}
+	);
+	return output;
+}
+
+// Opening youtube streams can't be interrupted, so cancelled entries are
+// joined lazily instead of blocking the caller.
+void prefetcher::cancel(entry_ptr ptr)
+{
+	ptr->song_decoder.stop_decode();
+	ptr->buffer.interrupt();
+	m_cancelled.push_back(std::move(ptr));
+}
+
+void prefetcher::reap_cancelled()
+{
+	auto iter = m_cancelled.begin();
+	while(iter != m_cancelled.end()) {
+		if((*iter)->finished) {
+			(*iter)->worker.join();
+			iter = m_cancelled.erase(iter);
+		}
+		else
+			++iter;
+	}
+}
+
+void prefetcher::prefetch(const std::vector<song>& songs)
+{
+	locker_type _(m_mutex);
+	reap_cancelled();
+	std::vector<entry_ptr> entries;
+	for(size_t i = 0; i < songs.size() && i < m_songs_to_prefetch; ++i) {
+		auto iter = std::find_if(
+			m_entries.begin(),
+			m_entries.end(),
+			[&](const entry_ptr& ptr) {
+				return ptr && ptr->prefetched_song == songs[i];
+			}
+		);
+		if(iter != m_entries.end())
+			entries.push_back(std::move(*iter));
+		else
+			entries.push_back(start(songs[i]));
+	}
+	for(auto& ptr : m_entries) {
+		if(ptr)
+			cancel(std::move(ptr));
+	}
+	m_entries = std::move(entries);
+}
+
+bool prefetcher::activate(const song& a_song, uint64_t generation)
+{
+	locker_type _(m_mutex);
+	auto iter = std::find_if(
+		m_entries.begin(),
+		m_entries.end(),
+		[&](const entry_ptr& ptr) {
+			return ptr->prefetched_song == a_song;
+		}
+	);
+	if(iter == m_entries.end())
+		return false;
+	if(m_active)
+		cancel(std::move(m_active));
+	m_active = std::move(*iter);
+	m_entries.erase(iter);
+	// A stop() that came in after the song was picked wins
+	m_playing = (generation == m_generation);
+	return true;
+}
+
+void prefetcher::play(types::decode_buffer_type& buffer)
+{
+	entry* active = nullptr;
+	{
+		locker_type _(m_mutex);
+		active = m_active.get();
+	}
+	if(!active)
+		return;
+	while(m_playing) {
+		auto input = active->buffer.peek(chunk_size);
+		if(input.empty()) {
+			// Only happens if decoding is slower than playback. Returns 
+			// false once the song is over or stop() is called.
+			if(!active->buffer.wait_for_data())
+				break;
+			continue;
+		}
+		if(!buffer.put(input.begin(), input.end()))
+			break;
+		active->buffer.release(input.size);
+	}
+	locker_type _(m_mutex);
+	m_playing = false;
+	cancel(std::move(m_active));
+}
+
+void prefetcher::stop()
+{
+	locker_type _(m_mutex);
+	// Both under the lock so activate() can't switch it back on
+	++m_generation;
+	m_playing = false;
+	if(m_active) {
+		m_active->song_decoder.stop_decode();
+		m_active->buffer.interrupt();
+	}
+}
+
+uint64_t prefetcher::generation() const
+{
+	locker_type _(m_mutex);
+	return m_generation;
+}
+
+bool prefetcher::is_playing() const
+{
+	return m_playing;
+}
+
+float prefetcher::percent_so_far()
+{
+	locker_type _(m_mutex);
+	return m_active ? m_active->song_decoder.percent_so_far() : 0;
+}
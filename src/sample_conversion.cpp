@@ -0,0 +1,291 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "sample_conversion.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SHAPLIM_X86_KERNELS
+	#include <immintrin.h>
+#endif
+
+namespace sample_conversion {
+
+// ************
+// ** scalar **
+// ************
+
+static short float_to_s16(float value)
+{
+	if(std::isnan(value))
+		return 0;
+	value *= 32768.0f;
+	value = std::min(std::max(value, -32768.0f), 32767.0f);
+	return static_cast<short>(std::lrint(value));
+}
+
+static void planar_float_to_s16_scalar(const float* left, const float* right,
+	short* output, size_t frames)
+{
+	for(size_t i = 0; i < frames; ++i) {
+		*output++ = float_to_s16(left[i]);
+		*output++ = float_to_s16(right[i]);
+	}
+}
+
+static void mono_to_stereo_s16_scalar(const short* input, short* output, 
+	size_t frames)
+{
+	for(size_t i = 0; i < frames; ++i) {
+		*output++ = input[i];
+		*output++ = input[i];
+	}
+}
+
+static void scale_s16_scalar(short* samples, size_t count, float gain)
+{
+	for(size_t i = 0; i < count; ++i) {
+		float value = samples[i] * gain;
+		value = std::min(std::max(value, -32768.0f), 32767.0f);
+		samples[i] = static_cast<short>(std::lrint(value));
+	}
+}
+
+#ifdef SHAPLIM_X86_KERNELS
+
+// **********
+// ** sse2 **
+// **********
+
+// Out of range values would convert to 0x80000000, so clip them like 
+// float_to_s16 does. NaNs are zeroed first since min and max return 
+// their second operand when either one is NaN.
+__attribute__((target("sse2")))
+static __m128 clamp_s16_sse2(__m128 values)
+{
+	values = _mm_and_ps(values, _mm_cmpord_ps(values, values));
+	values = _mm_max_ps(values, _mm_set1_ps(-32768.0f));
+	return _mm_min_ps(values, _mm_set1_ps(32767.0f));
+}
+
+__attribute__((target("sse2")))
+static void planar_float_to_s16_sse2(const float* left, const float* right,
+	short* output, size_t frames)
+{
+	const __m128 scale = _mm_set1_ps(32768.0f);
+	size_t i = 0;
+	for(; i + 4 <= frames; i += 4) {
+		// Conversion rounds to nearest
+		__m128i l = _mm_cvtps_epi32(clamp_s16_sse2(_mm_mul_ps(_mm_loadu_ps(left + i), scale)));
+		__m128i r = _mm_cvtps_epi32(clamp_s16_sse2(_mm_mul_ps(_mm_loadu_ps(right + i), scale)));
+		__m128i low = _mm_unpacklo_epi32(l, r);
+		__m128i high = _mm_unpackhi_epi32(l, r);
+		_mm_storeu_si128(
+			reinterpret_cast<__m128i*>(output + i * 2), 
+			_mm_packs_epi32(low, high)
+		);
+	}
+	planar_float_to_s16_scalar(left + i, right + i, output + i * 2, frames - i);
+}
+
+__attribute__((target("sse2")))
+static void mono_to_stereo_s16_sse2(const short* input, short* output, 
+	size_t frames)
+{
+	size_t i = 0;
+	for(; i + 8 <= frames; i += 8) {
+		__m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+		auto ptr = reinterpret_cast<__m128i*>(output + i * 2);
+		_mm_storeu_si128(ptr, _mm_unpacklo_epi16(samples, samples));
+		_mm_storeu_si128(ptr + 1, _mm_unpackhi_epi16(samples, samples));
+	}
+	mono_to_stereo_s16_scalar(input + i, output + i * 2, frames - i);
+}
+
+__attribute__((target("sse2")))
+static void scale_s16_sse2(short* samples, size_t count, float gain)
+{
+	const __m128 factor = _mm_set1_ps(gain);
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		auto ptr = reinterpret_cast<__m128i*>(samples + i);
+		__m128i input = _mm_loadu_si128(ptr);
+		// Sign extend to 32 bits
+		__m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(input, input), 16);
+		__m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(input, input), 16);
+		low = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(low), factor));
+		high = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(high), factor));
+		_mm_storeu_si128(ptr, _mm_packs_epi32(low, high));
+	}
+	scale_s16_scalar(samples + i, count - i, gain);
+}
+
+// **********
+// ** avx2 **
+// **********
+
+__attribute__((target("avx2")))
+static __m256 clamp_s16_avx2(__m256 values)
+{
+	values = _mm256_and_ps(values, _mm256_cmp_ps(values, values, _CMP_ORD_Q));
+	values = _mm256_max_ps(values, _mm256_set1_ps(-32768.0f));
+	return _mm256_min_ps(values, _mm256_set1_ps(32767.0f));
+}
+
+__attribute__((target("avx2")))
+static void planar_float_to_s16_avx2(const float* left, const float* right,
+	short* output, size_t frames)
+{
+	const __m256 scale = _mm256_set1_ps(32768.0f);
+	size_t i = 0;
+	for(; i + 8 <= frames; i += 8) {
+		__m256i l = _mm256_cvtps_epi32(clamp_s16_avx2(_mm256_mul_ps(_mm256_loadu_ps(left + i), scale)));
+		__m256i r = _mm256_cvtps_epi32(clamp_s16_avx2(_mm256_mul_ps(_mm256_loadu_ps(right + i), scale)));
+		// Unpacking and packing both work within 128 bit lanes, so the 
+		// output ends up in order: l0 r0 ... l3 r3 | l4 r4 ... l7 r7
+		__m256i low = _mm256_unpacklo_epi32(l, r);
+		__m256i high = _mm256_unpackhi_epi32(l, r);
+		_mm256_storeu_si256(
+			reinterpret_cast<__m256i*>(output + i * 2), 
+			_mm256_packs_epi32(low, high)
+		);
+	}
+	planar_float_to_s16_sse2(left + i, right + i, output + i * 2, frames - i);
+}
+
+__attribute__((target("avx2")))
+static void mono_to_stereo_s16_avx2(const short* input, short* output, 
+	size_t frames)
+{
+	size_t i = 0;
+	for(; i + 16 <= frames; i += 16) {
+		__m256i samples = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+		__m256i low = _mm256_unpacklo_epi16(samples, samples);
+		__m256i high = _mm256_unpackhi_epi16(samples, samples);
+		auto ptr = reinterpret_cast<__m256i*>(output + i * 2);
+		_mm256_storeu_si256(ptr, _mm256_permute2x128_si256(low, high, 0x20));
+		_mm256_storeu_si256(ptr + 1, _mm256_permute2x128_si256(low, high, 0x31));
+	}
+	mono_to_stereo_s16_sse2(input + i, output + i * 2, frames - i);
+}
+
+__attribute__((target("avx2")))
+static void scale_s16_avx2(short* samples, size_t count, float gain)
+{
+	const __m256 factor = _mm256_set1_ps(gain);
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16) {
+		auto ptr = reinterpret_cast<__m256i*>(samples + i);
+		__m256i input = _mm256_loadu_si256(ptr);
+		__m256i low = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(input));
+		__m256i high = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(input, 1));
+		low = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(low), factor));
+		high = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(high), factor));
+		// Packing interleaves the lanes, put them back in order
+		__m256i packed = _mm256_packs_epi32(low, high);
+		_mm256_storeu_si256(ptr, _mm256_permute4x64_epi64(packed, 0xd8));
+	}
+	scale_s16_sse2(samples + i, count - i, gain);
+}
+
+#endif // SHAPLIM_X86_KERNELS
+
+// ***************
+// ** dispatch **
+// ***************
+
+static const kernel_set scalar_kernels = {
+	&planar_float_to_s16_scalar,
+	&mono_to_stereo_s16_scalar,
+	&scale_s16_scalar
+};
+
+#ifdef SHAPLIM_X86_KERNELS
+static const kernel_set sse2_kernels = {
+	&planar_float_to_s16_sse2,
+	&mono_to_stereo_s16_sse2,
+	&scale_s16_sse2
+};
+
+static const kernel_set avx2_kernels = {
+	&planar_float_to_s16_avx2,
+	&mono_to_stereo_s16_avx2,
+	&scale_s16_avx2
+};
+#endif // SHAPLIM_X86_KERNELS
+
+bool is_supported(isa_level level)
+{
+	switch(level) {
+		case isa_level::scalar:
+			return true;
+		#ifdef SHAPLIM_X86_KERNELS
+		case isa_level::sse2:
+			return __builtin_cpu_supports("sse2");
+		case isa_level::avx2:
+			return __builtin_cpu_supports("avx2");
+		#endif
+		default:
+			return false;
+	}
+}
+
+isa_level best_isa_level()
+{
+	static const isa_level level = 
+		is_supported(isa_level::avx2) ? isa_level::avx2 : 
+		(is_supported(isa_level::sse2) ? isa_level::sse2 : isa_level::scalar);
+	return level;
+}
+
+const char* name(isa_level level)
+{
+	switch(level) {
+		case isa_level::sse2:
+			return "sse2";
+		case isa_level::avx2:
+			return "avx2";
+		default:
+			return "scalar";
+	}
+}
+
+const kernel_set& kernels(isa_level level)
+{
+	if(!is_supported(level))
+		throw std::runtime_error("Instruction set not supported");
+	switch(level) {
+		#ifdef SHAPLIM_X86_KERNELS
+		case isa_level::sse2:
+			return sse2_kernels;
+		case isa_level::avx2:
+			return avx2_kernels;
+		#endif
+		default:
+			return scalar_kernels;
+	}
+}
+
+const kernel_set& kernels()
+{
+	static const kernel_set& best = kernels(best_isa_level());
+	return best;
+}
+
+} // sample_conversion
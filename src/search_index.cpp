@@ -0,0 +1,280 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <limits>
+#include "search_index.h"
+#include "song_database.h"
+
+static const unsigned field_weights[] = { 4, 3, 2, 1 };
+// Don't bother rebuilding tiny indexes
+static const size_t min_dead_documents_to_rebuild = 1024;
+
+static std::string to_lower(std::string input)
+{
+	for(auto& c : input)
+		c = std::tolower(static_cast<unsigned char>(c));
+	return input;
+}
+
+static uint32_t make_trigram(const char* ptr)
+{
+	return (static_cast<uint32_t>(static_cast<unsigned char>(ptr[0])) << 16) |
+		(static_cast<uint32_t>(static_cast<unsigned char>(ptr[1])) << 8) |
+		static_cast<unsigned char>(ptr[2]);
+}
+
+// Adds every trigram in input to output, which might contain duplicates.
+static void add_trigrams(const std::string& input, std::vector<uint32_t>& output)
+{
+	for(size_t i = 0; i + 3 <= input.size(); ++i)
+		output.push_back(make_trigram(input.data() + i));
+}
+
+// Tags that were never set aren't worth searching for
+static std::string tag_field(const std::string& value)
+{
+	return value == "Unknown" ? std::string() : to_lower(value);
+}
+
+search_index::search_index()
+: m_dead_documents(0)
+{
+
+}
+
+void search_index::add_song(const std::string& path, const std::string& file_name,
+	const song_information* info)
+{
+	fields_type fields;
+	if(info) {
+		fields[0] = tag_field(info->title());
+		fields[1] = tag_field(info->artist());
+		fields[2] = tag_field(info->album());
+	}
+	fields[3] = to_lower(file_name);
+	locker_type _(m_mutex);
+	remove(path);
+	insert(path, std::move(fields));
+}
+
+void search_index::update_tags(const std::string& path, const song_information& info)
+{
+	locker_type _(m_mutex);
+	auto iter = m_ids.find(path);
+	if(iter == m_ids.end())
+		return;
+	fields_type fields = m_documents[iter->second].fields;
+	fields[0] = tag_field(info.title());
+	fields[1] = tag_field(info.artist());
+	fields[2] = tag_field(info.album());
+	if(fields == m_documents[iter->second].fields)
+		return;
+	remove(path);
+	insert(path, std::move(fields));
+}
+
+void search_index::remove_song(const std::string& path)
+{
+	locker_type _(m_mutex);
+	remove(path);
+}
+
+void search_index::remove_directory(const std::string& path)
+{
+	const std::string prefix = path + "/";
+	locker_type _(m_mutex);
+	std::vector<std::string> to_remove;
+	for(const auto& entry : m_ids) {
+		if(entry.first.compare(0, prefix.size(), prefix) == 0)
+			to_remove.push_back(entry.first);
+	}
+	for(const auto& song_path : to_remove)
+		remove(song_path);
+}
+
+size_t search_index::size() const
+{
+	locker_type _(m_mutex);
+	return m_ids.size();
+}
+
+// Requires the lock to be held. Ids only grow, so posting lists stay 
+// sorted by just appending to them.
+void search_index::insert(std::string path, fields_type fields)
+{
+	if(m_documents.size() == std::numeric_limits<document_id>::max())
+		rebuild();
+	const document_id id = m_documents.size();
+	std::vector<uint32_t> trigrams;
+	for(const auto& field : fields)
+		add_trigrams(field, trigrams);
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	for(auto trigram : trigrams)
+		m_postings[trigram].push_back(id);
+	m_ids[path] = id;
+	m_documents.push_back(document{std::move(path), std::move(fields), true});
+}
+
+// Requires the lock to be held. Documents are only marked as dead, their 
+// ids are skipped when searching until the next rebuild.
+void search_index::remove(const std::string& path)
+{
+	auto iter = m_ids.find(path);
+	if(iter == m_ids.end())
+		return;
+	auto& doc = m_documents[iter->second];
+	doc.alive = false;
+	doc.fields = fields_type();
+	m_ids.erase(iter);
+	++m_dead_documents;
+	if(m_dead_documents >= min_dead_documents_to_rebuild && 
+	   m_dead_documents > m_documents.size() / 2)
+		rebuild();
+}
+
+// Requires the lock to be held
+void search_index::rebuild()
+{
+	std::vector<document> documents;
+	documents.swap(m_documents);
+	m_postings.clear();
+	m_ids.clear();
+	m_dead_documents = 0;
+	for(auto& doc : documents) {
+		if(doc.alive)
+			insert(std::move(doc.path), std::move(doc.fields));
+	}
+}
+
+// Every word has to show up in some field. Matches in more relevant 
+// fields and at the beginning of a word score higher. Returns 0 if some 
+// word doesn't match.
+unsigned search_index::score(const document& doc, 
+	const std::vector<std::string>& words) const
+{
+	unsigned total = 0;
+	for(const auto& word : words) {
+		unsigned best = 0;
+		for(size_t i = 0; i < field_count; ++i) {
+			const auto& field = doc.fields[i];
+			auto position = field.find(word);
+			if(position == std::string::npos)
+				continue;
+			const bool word_start = position == 0 || 
+				!std::isalnum(static_cast<unsigned char>(field[position - 1]));
+			best = std::max(best, field_weights[i] * (word_start ? 2 : 1));
+		}
+		if(best == 0)
+			return 0;
+		total += best;
+	}
+	return total;
+}
+
+auto search_index::search(const std::string& query, size_t offset, size_t limit,
+	size_t& total_matches) const -> std::vector<result>
+{
+	std::vector<std::string> words;
+	std::vector<uint32_t> trigrams;
+	{
+		const std::string lowered = to_lower(query);
+		size_t start = 0;
+		while(start < lowered.size()) {
+			auto end = lowered.find_first_of(" \t", start);
+			if(end == std::string::npos)
+				end = lowered.size();
+			if(end > start) {
+				words.push_back(lowered.substr(start, end - start));
+				add_trigrams(words.back(), trigrams);
+			}
+			start = end + 1;
+		}
+	}
+	total_matches = 0;
+	if(words.empty())
+		return {};
+
+	locker_type _(m_mutex);
+	std::vector<document_id> candidates;
+	if(trigrams.empty()) {
+		// Only short words, every song is a candidate
+		for(const auto& entry : m_ids)
+			candidates.push_back(entry.second);
+	}
+	else {
+		std::vector<const posting_list*> lists;
+		for(auto trigram : trigrams) {
+			auto iter = m_postings.find(trigram);
+			if(iter == m_postings.end())
+				return {};
+			lists.push_back(&iter->second);
+		}
+		// Start from the shortest list so intermediate results stay small
+		std::sort(
+			lists.begin(), 
+			lists.end(),
+			[](const posting_list* lhs, const posting_list* rhs) {
+				return lhs->size() < rhs->size();
+			}
+		);
+		lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+		candidates = *lists[0];
+		std::vector<document_id> intersection;
+		for(size_t i = 1; i < lists.size() && !candidates.empty(); ++i) {
+			intersection.clear();
+			std::set_intersection(
+				candidates.begin(), candidates.end(),
+				lists[i]->begin(), lists[i]->end(),
+				std::back_inserter(intersection)
+			);
+			candidates.swap(intersection);
+		}
+	}
+
+	std::vector<std::pair<unsigned, document_id>> matches;
+	for(auto id : candidates) {
+		const auto& doc = m_documents[id];
+		if(!doc.alive)
+			continue;
+		auto doc_score = score(doc, words);
+		if(doc_score > 0)
+			matches.emplace_back(doc_score, id);
+	}
+	total_matches = matches.size();
+	if(offset >= matches.size())
+		return {};
+	const size_t end = std::min(matches.size(), offset + limit);
+	// Best score first, ties sorted by path
+	std::partial_sort(
+		matches.begin(),
+		matches.begin() + end,
+		matches.end(),
+		[&](const std::pair<unsigned, document_id>& lhs, 
+			const std::pair<unsigned, document_id>& rhs) {
+			if(lhs.first != rhs.first)
+				return lhs.first > rhs.first;
+			return m_documents[lhs.second].path < m_documents[rhs.second].path;
+		}
+	);
+	std::vector<result> output;
+	for(size_t i = offset; i < end; ++i)
+		output.push_back(result{m_documents[matches[i].second].path, matches[i].first});
+	return output;
+}
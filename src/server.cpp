@@ -18,74 +18,257 @@
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <vector>
+#include <algorithm>
+#include <cstring>
 #include <jsoncpp/json/writer.h>
 #include "server.h"
+#include "msgpack.h"
 
 using boost::asio::ip::tcp;
 using boost::asio::ip::udp;
 
+constexpr size_t session::max_pending_requests;
+constexpr size_t session::max_queued_pushes;
+
 session::session(socket_type sock, callback_type callback)
-: m_socket(std::move(sock)), m_read_buffer(), m_callback(std::move(callback))
+: m_socket(std::move(sock)), m_strand(m_socket.get_io_service()), m_read_buffer(), 
+m_callback(std::move(callback)),
+m_next_request(0), m_next_reply(0), m_writing(0), m_reading(false), 
+m_streaming(false), m_encoding(encoding_type::json), m_closed(false)
 {
 
 }
 
 void session::start() 
 {
-	do_read();
+	m_strand.dispatch(std::bind(&session::do_read, shared_from_this()));
 }
 
+// Every function below runs on m_strand, except for reply and push.
+
 void session::do_read()
 {
-  auto self = shared_from_this();
-  boost::asio::async_read_until(
-    	m_socket,
-    	m_read_buffer,
-    	'\n',
-        [this, self](boost::system::error_code ec, std::size_t length)
-        {
-         	if (!ec) {
-         		std::istream is(&m_read_buffer);
-         		std::string str;
-         		std::getline(is, str);
-         		try {
-	        		auto result = m_callback(*this, std::move(str));
-	        		Json::FastWriter writer;
-	        		m_send_buffer = writer.write(result);
-	        		do_write();
-	        	}
-	        	catch(std::exception& ex) { 
-	        		close();
-	        	}
-          	}
-          	else
-          		close();
-        }
-    );
+	handle_requests();
+	if(m_reading || m_closed)
+		return;
+	if(!m_streaming && pending_requests() >= max_pending_requests)
+		return;
+	m_reading = true;
+	auto self = shared_from_this();
+	// Whatever arrives is handled, rather than waiting for a delimiter, 
+	// since the encoding can change while this read is in progress.
+	boost::asio::async_read(
+		m_socket,
+		m_read_buffer,
+		boost::asio::transfer_at_least(1),
+		m_strand.wrap(
+			[this, self](boost::system::error_code ec, std::size_t) {
+				m_reading = false;
+				if(!ec)
+					do_read();
+				else
+					close();
+			}
+		)
+	);
+}
+
+// A single read can bring several requests, they're all dispatched 
+// without waiting for the previous ones to be answered. The encoding 
+// is checked again for every request, since one of them can change it.
+void session::handle_requests()
+{
+	const char* data;
+	size_t size;
+	size_t consumed;
+	while(!m_closed && pending_requests() < max_pending_requests) {
+		if(m_streaming) {
+			// Reads keep going only to notice when the client goes away
+			m_read_buffer.consume(m_read_buffer.size());
+			return;
+		}
+		if(!next_request(data, size, consumed))
+			return;
+		const encoding_type encoding = m_encoding;
+		const request_id id = m_next_request++;
+		auto self = shared_from_this();
+		try {
+			m_callback(
+				*this, 
+				encoding,
+				data,
+				size,
+				[self, id, encoding](Json::Value result) { 
+					self->reply(id, encoding, std::move(result)); 
+				}
+			);
+		}
+		catch(std::exception& ex) { 
+			close();
+		}
+		m_read_buffer.consume(consumed);
+	}
+}
+
+// Finds a complete request at the start of the read buffer. consumed 
+// is the amount of bytes it takes up, including its framing.
+bool session::next_request(const char*& data, size_t& size, size_t& consumed)
+{
+	// streambuf keeps its input in a single contiguous block
+	const char* buffer = boost::asio::buffer_cast<const char*>(m_read_buffer.data());
+	const size_t available = m_read_buffer.size();
+	if(m_encoding == encoding_type::json) {
+		auto end = static_cast<const char*>(std::memchr(buffer, '\n', available));
+		if(!end)
+			return false;
+		data = buffer;
+		size = end - buffer;
+		consumed = size + 1;
+		return true;
+	}
+	if(available < msgpack_frame_header_size)
+		return false;
+	size = msgpack_frame_size(buffer);
+	if(size > msgpack_max_frame_size) {
+		close();
+		return false;
+	}
+	if(available - msgpack_frame_header_size < size)
+		return false;
+	data = buffer + msgpack_frame_header_size;
+	consumed = msgpack_frame_header_size + size;
+	return true;
+}
+
+size_t session::pending_requests() const
+{
+	return (m_next_request - m_next_reply) + m_write_queue.size();
 }
 
 void session::close() 
 {
+	if(m_closed.exchange(true))
+		return;
 	boost::system::error_code ignored_ec;
     m_socket.shutdown(
     	tcp::socket::shutdown_both,
         ignored_ec
     );
-	m_socket.close();
+	m_socket.close(ignored_ec);
+}
+
+// Serializing here keeps that work off the strand when the reply comes 
+// from a worker.
+void session::reply(request_id id, encoding_type encoding, Json::Value result)
+{
+	shared_data data;
+	if(encoding == encoding_type::json) {
+		Json::FastWriter writer;
+		data = std::make_shared<std::string>(writer.write(result));
+	}
+	else
+		data = std::make_shared<std::string>(msgpack_frame(result));
+	auto self = shared_from_this();
+	m_strand.post(
+		[this, self, id, data]() {
+			queue_reply(id, data);
+		}
+	);
 }
 
+// Replies are written in the same order the requests came in
+void session::queue_reply(request_id id, shared_data data)
+{
+	m_finished[id] = std::move(data);
+	auto iter = m_finished.begin();
+	while(iter != m_finished.end() && iter->first == m_next_reply) {
+		m_write_queue.push_back(std::move(iter->second));
+		iter = m_finished.erase(iter);
+		++m_next_reply;
+	}
+	flush_pushes();
+	do_write();
+}
+
+void session::start_streaming()
+{
+	m_streaming = true;
+}
+
+auto session::encoding() const -> encoding_type
+{
+	return m_encoding;
+}
+
+void session::set_encoding(encoding_type encoding)
+{
+	m_encoding = encoding;
+}
+
+bool session::push(shared_data data)
+{
+	if(m_closed)
+		return false;
+	auto self = shared_from_this();
+	m_strand.post(
+		[this, self, data]() {
+			queue_push(data);
+		}
+	);
+	return true;
+}
+
+void session::queue_push(shared_data data)
+{
+	if(m_closed)
+		return;
+	m_pushes.push_back(std::move(data));
+	if(m_pushes.size() + m_write_queue.size() > max_queued_pushes) {
+		close();
+		return;
+	}
+	flush_pushes();
+	do_write();
+}
+
+// Pushed data never gets in front of a reply the client is waiting for
+void session::flush_pushes()
+{
+	if(m_next_reply != m_next_request)
+		return;
+	while(!m_pushes.empty()) {
+		m_write_queue.push_back(std::move(m_pushes.front()));
+		m_pushes.pop_front();
+	}
+}
+
+// Everything that's queued is sent in a single write
 void session::do_write()
 {
+	if(m_writing > 0 || m_closed || m_write_queue.empty())
+		return;
+	std::vector<boost::asio::const_buffer> buffers;
+	for(const auto& data : m_write_queue)
+		buffers.push_back(boost::asio::buffer(*data));
+	m_writing = m_write_queue.size();
 	auto self = shared_from_this();
 	boost::asio::async_write(
 		m_socket, 
-		boost::asio::buffer(m_send_buffer), 
-		[this, self](boost::system::error_code ec, std::size_t) { 
-			if(!ec)
+		buffers, 
+		m_strand.wrap(
+			[this, self](boost::system::error_code ec, std::size_t) { 
+				if(ec) {
+					close();
+					return;
+				}
+				m_write_queue.erase(m_write_queue.begin(), m_write_queue.begin() + m_writing);
+				m_writing = 0;
+				do_write();
+				// Reading might have stopped because too many requests were pending
 				do_read();
-			else
-				close();
-		}
+			}
+		)
 	);
 }
 
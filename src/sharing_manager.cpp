@@ -18,7 +18,7 @@
 #include "sharing_manager.h"
 
 sharing_manager::sharing_manager(const std::vector<std::string>& shared_dirs)
-: m_virtual_root(make_virtual_directory(shared_dirs.begin(), shared_dirs.end()))
+: m_tree(shared_dirs)
 {
 
 }
@@ -26,27 +26,32 @@ sharing_manager::sharing_manager(const std::vector<std::string>& shared_dirs)
 std::vector<std::string> sharing_manager::shared_directories()
 {
 	std::vector<std::string> output;
-	for(const auto& dir : m_virtual_root.directories())
-		output.push_back(dir.name().string());
+	for(const auto& dir : m_tree.root().directories())
+		output.push_back(dir.name().to_string());
 	return output;
 }
 
-const directory& sharing_manager::find_directory(const std::string& full_path) const
+directory sharing_manager::find_directory(const std::string& full_path) const
 {
-	directory::path_type dir_path(full_path);
-	return m_virtual_root.find_directory(dir_path.begin(), dir_path.end());
+	return m_tree.find_directory(full_path);
+}
+
+directory sharing_manager::root() const
+{
+	return m_tree.root();
 }
 
 std::string sharing_manager::find_full_path(const std::string& shared_path) const
 {
-	directory::path_type dir_path(shared_path);
-	auto end = dir_path.begin();
-	++end;
-	const auto& dir = m_virtual_root.find_directory(dir_path.begin(), end);
-	auto path = dir.path();
-	while(end != dir_path.end()) {
-		path /= *end;
-		++end;
+	return m_tree.find_full_path(shared_path);
+}
+
+std::string sharing_manager::shared_path(const std::string& full_path) const
+{
+	for(const auto& dir : m_tree.root().directories()) {
+		const auto prefix = dir.path().string() + "/";
+		if(full_path.compare(0, prefix.size(), prefix) == 0)
+			return dir.name().to_string() + full_path.substr(prefix.size() - 1);
 	}
-	return path.string();
+	return std::string();
 }
@@ -45,3 +45,13 @@ std::string song::to_string() const
 	else
 		return "youtube://" + m_path;
 }
+
+bool operator==(const song& lhs, const song& rhs)
+{
+	return lhs.schema() == rhs.schema() && lhs.path() == rhs.path();
+}
+
+bool operator!=(const song& lhs, const song& rhs)
+{
+	return !(lhs == rhs);
+}
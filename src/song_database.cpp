@@ -15,17 +15,112 @@
  * MA 02110-1301, USA.
  */
 
-#include <iterator>
-#include <boost/archive/iterators/base64_from_binary.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
+#include <cerrno>
+#include <fstream>
+#include <sys/stat.h>
 #include <taglib/fileref.h>
 #include <taglib/id3v2tag.h>
 #include <taglib/mpegfile.h>
 #include <taglib/attachedpictureframe.h>
+#include <taglib/flacfile.h>
+#include <taglib/flacpicture.h>
+#include <taglib/mp4file.h>
+#include <taglib/xiphcomment.h>
 #include "song_database.h"
+#include "artwork_store.h"
+
+static bool id3v2_picture(TagLib::ID3v2::Tag* tag, std::string& mime, 
+	std::string& data)
+{
+	if(!tag)
+		return false;
+	const TagLib::ID3v2::FrameList& l = tag->frameListMap()["APIC"];
+	if(l.isEmpty())
+		return false;
+	using TagLib::ID3v2::AttachedPictureFrame;
+
+	auto picture_frame = static_cast<AttachedPictureFrame*> (*l.begin());
+	const auto& image = picture_frame->picture();
+	mime = picture_frame->mimeType().to8Bit();
+	data.assign(image.data(), image.data() + image.size());
+	return true;
+}
+
+// FLAC and Ogg files use the same picture blocks
+static bool flac_picture(const TagLib::List<TagLib::FLAC::Picture*>& pictures, 
+	std::string& mime, std::string& data)
+{
+	if(pictures.isEmpty())
+		return false;
+	auto picture = pictures.front();
+	const auto& image = picture->data();
+	mime = picture->mimeType().to8Bit();
+	data.assign(image.data(), image.data() + image.size());
+	return true;
+}
+
+static bool mp4_picture(TagLib::MP4::Tag* tag, std::string& mime, 
+	std::string& data)
+{
+	if(!tag || !tag->contains("covr"))
+		return false;
+	const auto covers = tag->item("covr").toCoverArtList();
+	if(covers.isEmpty())
+		return false;
+	const auto& cover = covers.front();
+	switch(cover.format()) {
+		case TagLib::MP4::CoverArt::PNG:
+			mime = "image/png";
+			break;
+		case TagLib::MP4::CoverArt::BMP:
+			mime = "image/bmp";
+			break;
+		case TagLib::MP4::CoverArt::GIF:
+			mime = "image/gif";
+			break;
+		default:
+			mime = "image/jpeg";
+			break;
+	}
+	const auto image = cover.data();
+	data.assign(image.data(), image.data() + image.size());
+	return true;
+}
+
+// Each format keeps its pictures somewhere else
+static bool embedded_picture(const TagLib::FileRef& file, std::string& mime, 
+	std::string& data)
+{
+	if(auto mpeg = dynamic_cast<TagLib::MPEG::File*>(file.file()))
+		return id3v2_picture(mpeg->ID3v2Tag(), mime, data);
+	if(auto flac = dynamic_cast<TagLib::FLAC::File*>(file.file()))
+		return flac_picture(flac->pictureList(), mime, data);
+	if(auto mp4 = dynamic_cast<TagLib::MP4::File*>(file.file()))
+		return mp4_picture(mp4->tag(), mime, data);
+	// Vorbis, Opus and the rest of the Ogg formats
+	if(auto xiph = dynamic_cast<TagLib::Ogg::XiphComment*>(file.tag()))
+		return flac_picture(xiph->pictureList(), mime, data);
+	return false;
+}
+
+artwork_store::read_result read_embedded_picture(const std::string& file_name, 
+	std::string& mime, std::string& data)
+{
+	using read_result = artwork_store::read_result;
+	struct stat info;
+	if(stat(file_name.c_str(), &info) != 0)
+		return (errno == ENOENT || errno == ENOTDIR) ? read_result::missing : read_result::unavailable;
+	// The file exists, so failing to open it is most likely temporary
+	if(!std::ifstream(file_name))
+		return read_result::unavailable;
+	TagLib::FileRef f(file_name.c_str());
+	if(f.isNull())
+		return read_result::missing;
+	return embedded_picture(f, mime, data) ? read_result::found : read_result::missing;
+}
 
 song_information::song_information()
-: m_artist("Unknown"), m_album("Unknown"), m_title("Unknown"), m_picture(), 
+: m_artist("Unknown"), m_album("Unknown"), m_title("Unknown"), m_picture_id(), 
 m_picture_mime(), m_length()
 {
 
@@ -34,38 +129,19 @@ m_picture_mime(), m_length()
 song_information::song_information(const std::string& file_name)
 : m_length()
 {
-	TagLib::MPEG::File f(file_name.c_str());
-    auto tag = f.tag();
-    m_artist = tag->artist().to8Bit(true);
-    m_title = tag->title().to8Bit(true);
-    m_album = tag->album().to8Bit(true);
-    if(f.audioProperties())
-    	m_length = std::chrono::seconds(f.audioProperties()->length());
-    if(f.ID3v2Tag()) {
-        const TagLib::ID3v2::FrameList& l = f.ID3v2Tag()->frameListMap()["APIC"];
-        if(!l.isEmpty()) {
-            using TagLib::ID3v2::AttachedPictureFrame;
-
-            auto picture_frame = static_cast<AttachedPictureFrame*> (*l.begin());
-            const auto& image = picture_frame->picture();
-            m_picture_mime = picture_frame->mimeType().to8Bit();
-            using base64_text =	boost::archive::iterators::base64_from_binary<
-				boost::archive::iterators::transform_width<
-    				const char *,
-    				6,
-    				8
-				>
-			>;
-			std::copy(
-				base64_text(image.data()),
-				base64_text(image.data() + image.size()),
-				std::back_inserter(m_picture)
-			);
-            auto padding = image.size() % 3;
-            if(padding != 0)
-                m_picture.insert(m_picture.end(), 3 - padding, '=');
-        }
+	// Picks the right file type from the extension
+	TagLib::FileRef f(file_name.c_str());
+    auto tag = f.isNull() ? nullptr : f.tag();
+    if(tag) {
+        m_artist = tag->artist().to8Bit(true);
+        m_title = tag->title().to8Bit(true);
+        m_album = tag->album().to8Bit(true);
     }
+    if(!f.isNull() && f.audioProperties())
+    	m_length = std::chrono::seconds(f.audioProperties()->length());
+    std::string picture;
+    if(embedded_picture(f, m_picture_mime, picture))
+        m_picture_id = artwork_store::instance.add(m_picture_mime, std::move(picture));
     if(m_artist.empty())
     	m_artist = "Unknown";
    	if(m_title.empty())
@@ -89,9 +165,9 @@ const std::string& song_information::title() const
 	return m_title;
 }
 
-const std::string& song_information::picture() const
+const std::string& song_information::picture_id() const
 {
-	return m_picture;
+	return m_picture_id;
 }
 
 const std::string& song_information::picture_mime() const
@@ -119,9 +195,14 @@ void song_information::title(std::string data)
     m_title = std::move(data);
 }
 
-void song_information::picture(std::string data)
+void song_information::picture_id(std::string data)
+{
+    m_picture_id = std::move(data);
+}
+
+void song_information::picture_mime(std::string data)
 {
-    m_picture = std::move(data);
+    m_picture_mime = std::move(data);
 }
 
 void song_information::length(std::chrono::seconds data)
@@ -133,24 +214,96 @@ void song_information::length(std::chrono::seconds data)
 // ** song_database **
 // *******************
 
-using lock_type = std::lock_guard<std::mutex>;
-
 song_database song_database::instance;
 
-const song_information& song_database::song_info(const std::string& path)
+void song_database::load_cache(const std::string& file_path)
 {
-	lock_type _(m_lock);
-	auto iter = m_db.find(path);
-	if(iter == m_db.end()) {
-		iter = m_db.insert(
-			std::make_pair(path, song_information(path))
-		).first;
+	metadata_cache::entries_type entries;
+	{
+		locker_type _(m_cache_lock);
+		entries = m_cache.open(file_path);
+	}
+	for(auto& entry : entries) {
+		auto& target = shard_for(entry.first);
+		locker_type _(target.lock);
+		target.entries.insert(std::move(entry));
 	}
-	return iter->second;
+}
+
+auto song_database::shard_for(const std::string& path) -> shard&
+{
+	return m_shards[std::hash<std::string>()(path) % shard_count];
+}
+
+// Paths that aren't files (e.g. youtube songs) have no stamp and are
+// never invalidated.
+auto song_database::find(const std::string& path, bool is_file, 
+	const file_stamp& stamp) -> info_ptr
+{
+	auto& target = shard_for(path);
+	locker_type _(target.lock);
+	auto iter = target.entries.find(path);
+	if(iter != target.entries.end() && (!is_file || iter->second.stamp == stamp))
+		return iter->second.info;
+	return nullptr;
+}
+
+auto song_database::cached_song_info(const std::string& path) -> info_ptr
+{
+	file_stamp stamp{0, 0};
+	const bool is_file = file_stamp::from_file(path, stamp);
+	return find(path, is_file, stamp);
+}
+
+auto song_database::known_song_info(const std::string& path) -> info_ptr
+{
+	auto& target = shard_for(path);
+	locker_type _(target.lock);
+	auto iter = target.entries.find(path);
+	return iter == target.entries.end() ? nullptr : iter->second.info;
+}
+
+auto song_database::song_info(const std::string& path) -> info_ptr
+{
+	file_stamp stamp{0, 0};
+	const bool is_file = file_stamp::from_file(path, stamp);
+	if(auto info = find(path, is_file, stamp))
+		return info;
+	// Parse without holding any lock
+	cached_song_information entry{stamp, std::make_shared<song_information>(path)};
+	if(is_file) {
+		locker_type _(m_cache_lock);
+		m_cache.append(path, entry);
+	}
+	{
+		auto& target = shard_for(path);
+		locker_type _(target.lock);
+		target.entries[path] = entry;
+	}
+	if(m_update_observer)
+		m_update_observer(path, entry.info);
+	return entry.info;
+}
+
+void song_database::invalidate(const std::string& path)
+{
+	auto& target = shard_for(path);
+	locker_type _(target.lock);
+	target.entries.erase(path);
+}
+
+void song_database::set_update_observer(update_observer_type observer)
+{
+	m_update_observer = std::move(observer);
 }
 
 void song_database::set_song_info(std::string path, song_information data)
 {
-    lock_type _(m_lock);
-    m_db[std::move(path)] = std::move(data);
+    cached_song_information entry{
+        file_stamp{0, 0}, 
+        std::make_shared<song_information>(std::move(data))
+    };
+    auto& target = shard_for(path);
+    locker_type _(target.lock);
+    target.entries[std::move(path)] = std::move(entry);
 }
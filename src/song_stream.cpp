@@ -69,6 +69,16 @@ void song_stream::seek(size_t pos)
 	m_impl->seek(pos);
 }
 
+bool song_stream::is_memory_backed()
+{
+	return m_impl->is_memory_backed();
+}
+
+void song_stream::advise_sequential()
+{
+	m_impl->advise_sequential();
+}
+
 song_stream make_file_song_stream(const std::string& path)
 {
 	return song_stream(
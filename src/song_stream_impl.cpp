@@ -20,6 +20,7 @@
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
 #include <boost/algorithm/string/replace.hpp>
+#include <sys/mman.h>
 #include "song_database.h"
 #include "song_stream_impl.h"
 
@@ -68,6 +69,18 @@ void file_song_stream_impl::seek(size_t pos)
 	m_data = m_base_data + pos;
 }
 
+bool file_song_stream_impl::is_memory_backed()
+{
+	return true;
+}
+
+// Lets the kernel read ahead aggressively and drop pages behind us.
+void file_song_stream_impl::advise_sequential()
+{
+	if(m_file.size() > 0)
+		madvise(const_cast<char*>(m_base_data), m_file.size(), MADV_SEQUENTIAL);
+}
+
 // **********************
 // ** song_stream_impl **
 // **********************
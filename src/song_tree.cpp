@@ -0,0 +1,236 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include "song_tree.h"
+
+constexpr song_tree::node_id song_tree::no_node;
+
+song_tree::song_tree()
+: m_size(0)
+{
+	m_roots.fill(no_node);
+}
+
+size_t song_tree::size() const
+{
+	return m_size;
+}
+
+bool song_tree::empty() const
+{
+	return m_size == 0;
+}
+
+auto song_tree::insert(song value, size_t listed_position, size_t played_position) -> node_id
+{
+	node_id id;
+	if(m_free_nodes.empty()) {
+		id = m_nodes.size();
+		m_nodes.emplace_back();
+	}
+	else {
+		id = m_free_nodes.back();
+		m_free_nodes.pop_back();
+	}
+	auto& item = m_nodes[id];
+	item.value = std::move(value);
+	item.priority = m_generator();
+	attach(id, sequence::listed, listed_position);
+	attach(id, sequence::played, played_position);
+	++m_size;
+	return id;
+}
+
+void song_tree::erase(node_id id)
+{
+	detach(id, sequence::listed);
+	detach(id, sequence::played);
+	// Release the path right away
+	m_nodes[id].value = song();
+	m_free_nodes.push_back(id);
+	--m_size;
+}
+
+void song_tree::move(node_id id, sequence which, size_t position)
+{
+	detach(id, which);
+	attach(id, which, position);
+}
+
+auto song_tree::at(sequence which, size_t position) const -> node_id
+{
+	node_id id = m_roots[static_cast<size_t>(which)];
+	while(id != no_node) {
+		const auto& item = get_links(id, which);
+		const size_t left_size = subtree_size(item.left, which);
+		if(position < left_size)
+			id = item.left;
+		else if(position == left_size)
+			return id;
+		else {
+			position -= left_size + 1;
+			id = item.right;
+		}
+	}
+	return no_node;
+}
+
+size_t song_tree::position(sequence which, node_id id) const
+{
+	size_t output = subtree_size(get_links(id, which).left, which);
+	node_id parent = get_links(id, which).parent;
+	while(parent != no_node) {
+		const auto& item = get_links(parent, which);
+		if(item.right == id)
+			output += subtree_size(item.left, which) + 1;
+		id = parent;
+		parent = item.parent;
+	}
+	return output;
+}
+
+auto song_tree::next(sequence which, node_id id) const -> node_id
+{
+	const auto* item = &get_links(id, which);
+	if(item->right != no_node) {
+		id = item->right;
+		while(get_links(id, which).left != no_node)
+			id = get_links(id, which).left;
+		return id;
+	}
+	while(item->parent != no_node && get_links(item->parent, which).right == id) {
+		id = item->parent;
+		item = &get_links(id, which);
+	}
+	return item->parent;
+}
+
+const song& song_tree::value(node_id id) const
+{
+	return m_nodes[id].value;
+}
+
+void song_tree::clear()
+{
+	m_nodes.clear();
+	m_free_nodes.clear();
+	m_roots.fill(no_node);
+	m_size = 0;
+}
+
+auto song_tree::get_links(node_id id, sequence which) -> links&
+{
+	return m_nodes[id].sequences[static_cast<size_t>(which)];
+}
+
+auto song_tree::get_links(node_id id, sequence which) const -> const links&
+{
+	return m_nodes[id].sequences[static_cast<size_t>(which)];
+}
+
+auto song_tree::root(sequence which) -> node_id&
+{
+	return m_roots[static_cast<size_t>(which)];
+}
+
+uint32_t song_tree::subtree_size(node_id id, sequence which) const
+{
+	return id == no_node ? 0 : get_links(id, which).size;
+}
+
+void song_tree::update(node_id id, sequence which)
+{
+	auto& item = get_links(id, which);
+	item.size = subtree_size(item.left, which) + subtree_size(item.right, which) + 1;
+}
+
+void song_tree::set_left(node_id id, sequence which, node_id child)
+{
+	get_links(id, which).left = child;
+	if(child != no_node)
+		get_links(child, which).parent = id;
+}
+
+void song_tree::set_right(node_id id, sequence which, node_id child)
+{
+	get_links(id, which).right = child;
+	if(child != no_node)
+		get_links(child, which).parent = id;
+}
+
+// The first count nodes end up on the left tree. Parent links of the 
+// returned roots are fixed by the caller.
+auto song_tree::split(node_id id, sequence which, size_t count) 
+	-> std::pair<node_id, node_id>
+{
+	if(id == no_node)
+		return std::make_pair(no_node, no_node);
+	const auto& item = get_links(id, which);
+	const size_t left_size = subtree_size(item.left, which);
+	if(count <= left_size) {
+		auto parts = split(item.left, which, count);
+		set_left(id, which, parts.second);
+		update(id, which);
+		return std::make_pair(parts.first, id);
+	}
+	else {
+		auto parts = split(item.right, which, count - left_size - 1);
+		set_right(id, which, parts.first);
+		update(id, which);
+		return std::make_pair(id, parts.second);
+	}
+}
+
+auto song_tree::merge(node_id lhs, node_id rhs, sequence which) -> node_id
+{
+	if(lhs == no_node)
+		return rhs;
+	if(rhs == no_node)
+		return lhs;
+	if(m_nodes[lhs].priority > m_nodes[rhs].priority) {
+		set_right(lhs, which, merge(get_links(lhs, which).right, rhs, which));
+		update(lhs, which);
+		return lhs;
+	}
+	else {
+		set_left(rhs, which, merge(lhs, get_links(rhs, which).left, which));
+		update(rhs, which);
+		return rhs;
+	}
+}
+
+void song_tree::attach(node_id id, sequence which, size_t position)
+{
+	auto& item = get_links(id, which);
+	item.left = item.right = item.parent = no_node;
+	item.size = 1;
+	auto parts = split(root(which), which, position);
+	auto output = merge(merge(parts.first, id, which), parts.second, which);
+	get_links(output, which).parent = no_node;
+	root(which) = output;
+}
+
+void song_tree::detach(node_id id, sequence which)
+{
+	const size_t index = position(which, id);
+	auto parts = split(root(which), which, index);
+	auto rest = split(parts.second, which, 1);
+	auto output = merge(parts.first, rest.second, which);
+	if(output != no_node)
+		get_links(output, which).parent = no_node;
+	root(which) = output;
+}
@@ -0,0 +1,76 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include "worker_pool.h"
+
+worker_pool::worker_pool(size_t thread_count)
+: m_running(true)
+{
+	for(size_t i = 0; i < std::max<size_t>(thread_count, 1); ++i)
+		m_workers.emplace_back(&worker_pool::worker_loop, this);
+}
+
+worker_pool::~worker_pool()
+{
+	stop();
+}
+
+void worker_pool::stop()
+{
+	{
+		locker_type _(m_mutex);
+		m_running = false;
+		m_tasks.clear();
+		m_condition.notify_all();
+	}
+	for(auto& worker : m_workers) {
+		if(worker.joinable())
+			worker.join();
+	}
+}
+
+void worker_pool::post(task_type task)
+{
+	locker_type _(m_mutex);
+	if(!m_running)
+		return;
+	m_tasks.push_back(std::move(task));
+	m_condition.notify_one();
+}
+
+void worker_pool::worker_loop()
+{
+	locker_type lock(m_mutex);
+	while(true) {
+		while(m_running && m_tasks.empty())
+			m_condition.wait(lock);
+		if(!m_running)
+			break;
+		auto task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+		lock.unlock();
+		try {
+			task();
+		}
+		catch(std::exception& ex) {
+			std::cout << "Error running task: " << ex.what() << std::endl;
+		}
+		lock.lock();
+	}
+}
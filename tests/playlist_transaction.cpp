@@ -0,0 +1,217 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Atomic batches undo their playlist changes by replaying the
+ * transaction's log backwards. Random changes are rolled back and the
+ * playlist should be exactly as it was: same songs, same play order
+ * on both sides of the current one, same version and change log.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include "playlist.h"
+
+constexpr size_t rounds = 200;
+constexpr size_t changes_per_round = 40;
+
+static size_t failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+	if(!condition) {
+		std::cout << "[-] " << what << std::endl;
+		++failures;
+	}
+}
+
+struct state {
+	std::vector<std::string> listed;
+	// The songs reached by going back from the current one and the ones 
+	// coming after it
+	std::vector<std::string> played_before;
+	std::vector<std::string> played_after;
+	int current;
+	playlist::version_type version;
+	std::vector<playlist::change_ptr> changes;
+	playlist::mode order;
+
+	bool operator==(const state& other) const
+	{
+		return listed == other.listed && played_before == other.played_before &&
+			played_after == other.played_after && current == other.current &&
+			version == other.version && changes == other.changes &&
+			order == other.order;
+	}
+};
+
+static std::vector<std::string> to_strings(const std::vector<song>& songs)
+{
+	std::vector<std::string> output;
+	for(const auto& item : songs)
+		output.push_back(item.to_string());
+	return output;
+}
+
+static state capture(playlist& songs)
+{
+	state output;
+	output.listed = to_strings(
+		playlist::build_snapshot(songs.prepare_snapshot(nullptr))->songs
+	);
+	output.played_after = to_strings(songs.upcoming(songs.song_count()));
+	output.current = songs.current_index();
+	output.version = songs.version();
+	const auto kept = std::min<playlist::version_type>(output.version, playlist::max_changes);
+	check(songs.changes_since(output.version - kept, output.changes), 
+		"The change log lost some changes");
+	output.order = songs.playlist_mode();
+	// Walking back is undone by a transaction of its own
+	playlist::transaction walk(songs);
+	for(size_t i = 0; i < songs.song_count(); ++i) {
+		songs.prev();
+		output.played_before.push_back(songs.current().to_string());
+	}
+	return output;
+}
+
+static std::vector<song> make_songs(std::mt19937& generator, size_t& next_id)
+{
+	std::vector<song> output(generator() % 4 + 1);
+	for(auto& item : output)
+		item = song("song" + std::to_string(next_id++));
+	return output;
+}
+
+static void random_change(playlist& songs, std::mt19937& generator, size_t& next_id)
+{
+	const size_t count = songs.song_count();
+	const auto pick = generator() % 100;
+	if(pick < 25 || count == 0) {
+		songs.add_songs(make_songs(generator, next_id));
+	}
+	else if(pick < 45) {
+		songs.insert_songs(generator() % (count + 1), make_songs(generator, next_id));
+	}
+	else if(pick < 60) {
+		std::vector<size_t> indexes;
+		for(size_t i = 0; i < count; ++i) {
+			if(generator() % 5 == 0)
+				indexes.push_back(i);
+		}
+		songs.delete_songs(indexes);
+	}
+	else if(pick < 80) {
+		songs.move_song(generator() % count, generator() % count);
+	}
+	else if(pick < 88) {
+		songs.set_current_index(generator() % count);
+	}
+	else if(pick < 93) {
+		songs.next();
+	}
+	else if(pick < 96) {
+		songs.playlist_mode(
+			generator() % 2 ? playlist::mode::random_order : playlist::mode::default_order
+		);
+	}
+	else if(pick < 98) {
+		songs.prepare_snapshot(nullptr);
+	}
+	else {
+		songs.clear();
+	}
+}
+
+static void test_rollback_restores_everything()
+{
+	std::mt19937 generator(1);
+	size_t next_id = 0;
+	playlist songs;
+	for(size_t round = 0; round < rounds; ++round) {
+		auto before = capture(songs);
+		{
+			playlist::transaction changes(songs);
+			for(size_t i = 0; i < changes_per_round; ++i)
+				random_change(songs, generator, next_id);
+		}
+		check(capture(songs) == before, "Round " + std::to_string(round) +
+			" wasn't fully rolled back");
+		// Keep some of the changes so the next rounds start elsewhere
+		playlist::transaction changes(songs);
+		for(size_t i = 0; i < changes_per_round / 4; ++i)
+			random_change(songs, generator, next_id);
+		changes.commit();
+	}
+}
+
+// Dropping old changes and rebuilding the base snapshot is undone too
+static void test_rollback_past_max_changes()
+{
+	playlist songs;
+	songs.add_songs({ song("first") });
+	auto before = capture(songs);
+	{
+		playlist::transaction changes(songs);
+		for(size_t i = 0; i < playlist::max_changes + 10; ++i)
+			songs.add_songs({ song("song" + std::to_string(i)) });
+	}
+	check(capture(songs) == before, "Rolling back more than max_changes changes failed");
+	auto snapshot = playlist::build_snapshot(songs.prepare_snapshot(nullptr));
+	check(snapshot->version == songs.version() && snapshot->songs.size() == 1,
+		"The base snapshot wasn't rolled back");
+}
+
+static void test_commit_keeps_changes()
+{
+	playlist songs;
+	{
+		playlist::transaction changes(songs);
+		songs.add_songs({ song("a"), song("b") });
+		{
+			playlist::transaction nested(songs);
+			songs.move_song(0, 1);
+			nested.commit();
+		}
+		changes.commit();
+	}
+	check(songs.song_count() == 2 && songs.version() == 2, "Committed changes were undone");
+	// A committed nested transaction is still undone by the outer one
+	auto before = capture(songs);
+	{
+		playlist::transaction changes(songs);
+		{
+			playlist::transaction nested(songs);
+			songs.clear();
+			nested.commit();
+		}
+	}
+	check(capture(songs) == before, "A nested transaction survived its outer rollback");
+}
+
+int main()
+{
+	test_rollback_restores_everything();
+	test_rollback_past_max_changes();
+	test_commit_keeps_changes();
+	if(failures == 0)
+		std::cout << "[+] playlist_transaction" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Checks that every side of the decode buffer can be woken up. While 
+ * playback is paused or stopped nothing drains the buffer, so the decode 
+ * thread stays parked on it until core::stop interrupts it.
+ */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <future>
+#include <chrono>
+#include <thread>
+#include "ring_buffer.h"
+
+using buffer_type = spsc_ring_buffer<short>;
+
+// Only reached if something never wakes up
+constexpr std::chrono::seconds timeout(5);
+constexpr size_t capacity = 1024;
+
+static size_t failures = 0;
+
+static void check(bool condition, const std::string& what)
+{
+	if(!condition) {
+		std::cout << "[-] " << what << std::endl;
+		++failures;
+	}
+}
+
+// Writes until the buffer gives up, like the decoders do
+static size_t produce(buffer_type& buffer)
+{
+	std::vector<short> chunk(256, 1);
+	size_t written = 0;
+	while(buffer.put(chunk.begin(), chunk.end()))
+		written += chunk.size();
+	return written;
+}
+
+static void test_interrupt_wakes_parked_producer()
+{
+	buffer_type buffer(capacity);
+	auto producer = std::async(std::launch::async, [&]() { return produce(buffer); });
+	// Nothing drains it, so the producer fills it up and parks
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+	while(buffer.size() != buffer.capacity() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::yield();
+	check(buffer.size() == buffer.capacity(), "The buffer never filled up");
+	check(producer.wait_for(std::chrono::seconds(0)) == std::future_status::timeout,
+		"The producer didn't block on a full buffer");
+	// What core::stop does before stopping the decoder
+	buffer.interrupt();
+	check(producer.wait_for(timeout) == std::future_status::ready, 
+		"Interrupting didn't wake up the producer");
+	check(producer.get() == capacity, "The producer wrote more than it had room for");
+
+	// Once the producer is gone, reset makes the buffer usable again
+	buffer.reset();
+	buffer.clear();
+	std::vector<short> samples(16, 2), output(16);
+	check(buffer.put(samples.begin(), samples.end()), "Putting after a reset failed");
+	check(buffer.get(output.begin(), output.size()) == output.size() && output == samples, 
+		"Reading after a reset failed");
+}
+
+static void test_interrupt_while_waiting_for_space()
+{
+	// The producer can be interrupted before it gets to park, too
+	buffer_type buffer(capacity);
+	buffer.interrupt();
+	check(produce(buffer) == 0, "An interrupted buffer accepted samples");
+}
+
+static void test_consumer_wakes_up()
+{
+	for(bool close : { true, false }) {
+		buffer_type buffer(capacity);
+		auto consumer = std::async(std::launch::async, [&]() { return buffer.wait_for_data(); });
+		if(close)
+			buffer.close();
+		else
+			buffer.interrupt();
+		check(consumer.wait_for(timeout) == std::future_status::ready, 
+			close ? "Closing didn't wake up the consumer" : 
+			"Interrupting didn't wake up the consumer");
+		check(!consumer.get(), "An empty buffer reported data");
+	}
+	// Data that's already there is still read after closing
+	buffer_type buffer(capacity);
+	std::vector<short> samples(8, 3);
+	buffer.put(samples.begin(), samples.end());
+	buffer.close();
+	check(buffer.wait_for_data(), "Closing dropped the remaining data");
+}
+
+int main()
+{
+	test_interrupt_wakes_parked_producer();
+	test_interrupt_while_waiting_for_space();
+	test_consumer_wakes_up();
+	if(failures == 0)
+		std::cout << "[+] ring_buffer" << std::endl;
+	return failures == 0 ? 0 : 1;
+}